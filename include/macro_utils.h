@@ -68,6 +68,14 @@ typedef __le64 wtfs64_t;
 	test_bit((nr), (const volatile unsigned long *)(addr))
 #define wtfs_find_first_zero_bit(addr, size)\
 	find_first_zero_bit((const unsigned long *)(addr), (size))
+#define wtfs_find_next_zero_bit(addr, size, offset)\
+	find_next_zero_bit((const unsigned long *)(addr), (size), (offset))
+#define wtfs_find_next_bit(addr, size, offset)\
+	find_next_bit((const unsigned long *)(addr), (size), (offset))
+#define wtfs_bitmap_weight(addr, size)\
+	bitmap_weight((const unsigned long *)(addr), (size))
+#define wtfs_bitmap_set(addr, start, len)\
+	bitmap_set((unsigned long *)(addr), (start), (len))
 
 /* int comparators */
 #define wtfs_min(a, b) min((uint64_t)(a), (uint64_t)(b))
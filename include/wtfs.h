@@ -34,8 +34,8 @@
  * version of wtfs
  * we may evolve several versions of it
  */
-#define WTFS_VERSION 0x0006
-#define WTFS_VERSION_STR "0.6.0-alpha.1"
+#define WTFS_VERSION 0x0007
+#define WTFS_VERSION_STR "0.7.0-alpha.1"
 
 /* version control */
 #define WTFS_VERSION_MAJOR(v) ((v) >> 8)
@@ -44,7 +44,7 @@
 #define WTFS_GET_VERSION(major, minor, patch) (((major) << 8) | (minor))
 
 /*
- * version 0.6.0 physical disk layout:
+ * version 0.7.0 physical disk layout:
  *   +------------------+
  * 0 | boot loader      |
  *   +------------------+
@@ -59,10 +59,28 @@
  * 5 | data blocks...   |
  *   +------------------+
  *
+ * with WTFS_FEATURE_CONTIG_META, all inode tables are one run of blocks from
+ * block 2, followed by all block bitmaps, all inode bitmaps and the root
+ * directory, so that each is found by arithmetic; the chains are still linked
+ *
+ * with WTFS_FEATURE_LAZY_ITABLE, which needs WTFS_FEATURE_CONTIG_META, only
+ * inode tables before inode_table_inited are known to be initialized, the
+ * rest are zeroed by the kernel when first used or in the background
+ *
+ * with WTFS_FEATURE_JOURNAL, a run of journal blocks follows the last bitmap
+ * and data blocks start behind it
+ *
+ * with WTFS_FEATURE_FAST_SYMLINK, short symlink targets are kept in an extended
+ * inode record, i.e. an inode slot of its own, instead of a symlink block
+ *
  * -- filesystem overall information --
  * supported file types:		regular file, directory, symbolic link
  * label supported:			yes
  * UUID supported:			yes
+ * metadata journal:			optional, jbd2
+ * contiguous metadata:			optional
+ * lazy inode table initialization:	optional
+ * fast symlinks:			optional
  *
  * -- block information --
  * size of each block:			4096 bytes
@@ -79,11 +97,26 @@
  * max dentries per block:		63
  * max size of file name:		56 bytes
  *
+ * -- directory index information --
+ * index block of directory:		pointed by its first block
+ * buckets per index block:		512
+ *
+ * -- extent block information --
+ * first block of regular file:		extent block
+ * size of each extent:			16 bytes
+ * max extents per block:		254
+ * last extent block:			pointed by the first one
+ *
  * -- data block information --
- * size of real data in each block:	4088 bytes
+ * size of real data in each block:	4096 bytes
  *
  * -- symlink block information --
  * max size of symlink content:		4094 bytes
+ *
+ * -- extended inode record information --
+ * size of each record:			64 bytes
+ * max size of fast symlink content:	55 bytes
+ * record of fast symlink:		pointed by its first block
  */
 
 /*
@@ -107,9 +140,33 @@
 /* max dentry count per block in wtfs */
 #define WTFS_DENTRY_COUNT_PER_BLOCK 63
 
+/* max extent count per block in wtfs */
+#define WTFS_EXTENT_COUNT_PER_BLOCK 254
+
+/* buckets per directory index block */
+#define WTFS_DIR_INDEX_BUCKETS 512
+
+/* full directory blocks a directory has before it is indexed */
+#define WTFS_DIR_INDEX_MIN_BLOCKS 4
+
+/* max length of an extent in blocks */
+#define WTFS_EXTENT_MAX_LENGTH 0x7fffffffU
+
+/* max logical block index of a file, limited by the iblock of an extent */
+#define WTFS_MAX_IBLOCK 0xffffffffULL
+
+/* max size of a file in bytes */
+#define WTFS_MAX_FILE_SIZE ((WTFS_MAX_IBLOCK + 1) * WTFS_BLOCK_SIZE - 1)
+
+/* flag in the length of an extent preallocated but not written yet */
+#define WTFS_EXTENT_UNWRITTEN 0x80000000U
+
 /* max length of symlink content in wtfs */
 #define WTFS_SYMLINK_MAX 4094
 
+/* max length of symlink content kept in an extended inode record */
+#define WTFS_FAST_SYMLINK_MAX 56
+
 /* max length of filesystem label in wtfs */
 #define WTFS_LABEL_MAX 32
 
@@ -119,8 +176,11 @@
 /* size of bitmap data in bytes */
 #define WTFS_BITMAP_SIZE WTFS_LNKBLK_SIZE
 
-/* size of real data that each data block can contain */
-#define WTFS_DATA_SIZE WTFS_LNKBLK_SIZE
+/*
+ * size of real data that each data block can contain
+ * since 0.7.0 data blocks are mapped by extents, so no pointer is needed
+ */
+#define WTFS_DATA_SIZE WTFS_BLOCK_SIZE
 
 /* reserved block indices */
 #define WTFS_RB_BOOT		0 /* boot loader block */
@@ -135,6 +195,25 @@
 /* inode number of root directory */
 #define WTFS_ROOT_INO 1
 
+/* features of a filesystem, recorded in the super block */
+#define WTFS_FEATURE_JOURNAL	0x0001 /* metadata changes are journaled */
+#define WTFS_FEATURE_CONTIG_META 0x0002 /* each metadata chain contiguous */
+#define WTFS_FEATURE_LAZY_ITABLE 0x0004 /* inode tables zeroed after mkfs */
+#define WTFS_FEATURE_FAST_SYMLINK 0x0008 /* short symlinks without a block */
+
+/* all features this version of wtfs knows */
+#define WTFS_FEATURE_ALL	(WTFS_FEATURE_JOURNAL | \
+				 WTFS_FEATURE_CONTIG_META | \
+				 WTFS_FEATURE_LAZY_ITABLE | \
+				 WTFS_FEATURE_FAST_SYMLINK)
+
+/* least size of the journal in blocks */
+#define WTFS_JOURNAL_MIN_BLOCKS	4096
+
+/* super block states */
+#define WTFS_STATE_CLEAN	0 /* cleanly unmounted or never mounted */
+#define WTFS_STATE_DIRTY	1 /* mounted, counters may be stale on disk */
+
 /* DEBUG macro for wtfs */
 #ifdef DEBUG
 # define WTFS_DEBUG 1
@@ -183,7 +262,15 @@ struct wtfs_super_block
 	char label[WTFS_LABEL_MAX];	/* 32 bytes */
 	unsigned char uuid[16];		/* 16 bytes */
 
-	wtfs8_t padding[3952];		/* 3952 bytes */
+	wtfs64_t state;			/* 8 bytes */
+
+	wtfs64_t features;		/* 8 bytes */
+	wtfs64_t journal_first;		/* 8 bytes */
+	wtfs64_t journal_count;		/* 8 bytes */
+
+	wtfs64_t inode_table_inited;	/* 8 bytes */
+
+	wtfs8_t padding[3912];		/* 3912 bytes */
 };
 
 /* model of linked block */
@@ -212,6 +299,17 @@ struct wtfs_inode
 	wtfs16_t gid;		/* 2 bytes */
 };
 
+/*
+ * structure for extended inode record, taking an inode slot to hold the
+ * target of a fast symlink, which has no block and points to the record by
+ * its first_block
+ */
+struct wtfs_symlink_inode
+{
+	wtfs64_t owner;				/* 8 bytes */
+	char path[WTFS_FAST_SYMLINK_MAX];	/* 56 bytes */
+};
+
 /* structure for inode table */
 struct wtfs_inode_table
 {
@@ -244,15 +342,47 @@ struct wtfs_dir_block
 	[
 		WTFS_DENTRY_COUNT_PER_BLOCK
 	];
-	wtfs8_t padding[56];		/* 56 bytes */
+	wtfs64_t index;			/* 8 bytes, first block only */
+	wtfs64_t hash_next;		/* 8 bytes */
+	wtfs64_t tail;			/* 8 bytes, first block only */
+	wtfs8_t padding[32];		/* 32 bytes */
+	wtfs64_t next;			/* 8 bytes */
+};
+
+/* structure for directory index block */
+struct wtfs_dir_index_block
+{
+	wtfs64_t buckets		/* 4096 bytes */
+	[
+		WTFS_DIR_INDEX_BUCKETS
+	];
+};
+
+/* structure for extent */
+struct wtfs_extent
+{
+	wtfs32_t iblock;	/* 4 bytes */
+	wtfs32_t length;	/* 4 bytes */
+	wtfs64_t start;		/* 8 bytes */
+};
+
+/* structure for extent block */
+struct wtfs_extent_block
+{
+	struct wtfs_extent extents	/* 4064 bytes */
+	[
+		WTFS_EXTENT_COUNT_PER_BLOCK
+	];
+	wtfs64_t count;			/* 8 bytes */
+	wtfs64_t last;			/* 8 bytes, first block only */
+	wtfs8_t padding[8];		/* 8 bytes */
 	wtfs64_t next;			/* 8 bytes */
 };
 
 /* structure for data block */
 struct wtfs_data_block
 {
-	wtfs8_t data[WTFS_DATA_SIZE];	/* 4088 bytes */
-	wtfs64_t next;			/* 8 bytes */
+	wtfs8_t data[WTFS_DATA_SIZE];	/* 4096 bytes */
 };
 
 /* structure for symlink block */
@@ -265,6 +395,39 @@ struct wtfs_symlink_block
 /* following only available for module itself */
 #ifdef __KERNEL__
 
+#include <linux/percpu.h>
+#include <linux/percpu_counter.h>
+#include <linux/rbtree.h>
+#include <linux/shrinker.h>
+#include <linux/jbd2.h>
+#include <linux/workqueue.h>
+
+/* mount options */
+#define WTFS_OPT_PIN_BITMAPS	0x0001 /* keep bitmap blocks in memory */
+#define WTFS_OPT_DIR_INDEX	0x0002 /* index large directories */
+
+/* sizes in blocks of reservation windows, growing as a file is streamed */
+#define WTFS_RSV_MIN 8
+#define WTFS_RSV_MAX 1024
+
+/* max pages whose delayed blocks are allocated together at writeback */
+#define WTFS_DELALLOC_BATCH 64
+
+/* journal credits, i.e. the most metadata blocks a handle may dirty */
+#define WTFS_JOURNAL_CREDITS	64 /* a namespace operation */
+#define WTFS_JOURNAL_MAP_CREDITS 8 /* an allocation by wtfs_map_block */
+
+/* flags for wtfs_map_block */
+#define WTFS_MAP_CREATE		0x0001 /* allocate a block for a hole */
+#define WTFS_MAP_UNWRITTEN	0x0002 /* allocate it as unwritten */
+#define WTFS_MAP_CONVERT	0x0004 /* convert an unwritten block */
+
+/* length and flags of an on-disk extent */
+#define WTFS_EXTENT_LENGTH(ext) \
+	(wtfs32_to_cpu((ext)->length) & WTFS_EXTENT_MAX_LENGTH)
+#define WTFS_EXTENT_FLAGS(ext) \
+	(wtfs32_to_cpu((ext)->length) & WTFS_EXTENT_UNWRITTEN)
+
 /* structure for super block in memory */
 struct wtfs_sb_info
 {
@@ -280,8 +443,124 @@ struct wtfs_sb_info
 	uint64_t inode_bitmap_first;
 	uint64_t inode_bitmap_count;
 
-	uint64_t inode_count;
-	uint64_t free_block_count;
+	/* kept in memory and only folded into the super block on sync */
+	struct percpu_counter inode_count;
+	struct percpu_counter free_block_count;
+	uint64_t state;
+
+	/* features from the super block */
+	uint64_t features;
+
+	/* the journal, NULL if metadata changes are not journaled */
+	uint64_t journal_first;
+	uint64_t journal_count;
+	journal_t * journal;
+
+	/*
+	 * a block bitmap merged with its last committed version, one per CPU
+	 * as it is used under the spinlock of a group
+	 */
+	void __percpu * journal_scan;
+
+	/*
+	 * with WTFS_FEATURE_LAZY_ITABLE, inode tables before inode_table_inited
+	 * are zeroed or in use on disk, and one bit per table tells if it is
+	 * initialized in memory or on disk; the thread zeroing the rest and
+	 * everyone initializing a table hold itable_mutex
+	 */
+	uint64_t inode_table_inited;
+	unsigned long * inode_table_ready;
+	struct mutex itable_mutex;
+	struct task_struct * itable_thread;
+
+	/* blocks promised to buffered writes but not allocated yet */
+	struct percpu_counter delayed_block_count;
+
+	/*
+	 * block numbers of all inode tables, built at mount, NULL with
+	 * WTFS_FEATURE_CONTIG_META as they are found by arithmetic
+	 */
+	uint64_t * inode_table_index;
+
+	/* block numbers of all block/inode bitmaps, likewise */
+	uint64_t * block_bitmap_index;
+	uint64_t * inode_bitmap_index;
+
+	/* pinned buffer_heads of bitmaps, only with WTFS_OPT_PIN_BITMAPS */
+	struct buffer_head ** block_bitmap_bh;
+	struct buffer_head ** inode_bitmap_bh;
+
+	/* allocation groups, one per block/inode bitmap, set up at mount */
+	struct wtfs_group * block_groups;
+	struct wtfs_group * inode_groups;
+
+	/* one bit per block/inode bitmap dirtied since the last fsync */
+	unsigned long * block_bitmap_dirty;
+	unsigned long * inode_bitmap_dirty;
+
+	/*
+	 * next-fit cursors, where the last block/inode was allocated; blocks
+	 * have one per CPU, spread over the groups at mount, so that writers
+	 * on different CPUs start in different groups
+	 */
+	uint64_t __percpu * block_alloc_rotor;
+	uint64_t inode_alloc_rotor;
+
+	/*
+	 * reservation windows of all files, sorted by their first block, and
+	 * guarded by rsv_lock, which nests inside the lock of a group
+	 */
+	spinlock_t rsv_lock;
+	struct rb_root rsv_root;
+	uint64_t rsv_count;
+	uint64_t rsv_blocks;
+	struct shrinker rsv_shrinker;
+
+	/*
+	 * buffers written to unwritten blocks, linked by their b_private and
+	 * guarded by unwritten_lock, whose writeback ends once unwritten_work
+	 * has converted the blocks
+	 */
+	spinlock_t unwritten_lock;
+	struct buffer_head * unwritten_list;
+	struct work_struct unwritten_work;
+
+	/* mount options */
+	unsigned long options;
+};
+
+/*
+ * allocation group, the blocks or inodes of one bitmap
+ *
+ * the lock guards the bits of the bitmap and the free count, and is only held
+ * while they are searched and changed; the bitmap is read and journaled
+ * before, so that allocations in different groups never wait for each other
+ * and ones in the same group never wait for I/O
+ */
+struct wtfs_group
+{
+	spinlock_t lock;
+	uint64_t free;		/* free bits, counted at mount */
+};
+
+/*
+ * free blocks reserved in memory for a file to allocate from, so that files
+ * appended at the same time do not interleave their blocks
+ */
+struct wtfs_rsv_window
+{
+	struct rb_node node;	/* in rsv_root of sb_info, empty if unused */
+	uint64_t start;		/* the first block still reserved */
+	uint64_t end;		/* the block behind the last one reserved */
+	uint64_t size;		/* size of the next window */
+};
+
+/* location of the dentry naming an inode in its parent directory */
+struct wtfs_dentry_loc
+{
+	uint64_t blk_no;	/* 0 if unknown */
+	uint64_t gen;		/* dir_gen of the parent when recorded */
+	int slot;
 };
 
 /* structure for inode in memory */
@@ -289,6 +568,30 @@ struct wtfs_inode_info
 {
 	uint64_t dir_entry_count;
 	uint64_t first_block;
+
+	/* where this inode is named, set by lookup and when added */
+	struct wtfs_dentry_loc loc;
+
+	/* bumped whenever entries of this directory are moved */
+	uint64_t dir_gen;
+
+	/* last extent block of regular files, 0 if not known yet */
+	uint64_t last_block;
+
+	/* extents of regular files looked up so far, sorted by iblock */
+	struct rb_root extent_cache;
+	uint64_t extent_cache_count;
+
+	/* serializes extent changes of regular files */
+	struct mutex extent_mutex;
+
+	/* where appends of regular files allocate from */
+	struct wtfs_rsv_window rsv;
+
+	/* transactions to commit for fsync and fdatasync */
+	tid_t sync_tid;
+	tid_t datasync_tid;
+
 	struct inode vfs_inode;
 };
 
@@ -298,12 +601,40 @@ static inline struct wtfs_sb_info * WTFS_SB_INFO(struct super_block * vsb)
 	return (struct wtfs_sb_info *)vsb->s_fs_info;
 }
 
+/*
+ * get the block number of the count-th block of a metadata chain
+ *
+ * @index: index of the chain built at mount, NULL if it is contiguous
+ * @first: block number of the first block
+ * @count: position in the chain
+ *
+ * return: the block number
+ */
+static inline uint64_t wtfs_meta_block(const uint64_t * index,
+	uint64_t first, uint64_t count)
+{
+	return index != NULL ? index[count] : first + count;
+}
+
 /* get inode_info from the VFS inode */
 static inline struct wtfs_inode_info * WTFS_INODE_INFO(struct inode * vi)
 {
 	return container_of(vi, struct wtfs_inode_info, vfs_inode);
 }
 
+/*
+ * check if an inode is a fast symlink, whose first block is the inode number
+ * of its extended inode record
+ *
+ * @vi: the VFS inode
+ *
+ * return: 1 if so, 0 otherwise
+ */
+static inline int wtfs_is_fast_symlink(struct inode * vi)
+{
+	return S_ISLNK(vi->i_mode) && vi->i_blocks == 0;
+}
+
 /* operations */
 extern const struct super_operations wtfs_super_ops;
 extern const struct inode_operations wtfs_file_inops;
@@ -311,6 +642,7 @@ extern const struct inode_operations wtfs_dir_inops;
 extern const struct inode_operations wtfs_symlink_inops;
 extern const struct file_operations wtfs_file_ops;
 extern const struct file_operations wtfs_dir_ops;
+extern const struct address_space_operations wtfs_aops;
 
 /* helper functions */
 extern struct inode * wtfs_iget(struct super_block * vsb, uint64_t inode_no);
@@ -319,29 +651,96 @@ extern struct wtfs_inode * wtfs_get_inode(struct super_block * vsb,
 extern int is_ino_valid(struct super_block * vsb, uint64_t inode_no);
 extern struct buffer_head * wtfs_get_linked_block(struct super_block * vsb,
 	uint64_t entry, uint64_t count, uint64_t * blk_no);
+extern uint64_t * wtfs_build_linked_index(struct super_block * vsb,
+	uint64_t entry, uint64_t count);
 extern struct buffer_head * wtfs_get_last_linked_block(struct super_block * vsb,
 	uint64_t entry, uint64_t * count, uint64_t * blk_no);
-extern int wtfs_set_bitmap_bit(struct super_block * vsb, uint64_t entry,
-	uint64_t count, uint64_t offset);
-extern int wtfs_clear_bitmap_bit(struct super_block * vsb, uint64_t entry,
-	uint64_t count, uint64_t offset);
+extern struct buffer_head * wtfs_get_bitmap_block(struct super_block * vsb,
+	uint64_t entry, uint64_t count);
 extern int wtfs_test_bitmap_bit(struct super_block * vsb, uint64_t entry,
 	uint64_t count, uint64_t offset);
 extern struct buffer_head * wtfs_init_linked_block(struct super_block * vsb,
 	uint64_t blk_no, struct buffer_head * prev);
 extern uint64_t wtfs_alloc_block(struct super_block * vsb);
-extern uint64_t wtfs_alloc_free_inode(struct super_block * vsb);
+extern uint64_t wtfs_alloc_blocks(struct super_block * vsb, uint64_t goal,
+	uint64_t min, uint64_t max, uint64_t * count);
+extern uint64_t wtfs_alloc_blocks_rsv(struct inode * vi, uint64_t goal,
+	uint64_t max, uint64_t * count);
+extern void wtfs_rsv_release(struct inode * vi);
+extern uint64_t wtfs_rsv_drop(struct wtfs_sb_info * sbi, uint64_t nr);
+extern int wtfs_reserve_delayed(struct super_block * vsb, uint64_t n);
+extern void wtfs_release_delayed(struct super_block * vsb, uint64_t n);
+extern uint64_t wtfs_alloc_free_inode(struct super_block * vsb,
+	uint64_t goal);
 extern struct inode * wtfs_new_inode(struct inode * dir_vi, umode_t mode,
 	const char * path, size_t length);
 extern void wtfs_free_block(struct super_block * vsb, uint64_t blk_no);
 extern void wtfs_free_inode(struct super_block * vsb, uint64_t inode_no);
 extern int wtfs_sync_super(struct super_block * vsb, int wait);
-extern uint64_t wtfs_find_inode(struct inode * dir_vi, struct dentry * dentry);
+extern int wtfs_sync_bitmaps(struct super_block * vsb);
+extern uint64_t wtfs_find_inode(struct inode * dir_vi, struct dentry * dentry,
+	struct wtfs_dentry_loc * loc);
 extern int wtfs_add_entry(struct inode * dir_vi, uint64_t inode_no,
-	const char * filename, size_t length);
-extern int wtfs_delete_entry(struct inode * dir_vi, uint64_t inode_no);
+	const char * filename, size_t length, struct wtfs_dentry_loc * loc);
+extern int wtfs_delete_entry(struct inode * dir_vi, struct dentry * dentry);
+extern int wtfs_replace_entry(struct inode * dir_vi, struct dentry * dentry,
+	struct inode * vi);
 extern void wtfs_delete_inode(struct inode * vi);
 
+/* extent functions */
+extern int wtfs_map_block(struct inode * vi, uint64_t iblock, int create,
+	uint64_t * blk_no, uint64_t * length);
+extern int wtfs_truncate_extents(struct inode * vi, uint64_t iblock);
+extern int wtfs_punch_range(struct inode * vi, uint64_t from, uint64_t to);
+extern int wtfs_convert_range(struct inode * vi, uint64_t iblock,
+	uint64_t count);
+extern int wtfs_punch_extents(struct inode * vi, uint64_t from, uint64_t to);
+extern void wtfs_drop_extent_cache(struct inode * vi);
+extern int wtfs_create_extent_cache(void);
+extern void wtfs_destroy_extent_cache(void);
+
+/* directory index functions */
+extern struct buffer_head * wtfs_find_entry(struct inode * dir_vi,
+	const char * filename, size_t length, int * slot);
+extern int wtfs_index_add_entry(struct inode * dir_vi,
+	struct buffer_head * first_bh, uint64_t inode_no,
+	const char * filename, size_t length, struct wtfs_dentry_loc * loc);
+extern int wtfs_build_dir_index(struct inode * dir_vi,
+	struct buffer_head * first_bh);
+extern void wtfs_free_dir_index(struct inode * dir_vi);
+
+/* journal functions */
+extern int wtfs_load_journal(struct super_block * vsb);
+extern void wtfs_destroy_journal(struct wtfs_sb_info * sbi);
+extern handle_t * wtfs_journal_start(struct super_block * vsb, int nblocks);
+extern int wtfs_journal_stop(handle_t * handle);
+extern int wtfs_journal_extend(struct super_block * vsb, int nblocks);
+extern int wtfs_journal_restart(struct super_block * vsb, int nblocks);
+extern int wtfs_journal_access(struct super_block * vsb,
+	struct buffer_head * bh);
+extern int wtfs_journal_undo_access(struct super_block * vsb,
+	struct buffer_head * bh);
+extern void wtfs_journal_dirty(struct super_block * vsb, struct inode * vi,
+	struct buffer_head * bh);
+extern void wtfs_journal_dirty_inode(struct inode * vi,
+	struct buffer_head * bh, int datasync);
+extern void wtfs_journal_forget(struct super_block * vsb, uint64_t blk_no);
+extern void * wtfs_journal_bitmap(struct super_block * vsb,
+	struct buffer_head * bh);
+extern int wtfs_journal_sync_inode(struct inode * vi, int datasync);
+extern int wtfs_journal_commit(struct super_block * vsb, int wait);
+extern int wtfs_journal_flush(struct super_block * vsb);
+
+/* lazy inode table functions */
+extern int wtfs_init_inode_table(struct super_block * vsb, uint64_t inode_no);
+extern int wtfs_scan_inode_tables(struct super_block * vsb);
+extern void wtfs_start_itable_thread(struct super_block * vsb);
+extern void wtfs_stop_itable_thread(struct wtfs_sb_info * sbi);
+
+/* file functions */
+extern int wtfs_truncate(struct inode * vi, loff_t size);
+extern void wtfs_end_unwritten(struct work_struct * work);
+
 #endif /* __KERNEL__ */
 
 #endif /* WTFS_H_ */
@@ -0,0 +1,449 @@
+/*
+ * dir_index.c - implementation of wtfs hashed directory index.
+ *
+ * Copyright (C) 2015 Chaos Shen
+ *
+ * This file is part of wtfs, What the fxck filesystem.  You may take
+ * the letter 'f' from, at your option, either 'fxck' or 'filesystem'.
+ *
+ * wtfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * wtfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with wtfs.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <linux/fs.h>
+#include <linux/vfs.h>
+#include <linux/buffer_head.h>
+#include <linux/err.h>
+
+#include "wtfs.h"
+
+/*
+ * A directory is indexed once the index field of its first block points to an
+ * index block.  The index block holds WTFS_DIR_INDEX_BUCKETS bucket heads,
+ * each of which starts a chain of directory blocks linked by their hash_next
+ * field, and every entry but those of the first block, which is never hashed
+ * and always searched first, is in a block on the chain of its bucket.
+ *
+ * A directory is indexed when its WTFS_DIR_INDEX_MIN_BLOCKS blocks are full,
+ * and the blocks behind the first one then end every chain.  Buckets sharing
+ * a head always make a range, and a new block heads the half of the range
+ * holding the bucket it is created for, so chains join towards their ends and
+ * a block is shared by fewer buckets each time one fills up, instead of every
+ * bucket taking a block of its own.
+ *
+ * readdir walks the next chain and uses the position of an entry along it as
+ * the directory offset, so no entry is ever moved, and a new block is always
+ * appended to the next chain at the tail recorded in the first block.
+ */
+
+/* declaration of internal helper functions */
+static uint32_t wtfs_name_hash(const char * filename, size_t length);
+static int wtfs_match_entry(struct wtfs_dentry * entry, const char * filename,
+	size_t length);
+static int __wtfs_index_insert(struct inode * dir_vi,
+	struct buffer_head * first_bh, struct buffer_head * index_bh,
+	uint64_t inode_no, const char * filename, size_t length,
+	struct wtfs_dentry_loc * loc);
+static void wtfs_split_buckets(struct wtfs_dir_index_block * index,
+	uint64_t bucket, uint64_t blk_no);
+
+/********************* implementation of wtfs_find_entry **********************/
+
+/*
+ * find an entry by name in a directory, indexed or not
+ *
+ * @dir_vi: the VFS inode of the directory
+ * @filename: name of the entry
+ * @length: length of name
+ * @slot: place to store the index of the entry in the returned block
+ *
+ * return: the buffer_head of the block containing the entry, NULL if it is not
+ *         found, error code otherwise
+ *         it must be released outside after this function being called
+ */
+struct buffer_head * wtfs_find_entry(struct inode * dir_vi,
+	const char * filename, size_t length, int * slot)
+{
+	struct super_block * vsb = dir_vi->i_sb;
+	struct wtfs_inode_info * info = WTFS_INODE_INFO(dir_vi);
+	struct wtfs_dir_block * blk = NULL;
+	struct wtfs_dir_index_block * index = NULL;
+	struct buffer_head * bh = NULL;
+	uint64_t next = info->first_block, index_no = 0;
+	int hashed = 0;
+	int i;
+
+	while (next != 0) {
+		if ((bh = sb_bread(vsb, next)) == NULL) {
+			wtfs_error("unable to read the block %llu\n", next);
+			return ERR_PTR(-EIO);
+		}
+		blk = (struct wtfs_dir_block *)bh->b_data;
+		for (i = 0; i < WTFS_DENTRY_COUNT_PER_BLOCK; ++i) {
+			if (wtfs_match_entry(&(blk->entries[i]), filename,
+				length)) {
+				*slot = i;
+				return bh;
+			}
+		}
+
+		/* after the first block, go to the bucket if indexed */
+		if (next == info->first_block) {
+			index_no = wtfs64_to_cpu(blk->index);
+		}
+		if (next == info->first_block && index_no != 0) {
+			brelse(bh);
+			if ((bh = sb_bread(vsb, index_no)) == NULL) {
+				wtfs_error("unable to read the block %llu\n",
+					index_no);
+				return ERR_PTR(-EIO);
+			}
+			index = (struct wtfs_dir_index_block *)bh->b_data;
+			next = wtfs64_to_cpu(index->buckets[
+				wtfs_name_hash(filename, length) %
+				WTFS_DIR_INDEX_BUCKETS]);
+			hashed = 1;
+		} else if (hashed) {
+			next = wtfs64_to_cpu(blk->hash_next);
+		} else {
+			next = wtfs64_to_cpu(blk->next);
+		}
+		brelse(bh);
+	}
+	return NULL;
+}
+
+/*
+ * internal function used to check if a dentry has the specified name
+ *
+ * @entry: the dentry
+ * @filename: name to check
+ * @length: length of name
+ *
+ * return: 1 if matched, 0 otherwise
+ */
+static int wtfs_match_entry(struct wtfs_dentry * entry, const char * filename,
+	size_t length)
+{
+	return entry->inode_no != 0 &&
+		strnlen(entry->filename, WTFS_FILENAME_MAX) == length &&
+		memcmp(entry->filename, filename, length) == 0;
+}
+
+/*
+ * internal function used to hash a file name, this is FNV-1a which is stable
+ * across kernel versions, as the hash is stored on disk implicitly
+ *
+ * @filename: name to hash
+ * @length: length of name
+ *
+ * return: the hash value
+ */
+static uint32_t wtfs_name_hash(const char * filename, size_t length)
+{
+	uint32_t hash = 2166136261U;
+	size_t i;
+
+	for (i = 0; i < length; ++i) {
+		hash ^= (unsigned char)filename[i];
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
+/********************* implementation of wtfs_index_add_entry *****************/
+
+/*
+ * add a new entry to an indexed directory whose first block is full
+ *
+ * @dir_vi: the VFS inode of the directory
+ * @first_bh: buffer_head of the first directory block
+ * @inode_no: inode number of the new entry
+ * @filename: name of the new entry
+ * @length: length of name
+ * @loc: place to store where the entry is, can be NULL
+ *
+ * return: 0 on success, error code otherwise
+ */
+int wtfs_index_add_entry(struct inode * dir_vi, struct buffer_head * first_bh,
+	uint64_t inode_no, const char * filename, size_t length,
+	struct wtfs_dentry_loc * loc)
+{
+	struct wtfs_dir_block * first = NULL;
+	struct buffer_head * index_bh = NULL;
+	uint64_t index_no;
+	int ret;
+
+	first = (struct wtfs_dir_block *)first_bh->b_data;
+	index_no = wtfs64_to_cpu(first->index);
+	if ((index_bh = sb_bread(dir_vi->i_sb, index_no)) == NULL) {
+		wtfs_error("unable to read the block %llu\n", index_no);
+		return -EIO;
+	}
+
+	ret = __wtfs_index_insert(dir_vi, first_bh, index_bh, inode_no,
+		filename, length, loc);
+	brelse(index_bh);
+	return ret;
+}
+
+/*
+ * internal function used to insert an entry into its bucket, a new directory
+ * block is appended to the next chain and put at the head of the bucket if all
+ * blocks on its chain are full
+ *
+ * @dir_vi: the VFS inode of the directory
+ * @first_bh: buffer_head of the first directory block
+ * @index_bh: buffer_head of the index block
+ * @inode_no: inode number of the entry
+ * @filename: name of the entry
+ * @length: length of name
+ * @loc: place to store where the entry is, can be NULL
+ *
+ * return: 0 on success, error code otherwise
+ */
+static int __wtfs_index_insert(struct inode * dir_vi,
+	struct buffer_head * first_bh, struct buffer_head * index_bh,
+	uint64_t inode_no, const char * filename, size_t length,
+	struct wtfs_dentry_loc * loc)
+{
+	struct super_block * vsb = dir_vi->i_sb;
+	struct wtfs_sb_info * sbi = WTFS_SB_INFO(vsb);
+	struct wtfs_dir_block * blk = NULL, * first = NULL;
+	struct wtfs_dir_index_block * index = NULL;
+	struct buffer_head * bh = NULL, * tail_bh = NULL;
+	uint64_t bucket, next, blk_no, tail;
+	int i, ret;
+
+	first = (struct wtfs_dir_block *)first_bh->b_data;
+	index = (struct wtfs_dir_index_block *)index_bh->b_data;
+	bucket = wtfs_name_hash(filename, length) % WTFS_DIR_INDEX_BUCKETS;
+
+	/* find an empty entry on the chain of the bucket */
+	next = wtfs64_to_cpu(index->buckets[bucket]);
+	while (next != 0) {
+		if ((bh = sb_bread(vsb, next)) == NULL) {
+			wtfs_error("unable to read the block %llu\n", next);
+			return -EIO;
+		}
+		blk = (struct wtfs_dir_block *)bh->b_data;
+		for (i = 0; i < WTFS_DENTRY_COUNT_PER_BLOCK; ++i) {
+			if (blk->entries[i].inode_no == 0) {
+				goto found;
+			}
+		}
+		next = wtfs64_to_cpu(blk->hash_next);
+		brelse(bh);
+	}
+
+	/* bucket is full, so we have to append a new directory block */
+	tail = wtfs64_to_cpu(first->tail);
+	if ((tail_bh = sb_bread(vsb, tail)) == NULL) {
+		wtfs_error("unable to read the block %llu\n", tail);
+		return -EIO;
+	}
+	if ((blk_no = wtfs_alloc_blocks(vsb, tail, 1, 1, NULL)) == 0) {
+		brelse(tail_bh);
+		return -ENOSPC;
+	}
+	if ((ret = wtfs_journal_access(vsb, first_bh)) < 0 ||
+		(ret = wtfs_journal_access(vsb, index_bh)) < 0) {
+		brelse(tail_bh);
+		wtfs_free_block(vsb, blk_no);
+		return ret;
+	}
+	bh = wtfs_init_linked_block(vsb, blk_no, tail_bh);
+	brelse(tail_bh);
+	if (IS_ERR(bh)) {
+		wtfs_free_block(vsb, blk_no);
+		return PTR_ERR(bh);
+	}
+	blk = (struct wtfs_dir_block *)bh->b_data;
+	blk->hash_next = index->buckets[bucket];
+	first->tail = cpu_to_wtfs64(blk_no);
+	wtfs_split_buckets(index, bucket, blk_no);
+	wtfs_journal_dirty(vsb, NULL, first_bh);
+	wtfs_journal_dirty(vsb, NULL, index_bh);
+
+	++dir_vi->i_blocks;
+	i_size_write(dir_vi, i_size_read(dir_vi) + sbi->block_size);
+	i = 0;
+
+found:
+	if ((ret = wtfs_journal_access(vsb, bh)) < 0) {
+		brelse(bh);
+		return ret;
+	}
+	blk->entries[i].inode_no = cpu_to_wtfs64(inode_no);
+	memcpy(blk->entries[i].filename, filename, length);
+	wtfs_journal_dirty(vsb, NULL, bh);
+	if (loc != NULL) {
+		loc->blk_no = bh->b_blocknr;
+		loc->slot = i;
+		loc->gen = WTFS_INODE_INFO(dir_vi)->dir_gen;
+	}
+	brelse(bh);
+	return 0;
+}
+
+/*
+ * internal function used to put a new block at the head of a bucket, along
+ * with the half of the buckets sharing the old head that holds the bucket
+ *
+ * @index: the index block
+ * @bucket: the bucket to put the block in
+ * @blk_no: block number of the new block
+ */
+static void wtfs_split_buckets(struct wtfs_dir_index_block * index,
+	uint64_t bucket, uint64_t blk_no)
+{
+	wtfs64_t head = index->buckets[bucket];
+	uint64_t lo = bucket, hi = bucket + 1, mid, i;
+
+	/* find the range of buckets sharing the head */
+	while (lo > 0 && index->buckets[lo - 1] == head) {
+		--lo;
+	}
+	while (hi < WTFS_DIR_INDEX_BUCKETS && index->buckets[hi] == head) {
+		++hi;
+	}
+
+	/* the new block takes the half holding the bucket */
+	mid = lo + (hi - lo) / 2;
+	if (hi - lo > 1 && bucket < mid) {
+		hi = mid;
+	} else if (hi - lo > 1) {
+		lo = mid;
+	}
+	for (i = lo; i < hi; ++i) {
+		index->buckets[i] = cpu_to_wtfs64(blk_no);
+	}
+}
+
+/********************* implementation of wtfs_build_dir_index *****************/
+
+/*
+ * build the hashed index for a directory, the blocks behind the first one are
+ * linked by their hash_next field in their next order, and every bucket starts
+ * with them, so that no entry has to be moved
+ *
+ * the directory is left as it was if this function fails
+ *
+ * @dir_vi: the VFS inode of the directory
+ * @first_bh: buffer_head of the first directory block
+ *
+ * return: 0 on success, -EAGAIN if the directory has too many blocks to be
+ *         indexed in the current transaction, error code otherwise
+ */
+int wtfs_build_dir_index(struct inode * dir_vi, struct buffer_head * first_bh)
+{
+	struct super_block * vsb = dir_vi->i_sb;
+	struct wtfs_dir_block * blk = NULL, * first = NULL;
+	struct wtfs_dir_index_block * index = NULL;
+	struct buffer_head * bh = NULL, * index_bh = NULL;
+	uint64_t index_no, next, tail;
+	int i, ret;
+
+	/*
+	 * the index must be built in one transaction, where each block of the
+	 * chain, the first block, the index block and its bitmap are dirtied,
+	 * and the entry is inserted then with at most five more blocks
+	 */
+	if ((ret = wtfs_journal_extend(vsb, dir_vi->i_blocks + 8)) < 0) {
+		return ret;
+	}
+
+	wtfs_debug("building index for dir of inode %lu\n", dir_vi->i_ino);
+
+	/* link the blocks behind the first one by hash_next as well */
+	first = (struct wtfs_dir_block *)first_bh->b_data;
+	tail = first_bh->b_blocknr;
+	next = wtfs64_to_cpu(first->next);
+	while (next != 0) {
+		if ((bh = sb_bread(vsb, next)) == NULL) {
+			wtfs_error("unable to read the block %llu\n", next);
+			return -EIO;
+		}
+		if ((ret = wtfs_journal_access(vsb, bh)) < 0) {
+			brelse(bh);
+			return ret;
+		}
+		blk = (struct wtfs_dir_block *)bh->b_data;
+		blk->hash_next = blk->next;
+		wtfs_journal_dirty(vsb, NULL, bh);
+		tail = next;
+		next = wtfs64_to_cpu(blk->next);
+		brelse(bh);
+	}
+
+	/* every bucket starts with these blocks */
+	if ((index_no = wtfs_alloc_blocks(vsb, first_bh->b_blocknr, 1, 1,
+		NULL)) == 0) {
+		return -ENOSPC;
+	}
+	if ((ret = wtfs_journal_access(vsb, first_bh)) < 0) {
+		wtfs_free_block(vsb, index_no);
+		return ret;
+	}
+	index_bh = wtfs_init_linked_block(vsb, index_no, NULL);
+	if (IS_ERR(index_bh)) {
+		wtfs_free_block(vsb, index_no);
+		return PTR_ERR(index_bh);
+	}
+	index = (struct wtfs_dir_index_block *)index_bh->b_data;
+	for (i = 0; i < WTFS_DIR_INDEX_BUCKETS; ++i) {
+		index->buckets[i] = first->next;
+	}
+	wtfs_journal_dirty(vsb, NULL, index_bh);
+	brelse(index_bh);
+
+	/* now publish the index */
+	first->index = cpu_to_wtfs64(index_no);
+	first->tail = cpu_to_wtfs64(tail);
+	wtfs_journal_dirty(vsb, NULL, first_bh);
+
+	++dir_vi->i_blocks;
+	mark_inode_dirty(dir_vi);
+	return 0;
+}
+
+/********************* implementation of wtfs_free_dir_index ******************/
+
+/*
+ * free the index block of a directory to delete, its directory blocks are
+ * freed along the next chain as before
+ *
+ * @dir_vi: the VFS inode of the directory
+ */
+void wtfs_free_dir_index(struct inode * dir_vi)
+{
+	struct super_block * vsb = dir_vi->i_sb;
+	struct wtfs_inode_info * info = WTFS_INODE_INFO(dir_vi);
+	struct wtfs_dir_block * first = NULL;
+	struct buffer_head * bh = NULL;
+	uint64_t index_no;
+
+	if ((bh = sb_bread(vsb, info->first_block)) == NULL) {
+		wtfs_error("unable to read the block %llu\n",
+			info->first_block);
+		return;
+	}
+	first = (struct wtfs_dir_block *)bh->b_data;
+	index_no = wtfs64_to_cpu(first->index);
+	brelse(bh);
+
+	if (index_no != 0) {
+		wtfs_journal_forget(vsb, index_no);
+		wtfs_free_block(vsb, index_no);
+	}
+}
@@ -0,0 +1,1052 @@
+/*
+ * extent.c - implementation of wtfs extent mapping.
+ *
+ * Copyright (C) 2015 Chaos Shen
+ *
+ * This file is part of wtfs, What the fxck filesystem.  You may take
+ * the letter 'f' from, at your option, either 'fxck' or 'filesystem'.
+ *
+ * wtfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * wtfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with wtfs.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <linux/fs.h>
+#include <linux/vfs.h>
+#include <linux/buffer_head.h>
+#include <linux/err.h>
+#include <linux/slab.h>
+#include <linux/rbtree.h>
+
+#include "wtfs.h"
+
+/* max extents cached per inode before the cache is dropped and refilled */
+#define WTFS_EXTENT_CACHE_MAX 1024
+
+/*
+ * max blocks freed from one extent in a transaction, so that the bitmaps they
+ * are in fit into its credits
+ */
+#define WTFS_PUNCH_MAX ((uint64_t)32 * WTFS_BITMAP_SIZE * 8)
+
+/* credits for a punched extent besides its bitmaps */
+#define WTFS_PUNCH_CREDITS 8
+
+/* an extent cached in memory */
+struct wtfs_cached_extent
+{
+	struct rb_node node;
+	uint64_t iblock;
+	uint64_t length;
+	uint64_t start;
+};
+
+/* a slab memory that contains wtfs_cached_extent structure */
+static struct kmem_cache * wtfs_extent_cachep = NULL;
+
+/* declaration of internal helper functions */
+static int __wtfs_insert_extent(struct inode * vi, struct buffer_head * bh,
+	int index, uint64_t iblock, uint64_t length, uint64_t start);
+static int __wtfs_split_extent(struct inode * vi, struct buffer_head * bh,
+	int index, uint64_t iblock);
+static int __wtfs_convert_extent(struct inode * vi, struct buffer_head * bh,
+	int index);
+static void __wtfs_free_run(struct super_block * vsb, uint64_t start,
+	uint64_t length);
+static void __wtfs_set_last(struct inode * vi, uint64_t blk_no);
+static uint64_t __wtfs_load_last(struct inode * vi,
+	struct wtfs_extent_block * first);
+static struct wtfs_cached_extent * __wtfs_cache_lookup(struct inode * vi,
+	uint64_t iblock);
+static void __wtfs_cache_insert(struct inode * vi, uint64_t iblock,
+	uint64_t length, uint64_t start);
+
+/********************* implementation of wtfs_map_block ***********************/
+
+/*
+ * map a logical block of a regular file to its physical block
+ *
+ * extents in the extent block chain are sorted by their logical block index,
+ * so we only need to read extent blocks until we reach the one covering the
+ * logical block, and logical blocks behind the first extent of the last extent
+ * block, which is where appends go, are found in the last block directly
+ *
+ * every written extent found is also kept in a per-inode cache, so mapping a
+ * logical block whose extent has been looked up before costs no I/O at all
+ *
+ * blocks of unwritten extents, which are preallocated by fallocate, are
+ * reported as holes unless WTFS_MAP_UNWRITTEN is given, and mapped without
+ * being converted with WTFS_MAP_CREATE, so that data is written to them
+ * before WTFS_MAP_CONVERT converts them to written blocks, and a crash in
+ * between never exposes what the blocks held before
+ *
+ * the caller must hold extent_mutex of the inode, unless no one else can
+ * access the inode, and to create blocks with a journal it must also be in a
+ * handle with WTFS_JOURNAL_MAP_CREDITS left
+ *
+ * @vi: the VFS inode of the regular file
+ * @iblock: logical block index in the file
+ * @create: WTFS_MAP_CREATE to allocate new blocks if the logical block is a
+ *          hole, WTFS_MAP_UNWRITTEN to allocate them as unwritten, and
+ *          WTFS_MAP_CONVERT alone to convert an unwritten block
+ * @blk_no: place to store the physical block number, 0 if it is a hole
+ * @length: place to store how many blocks are mapped contiguously from iblock,
+ *          or how many blocks the hole spans ((uint64_t)-1 if no more block
+ *          is mapped behind), can be NULL, and with WTFS_MAP_CREATE it also
+ *          tells at most how many blocks to allocate for a hole, which are
+ *          taken as a physically contiguous run placed right behind the
+ *          previous extent if possible
+ *
+ * return: 1 if new blocks are allocated or an unwritten block is converted,
+ *         2 if unwritten blocks are mapped with WTFS_MAP_CREATE, 0 if the
+ *         logical block is already mapped or a hole, -EFBIG if iblock is
+ *         beyond WTFS_MAX_IBLOCK, other error code otherwise
+ */
+int wtfs_map_block(struct inode * vi, uint64_t iblock, int create,
+	uint64_t * blk_no, uint64_t * length)
+{
+	struct super_block * vsb = vi->i_sb;
+	struct wtfs_inode_info * info = WTFS_INODE_INFO(vi);
+	struct wtfs_extent_block * blk = NULL;
+	struct wtfs_extent * ext = NULL;
+	struct wtfs_cached_extent * cached = NULL;
+	struct buffer_head * bh = NULL;
+	uint64_t next, new_blk = 0, unwritten, goal, want, n = 0;
+	uint64_t ext_iblock = 0, ext_length = 0, ext_start = 0, ext_flags = 0;
+	int64_t i, count;
+	int ret = -EIO;
+
+	*blk_no = 0;
+	if (iblock > WTFS_MAX_IBLOCK) {
+		return -EFBIG;
+	}
+	unwritten = (create & WTFS_MAP_UNWRITTEN) ? WTFS_EXTENT_UNWRITTEN : 0;
+	want = ((create & WTFS_MAP_CREATE) && length != NULL && *length > 0 ?
+		*length : 1);
+	/* the run must not pass the last logical block either */
+	want = min_t(uint64_t, want, WTFS_MAX_IBLOCK - iblock + 1);
+
+	/* try the cache first */
+	if ((cached = __wtfs_cache_lookup(vi, iblock)) != NULL) {
+		*blk_no = cached->start + iblock - cached->iblock;
+		if (length != NULL) {
+			*length = cached->iblock + cached->length - iblock;
+		}
+		return 0;
+	}
+
+again:
+	next = info->first_block;
+
+	/* go straight to the last extent block if iblock is there */
+	if (info->last_block != 0 && info->last_block != next) {
+		if ((bh = sb_bread(vsb, info->last_block)) == NULL) {
+			wtfs_error("unable to read the block %llu\n",
+				info->last_block);
+			goto error;
+		}
+		blk = (struct wtfs_extent_block *)bh->b_data;
+		if (wtfs64_to_cpu(blk->count) > 0 &&
+			wtfs32_to_cpu(blk->extents[0].iblock) <= iblock) {
+			next = info->last_block;
+		}
+		brelse(bh);
+		bh = NULL;
+	}
+
+	/* find the extent block where iblock is or should be */
+	while (1) {
+		if ((bh = sb_bread(vsb, next)) == NULL) {
+			wtfs_error("unable to read the block %llu\n", next);
+			goto error;
+		}
+		blk = (struct wtfs_extent_block *)bh->b_data;
+		count = wtfs64_to_cpu(blk->count);
+
+		/* the first block tells where the last one is */
+		if (next == info->first_block && info->last_block == 0) {
+			info->last_block = __wtfs_load_last(vi, blk);
+		}
+
+		/* find the last extent starting at or before iblock */
+		for (i = count - 1; i >= 0; --i) {
+			if (wtfs32_to_cpu(blk->extents[i].iblock) <= iblock) {
+				break;
+			}
+		}
+
+		if (i >= 0) {
+			ext = &(blk->extents[i]);
+			ext_iblock = wtfs32_to_cpu(ext->iblock);
+			ext_length = WTFS_EXTENT_LENGTH(ext);
+			ext_start = wtfs64_to_cpu(ext->start);
+			ext_flags = WTFS_EXTENT_FLAGS(ext);
+		}
+
+		/* check if iblock is covered by that extent */
+		if (i >= 0 && iblock < ext_iblock + ext_length) {
+			if (ext_flags == 0) {
+				__wtfs_cache_insert(vi, ext_iblock,
+					ext_length, ext_start);
+				*blk_no = ext_start + iblock - ext_iblock;
+				if (length != NULL) {
+					*length = ext_iblock + ext_length -
+						iblock;
+				}
+				brelse(bh);
+				return 0;
+			} else if (!(create & WTFS_MAP_CONVERT)) {
+				/* leave unwritten blocks as they are */
+				if (create & (WTFS_MAP_CREATE |
+					WTFS_MAP_UNWRITTEN)) {
+					*blk_no = ext_start + iblock -
+						ext_iblock;
+				}
+				if (length != NULL) {
+					*length = ext_iblock + ext_length -
+						iblock;
+				}
+				brelse(bh);
+				return (create & WTFS_MAP_CREATE) &&
+					!unwritten ? 2 : 0;
+			} else if (iblock > ext_iblock) {
+				/* split the extent so that iblock starts one */
+				if ((ret = __wtfs_split_extent(vi, bh, i,
+					iblock)) < 0) {
+					goto error;
+				}
+				brelse(bh);
+				goto again;
+			} else {
+				if ((ret = __wtfs_convert_extent(vi, bh,
+					i)) < 0) {
+					goto error;
+				}
+				brelse(bh);
+				*blk_no = ext_start;
+				if (length != NULL) {
+					*length = 1;
+				}
+				return 1;
+			}
+		}
+
+		/*
+		 * iblock is in a hole before the next extent of this block, or
+		 * this is the last extent block
+		 */
+		next = wtfs64_to_cpu(blk->next);
+		if (next == 0) {
+			info->last_block = bh->b_blocknr;
+		}
+		if (i < count - 1 || next == 0) {
+			break;
+		}
+		brelse(bh);
+	}
+
+	/* a hole */
+	if (!(create & WTFS_MAP_CREATE)) {
+		if (length != NULL) {
+			if (i < count - 1) {
+				*length = wtfs32_to_cpu(
+					blk->extents[i + 1].iblock) - iblock;
+			} else {
+				*length = (uint64_t)-1;
+			}
+		}
+		brelse(bh);
+		return 0;
+	}
+
+	/*
+	 * alloc new data blocks, going on from the previous extent so that the
+	 * file stays physically sequential, the caller is responsible for
+	 * zeroing what it does not write through the page cache
+	 */
+	if (i < count - 1) {
+		want = wtfs_min(want, wtfs32_to_cpu(
+			blk->extents[i + 1].iblock) - iblock);
+	}
+	want = wtfs_min(want, WTFS_EXTENT_MAX_LENGTH);
+	goal = (i >= 0 ? ext_start + iblock - ext_iblock : bh->b_blocknr + 1);
+	if (unwritten) {
+		new_blk = wtfs_alloc_blocks(vsb, goal, 1, want, &n);
+	} else {
+		new_blk = wtfs_alloc_blocks_rsv(vi, goal, want, &n);
+	}
+	if (new_blk == 0) {
+		ret = -ENOSPC;
+		goto error;
+	}
+
+	/* merge them into the previous extent if they are contiguous */
+	if (i >= 0 && ext_iblock + ext_length == iblock &&
+		ext_start + ext_length == new_blk && ext_flags == unwritten &&
+		ext_length + n <= WTFS_EXTENT_MAX_LENGTH &&
+		(ret = wtfs_journal_access(vsb, bh)) == 0) {
+		ext->length = cpu_to_wtfs32((ext_length + n) | ext_flags);
+		wtfs_journal_dirty(vsb, vi, bh);
+		if (!unwritten) {
+			__wtfs_cache_insert(vi, ext_iblock, ext_length + n,
+				ext_start);
+		}
+	} else if ((ret = __wtfs_insert_extent(vi, bh, i + 1, iblock,
+		n | unwritten, new_blk)) < 0) {
+		goto error;
+	} else if (!unwritten) {
+		__wtfs_cache_insert(vi, iblock, n, new_blk);
+	}
+	brelse(bh);
+
+	vi->i_blocks += n;
+	mark_inode_dirty(vi);
+
+	*blk_no = new_blk;
+	if (length != NULL) {
+		*length = n;
+	}
+	return 1;
+
+error:
+	if (bh != NULL) {
+		brelse(bh);
+	}
+	if (new_blk != 0) {
+		__wtfs_free_run(vsb, new_blk, n);
+	}
+	return ret;
+}
+
+/*
+ * internal function used to insert a new extent into an extent block,
+ * splitting the extent block if it is full
+ *
+ * @vi: the VFS inode of the regular file
+ * @bh: buffer_head of the extent block
+ * @index: position in the extent block to insert
+ * @iblock: logical block index of the new extent
+ * @length: length of the new extent, with its flags
+ * @start: physical block number of the new extent
+ *
+ * return: 0 on success, error code otherwise
+ */
+static int __wtfs_insert_extent(struct inode * vi, struct buffer_head * bh,
+	int index, uint64_t iblock, uint64_t length, uint64_t start)
+{
+	struct super_block * vsb = vi->i_sb;
+	struct wtfs_extent_block * blk = NULL, * blk2 = NULL;
+	struct buffer_head * bh2 = NULL;
+	uint64_t blk_no, next, count, half;
+	int ret;
+
+	if ((ret = wtfs_journal_access(vsb, bh)) < 0) {
+		return ret;
+	}
+	blk = (struct wtfs_extent_block *)bh->b_data;
+	count = wtfs64_to_cpu(blk->count);
+
+	/* the extent block is full, so we have to split it */
+	if (count == WTFS_EXTENT_COUNT_PER_BLOCK) {
+		if ((blk_no = wtfs_alloc_blocks(vsb, bh->b_blocknr, 1, 1,
+			NULL)) == 0) {
+			return -ENOSPC;
+		}
+		next = blk->next;
+		bh2 = wtfs_init_linked_block(vsb, blk_no, bh);
+		if (IS_ERR(bh2)) {
+			wtfs_free_block(vsb, blk_no);
+			return PTR_ERR(bh2);
+		}
+		blk2 = (struct wtfs_extent_block *)bh2->b_data;
+		blk2->next = next;
+		++vi->i_blocks;
+		if (next == 0) {
+			__wtfs_set_last(vi, blk_no);
+		}
+
+		/*
+		 * appending is the most common case, in which we just put the
+		 * new extent into the new block, otherwise we move the upper
+		 * half of the extents into the new block
+		 */
+		half = (index == count ? count : count / 2);
+		memcpy(blk2->extents, &(blk->extents[half]),
+			(count - half) * sizeof(struct wtfs_extent));
+		memset(&(blk->extents[half]), 0,
+			(count - half) * sizeof(struct wtfs_extent));
+		blk2->count = cpu_to_wtfs64(count - half);
+		blk->count = cpu_to_wtfs64(half);
+		wtfs_journal_dirty(vsb, vi, bh);
+
+		if (index >= half) {
+			__wtfs_insert_extent(vi, bh2, index - half, iblock,
+				length, start);
+		} else {
+			__wtfs_insert_extent(vi, bh, index, iblock, length,
+				start);
+		}
+		wtfs_journal_dirty(vsb, vi, bh2);
+		brelse(bh2);
+		return 0;
+	}
+
+	/* now there must be space in this block */
+	memmove(&(blk->extents[index + 1]), &(blk->extents[index]),
+		(count - index) * sizeof(struct wtfs_extent));
+	blk->extents[index].iblock = cpu_to_wtfs32(iblock);
+	blk->extents[index].length = cpu_to_wtfs32(length);
+	blk->extents[index].start = cpu_to_wtfs64(start);
+	blk->count = cpu_to_wtfs64(count + 1);
+	wtfs_journal_dirty(vsb, vi, bh);
+	return 0;
+}
+
+/*
+ * internal function used to split an extent into two at a logical block,
+ * both keeping the flags of the original one
+ *
+ * @vi: the VFS inode of the regular file
+ * @bh: buffer_head of the extent block
+ * @index: position of the extent in the extent block
+ * @iblock: logical block index where the second extent starts
+ *
+ * return: 0 on success, error code otherwise
+ */
+static int __wtfs_split_extent(struct inode * vi, struct buffer_head * bh,
+	int index, uint64_t iblock)
+{
+	struct wtfs_extent_block * blk = (struct wtfs_extent_block *)bh->b_data;
+	struct wtfs_extent * ext = &(blk->extents[index]);
+	uint64_t ext_iblock = wtfs32_to_cpu(ext->iblock);
+	uint64_t ext_length = WTFS_EXTENT_LENGTH(ext);
+	uint64_t ext_start = wtfs64_to_cpu(ext->start);
+	uint64_t ext_flags = WTFS_EXTENT_FLAGS(ext);
+	int ret;
+
+	if ((ret = wtfs_journal_access(vi->i_sb, bh)) < 0) {
+		return ret;
+	}
+
+	/* shrink it first, as inserting may move it to another block */
+	ext->length = cpu_to_wtfs32((iblock - ext_iblock) | ext_flags);
+	if ((ret = __wtfs_insert_extent(vi, bh, index + 1, iblock,
+		(ext_iblock + ext_length - iblock) | ext_flags,
+		ext_start + iblock - ext_iblock)) < 0) {
+		ext->length = cpu_to_wtfs32(ext_length | ext_flags);
+		return ret;
+	}
+	wtfs_journal_dirty(vi->i_sb, vi, bh);
+	return 0;
+}
+
+/*
+ * internal function used to convert the first block of an unwritten extent to
+ * a written one, which is merged into the previous extent if possible
+ *
+ * @vi: the VFS inode of the regular file
+ * @bh: buffer_head of the extent block
+ * @index: position of the unwritten extent in the extent block
+ *
+ * return: 0 on success, error code otherwise
+ */
+static int __wtfs_convert_extent(struct inode * vi, struct buffer_head * bh,
+	int index)
+{
+	struct wtfs_extent_block * blk = (struct wtfs_extent_block *)bh->b_data;
+	struct wtfs_extent * ext = &(blk->extents[index]), * prev = NULL;
+	uint64_t ext_iblock = wtfs32_to_cpu(ext->iblock);
+	uint64_t ext_length = WTFS_EXTENT_LENGTH(ext);
+	uint64_t ext_start = wtfs64_to_cpu(ext->start);
+	uint64_t prev_length, count;
+	int ret;
+
+	if ((ret = wtfs_journal_access(vi->i_sb, bh)) < 0) {
+		return ret;
+	}
+
+	if (index > 0) {
+		prev = &(blk->extents[index - 1]);
+		prev_length = WTFS_EXTENT_LENGTH(prev);
+		if (WTFS_EXTENT_FLAGS(prev) != 0 ||
+			wtfs32_to_cpu(prev->iblock) + prev_length !=
+			ext_iblock ||
+			wtfs64_to_cpu(prev->start) + prev_length !=
+			ext_start ||
+			prev_length >= WTFS_EXTENT_MAX_LENGTH) {
+			prev = NULL;
+		}
+	}
+
+	if (prev != NULL) {
+		/* sequential writes into preallocated space end up here */
+		prev->length = cpu_to_wtfs32(prev_length + 1);
+		__wtfs_cache_insert(vi, wtfs32_to_cpu(prev->iblock),
+			prev_length + 1, wtfs64_to_cpu(prev->start));
+		if (ext_length == 1) {
+			count = wtfs64_to_cpu(blk->count);
+			memmove(ext, ext + 1, (count - index - 1) *
+				sizeof(struct wtfs_extent));
+			memset(&(blk->extents[count - 1]), 0,
+				sizeof(struct wtfs_extent));
+			blk->count = cpu_to_wtfs64(count - 1);
+		} else {
+			ext->iblock = cpu_to_wtfs32(ext_iblock + 1);
+			ext->length = cpu_to_wtfs32((ext_length - 1) |
+				WTFS_EXTENT_UNWRITTEN);
+			ext->start = cpu_to_wtfs64(ext_start + 1);
+		}
+	} else if (ext_length == 1) {
+		ext->length = cpu_to_wtfs32(1);
+		__wtfs_cache_insert(vi, ext_iblock, 1, ext_start);
+	} else {
+		ext->iblock = cpu_to_wtfs32(ext_iblock + 1);
+		ext->length = cpu_to_wtfs32((ext_length - 1) |
+			WTFS_EXTENT_UNWRITTEN);
+		ext->start = cpu_to_wtfs64(ext_start + 1);
+		if ((ret = __wtfs_insert_extent(vi, bh, index, ext_iblock, 1,
+			ext_start)) < 0) {
+			ext->iblock = cpu_to_wtfs32(ext_iblock);
+			ext->length = cpu_to_wtfs32(ext_length |
+				WTFS_EXTENT_UNWRITTEN);
+			ext->start = cpu_to_wtfs64(ext_start);
+			return ret;
+		}
+		__wtfs_cache_insert(vi, ext_iblock, 1, ext_start);
+	}
+	wtfs_journal_dirty(vi->i_sb, vi, bh);
+	return 0;
+}
+
+/********************* implementation of wtfs_convert_range *******************/
+
+/*
+ * convert the unwritten blocks in a range of logical blocks of a regular file
+ * to written ones, once data has been written to them, taking extent_mutex
+ * and a transaction for each block
+ *
+ * @vi: the VFS inode of the regular file
+ * @iblock: the first logical block index
+ * @count: count of blocks
+ *
+ * return: 0 on success, error code otherwise
+ */
+int wtfs_convert_range(struct inode * vi, uint64_t iblock, uint64_t count)
+{
+	struct wtfs_inode_info * info = WTFS_INODE_INFO(vi);
+	uint64_t blk_no, n;
+	handle_t * handle = NULL;
+	int ret = 0;
+
+	while (count > 0) {
+		handle = wtfs_journal_start(vi->i_sb,
+			WTFS_JOURNAL_MAP_CREDITS);
+		if (IS_ERR(handle)) {
+			return PTR_ERR(handle);
+		}
+		mutex_lock(&(info->extent_mutex));
+		ret = wtfs_map_block(vi, iblock, WTFS_MAP_CONVERT, &blk_no,
+			&n);
+		mutex_unlock(&(info->extent_mutex));
+		wtfs_journal_stop(handle);
+		if (ret < 0) {
+			return ret;
+		}
+
+		/* written blocks and holes are skipped as a whole */
+		n = wtfs_min(n, count);
+		iblock += n;
+		count -= n;
+	}
+	return 0;
+}
+
+/********************* implementation of wtfs_punch_extents *******************/
+
+/*
+ * free all data blocks of a regular file from the specified logical block,
+ * and free the extent blocks that become empty except the first one
+ *
+ * @vi: the VFS inode of the regular file
+ * @iblock: the first logical block index to free
+ *
+ * return: 0 on success, error code otherwise
+ */
+int wtfs_truncate_extents(struct inode * vi, uint64_t iblock)
+{
+	return wtfs_punch_range(vi, iblock, (uint64_t)-1);
+}
+
+/*
+ * free data blocks of a regular file in a range of logical blocks, taking
+ * extent_mutex and as many transactions as it needs
+ *
+ * no handle of the journal must be held by the caller unless it has nothing
+ * to lose by committing what it has done so far
+ *
+ * @vi: the VFS inode of the regular file
+ * @from: the first logical block index to free
+ * @to: the logical block index behind the last one to free
+ *
+ * return: 0 on success, error code otherwise
+ */
+int wtfs_punch_range(struct inode * vi, uint64_t from, uint64_t to)
+{
+	struct wtfs_inode_info * info = WTFS_INODE_INFO(vi);
+	handle_t * handle = NULL;
+	int ret;
+
+	handle = wtfs_journal_start(vi->i_sb, WTFS_JOURNAL_CREDITS);
+	if (IS_ERR(handle)) {
+		return PTR_ERR(handle);
+	}
+	while (1) {
+		mutex_lock(&(info->extent_mutex));
+		ret = wtfs_punch_extents(vi, from, to);
+		mutex_unlock(&(info->extent_mutex));
+
+		/* go on in a new transaction, with nothing locked */
+		if (ret != -EAGAIN || (ret = wtfs_journal_restart(vi->i_sb,
+			WTFS_JOURNAL_CREDITS)) < 0) {
+			break;
+		}
+	}
+	wtfs_journal_stop(handle);
+	return ret;
+}
+
+/*
+ * free data blocks of a regular file in a range of logical blocks, and free
+ * the extent blocks that become empty except the first one
+ *
+ * the caller must hold extent_mutex of the inode and, with a journal, be in a
+ * handle, and call again in a new transaction on -EAGAIN
+ *
+ * @vi: the VFS inode of the regular file
+ * @from: the first logical block index to free
+ * @to: the logical block index behind the last one to free
+ *
+ * return: 0 on success, -EAGAIN if the range is freed in part, error code
+ *         otherwise
+ */
+int wtfs_punch_extents(struct inode * vi, uint64_t from, uint64_t to)
+{
+	struct super_block * vsb = vi->i_sb;
+	struct wtfs_inode_info * info = WTFS_INODE_INFO(vi);
+	struct wtfs_extent_block * blk = NULL, * prev = NULL;
+	struct wtfs_extent * ext = NULL;
+	struct buffer_head * bh = NULL, * prev_bh = NULL;
+	uint64_t next = info->first_block, cur;
+	uint64_t ext_iblock, ext_length, ext_start, ext_flags, ext_end;
+	uint64_t lo, hi, count, kept, i;
+	int done = 0, again = 0;
+	int ret = -EIO;
+
+	if (from >= to) {
+		return 0;
+	}
+
+	/* cached extents in the range are going away */
+	wtfs_drop_extent_cache(vi);
+
+	while (next != 0 && !done && !again) {
+		if ((bh = sb_bread(vsb, next)) == NULL) {
+			wtfs_error("unable to read the block %llu\n", next);
+			goto error;
+		}
+		blk = (struct wtfs_extent_block *)bh->b_data;
+		count = wtfs64_to_cpu(blk->count);
+
+		/* free blocks in the range, and pack the extents kept */
+		kept = 0;
+		for (i = 0; i < count; ++i) {
+			ext = &(blk->extents[i]);
+			ext_iblock = wtfs32_to_cpu(ext->iblock);
+			ext_length = WTFS_EXTENT_LENGTH(ext);
+			ext_start = wtfs64_to_cpu(ext->start);
+			ext_flags = WTFS_EXTENT_FLAGS(ext);
+			ext_end = ext_iblock + ext_length;
+
+			if (ext_iblock >= to) {
+				/* no more extents in the range behind */
+				done = 1;
+				goto keep;
+			} else if (ext_end <= from) {
+				/* before the range */
+				goto keep;
+			}
+
+			/*
+			 * the part of this extent to free, cut down to what a
+			 * transaction can take, from its end if that is freed
+			 */
+			lo = wtfs_max(from, ext_iblock);
+			hi = wtfs_min(to, ext_end);
+			if (hi - lo > WTFS_PUNCH_MAX) {
+				if (hi == ext_end) {
+					lo = hi - WTFS_PUNCH_MAX;
+				} else {
+					hi = lo + WTFS_PUNCH_MAX;
+				}
+				again = 1;
+			}
+			if ((ret = wtfs_journal_extend(vsb, WTFS_PUNCH_CREDITS +
+				(hi - lo) / (WTFS_BITMAP_SIZE * 8))) < 0 ||
+				(ret = wtfs_journal_access(vsb, bh)) < 0) {
+				if (ret != -EAGAIN) {
+					goto error;
+				}
+				again = 1;
+				break;
+			}
+
+			if (lo > ext_iblock && hi < ext_end) {
+				/*
+				 * the range is inside this extent, shrink it
+				 * first, as inserting may move it to another
+				 * block
+				 */
+				ext->length = cpu_to_wtfs32((lo -
+					ext_iblock) | ext_flags);
+				if ((ret = __wtfs_insert_extent(vi, bh, i + 1,
+					hi, (ext_end - hi) | ext_flags,
+					ext_start + hi - ext_iblock)) < 0) {
+					ext->length = cpu_to_wtfs32(ext_length |
+						ext_flags);
+					goto error;
+				}
+				__wtfs_free_run(vsb, ext_start + lo -
+					ext_iblock, hi - lo);
+				vi->i_blocks -= hi - lo;
+				wtfs_journal_dirty(vsb, vi, bh);
+				brelse(bh);
+				bh = NULL;
+				done = !again;
+				break;
+			} else if (lo > ext_iblock) {
+				__wtfs_free_run(vsb, ext_start + lo -
+					ext_iblock, ext_end - lo);
+				vi->i_blocks -= ext_end - lo;
+				ext->length = cpu_to_wtfs32((lo -
+					ext_iblock) | ext_flags);
+				wtfs_journal_dirty(vsb, vi, bh);
+			} else if (hi < ext_end) {
+				__wtfs_free_run(vsb, ext_start, hi -
+					ext_iblock);
+				vi->i_blocks -= hi - ext_iblock;
+				ext->iblock = cpu_to_wtfs32(hi);
+				ext->length = cpu_to_wtfs32((ext_end - hi) |
+					ext_flags);
+				ext->start = cpu_to_wtfs64(ext_start + hi -
+					ext_iblock);
+				wtfs_journal_dirty(vsb, vi, bh);
+			} else {
+				__wtfs_free_run(vsb, ext_start, ext_length);
+				vi->i_blocks -= ext_length;
+				continue;
+			}
+
+keep:
+			if (kept != i) {
+				blk->extents[kept] = *ext;
+			}
+			++kept;
+			if (again) {
+				++i;
+				break;
+			}
+		}
+		if (bh == NULL) {
+			/* the range was inside one extent, nothing to pack */
+			break;
+		}
+		if (i < count) {
+			/* the rest is left to the next transaction */
+			memmove(&(blk->extents[kept]), &(blk->extents[i]),
+				(count - i) * sizeof(struct wtfs_extent));
+			kept += count - i;
+		}
+		if (kept < count) {
+			memset(&(blk->extents[kept]), 0,
+				(count - kept) * sizeof(struct wtfs_extent));
+			blk->count = cpu_to_wtfs64(kept);
+			wtfs_journal_dirty(vsb, vi, bh);
+		}
+
+		cur = next;
+		next = wtfs64_to_cpu(blk->next);
+
+		/* unlink and free an empty extent block except the first one */
+		if (kept == 0 && prev_bh != NULL) {
+			if ((ret = wtfs_journal_access(vsb, prev_bh)) < 0) {
+				goto error;
+			}
+			prev->next = blk->next;
+			wtfs_journal_dirty(vsb, vi, prev_bh);
+			brelse(bh);
+			bh = NULL;
+			wtfs_journal_forget(vsb, cur);
+			wtfs_free_block(vsb, cur);
+			--vi->i_blocks;
+			continue;
+		}
+
+		if (prev_bh != NULL) {
+			brelse(prev_bh);
+		}
+		prev_bh = bh;
+		prev = blk;
+	}
+	if (prev_bh != NULL) {
+		/* the last block kept is the new tail if we walked to the end */
+		if (!done && !again &&
+			prev_bh->b_blocknr != info->last_block) {
+			__wtfs_set_last(vi, prev_bh->b_blocknr);
+		}
+		brelse(prev_bh);
+	}
+
+	mark_inode_dirty(vi);
+	return (again ? -EAGAIN : 0);
+
+error:
+	if (bh != NULL && bh != prev_bh) {
+		brelse(bh);
+	}
+	if (prev_bh != NULL) {
+		brelse(prev_bh);
+	}
+	/*
+	 * the last extent block may have been freed, so fall back to the
+	 * first one on disk too, which is always right if slower
+	 */
+	__wtfs_set_last(vi, info->first_block);
+	mark_inode_dirty(vi);
+	return ret;
+}
+
+/*
+ * internal function used to free a run of blocks
+ *
+ * @vsb: the VFS super block structure
+ * @start: the first block number
+ * @length: count of blocks
+ */
+static void __wtfs_free_run(struct super_block * vsb, uint64_t start,
+	uint64_t length)
+{
+	uint64_t i;
+
+	for (i = 0; i < length; ++i) {
+		wtfs_free_block(vsb, start + i);
+	}
+}
+
+/*
+ * internal function used to record the last extent block of a regular file,
+ * both in memory and in its first extent block
+ *
+ * @vi: the VFS inode of the regular file
+ * @blk_no: block number of the last extent block
+ */
+static void __wtfs_set_last(struct inode * vi, uint64_t blk_no)
+{
+	struct wtfs_inode_info * info = WTFS_INODE_INFO(vi);
+	struct wtfs_extent_block * blk = NULL;
+	struct buffer_head * bh = NULL;
+
+	info->last_block = blk_no;
+	if ((bh = sb_bread(vi->i_sb, info->first_block)) == NULL) {
+		wtfs_error("unable to read the block %llu\n",
+			info->first_block);
+		return;
+	}
+	if (wtfs_journal_access(vi->i_sb, bh) == 0) {
+		blk = (struct wtfs_extent_block *)bh->b_data;
+		blk->last = cpu_to_wtfs64(blk_no);
+		wtfs_journal_dirty(vi->i_sb, vi, bh);
+	}
+	brelse(bh);
+}
+
+/*
+ * internal function used to find out the last extent block of a regular file
+ * from its first extent block, which is trusted only if it looks like the
+ * tail of the chain, falling back to the first block otherwise
+ *
+ * @vi: the VFS inode of the regular file
+ * @first: the first extent block
+ *
+ * return: block number of the last extent block, or of the first one
+ */
+static uint64_t __wtfs_load_last(struct inode * vi,
+	struct wtfs_extent_block * first)
+{
+	struct wtfs_inode_info * info = WTFS_INODE_INFO(vi);
+	struct wtfs_extent_block * blk = NULL;
+	struct buffer_head * bh = NULL;
+	uint64_t last = wtfs64_to_cpu(first->last);
+	uint64_t count, first_count = wtfs64_to_cpu(first->count);
+	int valid;
+
+	/* a single block is its own last one */
+	if (first->next == 0 || last == 0 || last == info->first_block ||
+		first_count > WTFS_EXTENT_COUNT_PER_BLOCK) {
+		return info->first_block;
+	}
+
+	if ((bh = sb_bread(vi->i_sb, last)) == NULL) {
+		wtfs_error("unable to read the block %llu\n", last);
+		return info->first_block;
+	}
+	blk = (struct wtfs_extent_block *)bh->b_data;
+	count = wtfs64_to_cpu(blk->count);
+
+	/*
+	 * the tail ends the chain, is never empty, and maps blocks behind all
+	 * those of the first block
+	 */
+	valid = (blk->next == 0 && count > 0 &&
+		count <= WTFS_EXTENT_COUNT_PER_BLOCK &&
+		(first_count == 0 ||
+		wtfs32_to_cpu(blk->extents[0].iblock) >
+		wtfs32_to_cpu(first->extents[first_count - 1].iblock)));
+	brelse(bh);
+
+	if (!valid) {
+		wtfs_error("invalid last extent block %llu of inode %lu\n",
+			last, vi->i_ino);
+		return info->first_block;
+	}
+	return last;
+}
+
+/********************* implementation of extent cache *************************/
+
+/*
+ * internal function used to find the cached extent covering a logical block
+ *
+ * @vi: the VFS inode of the regular file
+ * @iblock: logical block index in the file
+ *
+ * return: the cached extent, NULL if not cached
+ */
+static struct wtfs_cached_extent * __wtfs_cache_lookup(struct inode * vi,
+	uint64_t iblock)
+{
+	struct wtfs_inode_info * info = WTFS_INODE_INFO(vi);
+	struct rb_node * node = info->extent_cache.rb_node;
+	struct wtfs_cached_extent * cached = NULL;
+
+	while (node != NULL) {
+		cached = rb_entry(node, struct wtfs_cached_extent, node);
+		if (iblock < cached->iblock) {
+			node = node->rb_left;
+		} else if (iblock >= cached->iblock + cached->length) {
+			node = node->rb_right;
+		} else {
+			return cached;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * internal function used to cache an extent, replacing the one that starts at
+ * the same logical block, extents grown by appends are updated this way
+ *
+ * @vi: the VFS inode of the regular file
+ * @iblock: logical block index of the extent
+ * @length: length of the extent
+ * @start: physical block number of the extent
+ */
+static void __wtfs_cache_insert(struct inode * vi, uint64_t iblock,
+	uint64_t length, uint64_t start)
+{
+	struct wtfs_inode_info * info = WTFS_INODE_INFO(vi);
+	struct rb_node ** p = &(info->extent_cache.rb_node), * parent = NULL;
+	struct wtfs_cached_extent * cached = NULL;
+
+	while (*p != NULL) {
+		parent = *p;
+		cached = rb_entry(parent, struct wtfs_cached_extent, node);
+		if (iblock < cached->iblock) {
+			p = &(parent->rb_left);
+		} else if (iblock > cached->iblock) {
+			p = &(parent->rb_right);
+		} else {
+			cached->length = length;
+			cached->start = start;
+			return;
+		}
+	}
+
+	/* do not let a badly fragmented file eat up memory */
+	if (info->extent_cache_count >= WTFS_EXTENT_CACHE_MAX) {
+		wtfs_drop_extent_cache(vi);
+		p = &(info->extent_cache.rb_node);
+		parent = NULL;
+	}
+
+	cached = kmem_cache_alloc(wtfs_extent_cachep, GFP_NOFS);
+	if (cached == NULL) {
+		return; /* it is only a cache */
+	}
+	cached->iblock = iblock;
+	cached->length = length;
+	cached->start = start;
+	rb_link_node(&(cached->node), parent, p);
+	rb_insert_color(&(cached->node), &(info->extent_cache));
+	++info->extent_cache_count;
+}
+
+/*
+ * drop all cached extents of a regular file
+ *
+ * @vi: the VFS inode of the regular file
+ */
+void wtfs_drop_extent_cache(struct inode * vi)
+{
+	struct wtfs_inode_info * info = WTFS_INODE_INFO(vi);
+	struct rb_node * node = NULL;
+
+	while ((node = rb_first(&(info->extent_cache))) != NULL) {
+		rb_erase(node, &(info->extent_cache));
+		kmem_cache_free(wtfs_extent_cachep,
+			rb_entry(node, struct wtfs_cached_extent, node));
+	}
+	info->extent_cache_count = 0;
+}
+
+/*
+ * create the slab memory for cached extents on module initialization
+ *
+ * return: 0 on success, error code otherwise
+ */
+int wtfs_create_extent_cache(void)
+{
+	wtfs_extent_cachep = kmem_cache_create("wtfs_extent_cache",
+		sizeof(struct wtfs_cached_extent), 0,
+		SLAB_RECLAIM_ACCOUNT | SLAB_MEM_SPREAD, NULL);
+	if (wtfs_extent_cachep == NULL) {
+		return -ENOMEM;
+	}
+	return 0;
+}
+
+/*
+ * destroy the slab memory for cached extents
+ */
+void wtfs_destroy_extent_cache(void)
+{
+	kmem_cache_destroy(wtfs_extent_cachep);
+}
@@ -23,592 +23,1324 @@
 #include <linux/fs.h>
 #include <linux/vfs.h>
 #include <linux/buffer_head.h>
+#include <linux/blkdev.h>
+#include <linux/mpage.h>
+#include <linux/pagemap.h>
+#include <linux/pagevec.h>
 #include <linux/err.h>
 #include <linux/slab.h>
+#include <linux/falloc.h>
+#include <linux/highmem.h>
+#include <linux/sched.h>
+#include <linux/version.h>
 
 #include "wtfs.h"
 
 /* declaration of file operations */
-static ssize_t wtfs_read(struct file * file, char __user * buf, size_t length,
-	loff_t * ppos);
-static ssize_t wtfs_write(struct file * file, const char __user * buf,
-	size_t length, loff_t * ppos);
 static loff_t wtfs_llseek(struct file * file, loff_t offset, int whence);
-static int wtfs_open(struct inode * vi, struct file * file);
+static long wtfs_fallocate(struct file * file, int mode, loff_t offset,
+	loff_t len);
+static int wtfs_file_mmap(struct file * file, struct vm_area_struct * vma);
 static int wtfs_release(struct inode * vi, struct file * file);
+static int wtfs_fsync(struct file * file, loff_t start, loff_t end,
+	int datasync);
 
 const struct file_operations wtfs_file_ops = {
-	.read = wtfs_read,
-	.write = wtfs_write,
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3, 16, 0)
+	.read = do_sync_read,
+	.aio_read = generic_file_aio_read,
+	.write = do_sync_write,
+	.aio_write = generic_file_aio_write,
+#elif LINUX_VERSION_CODE < KERNEL_VERSION(4, 1, 0)
+	.read = new_sync_read,
+	.read_iter = generic_file_read_iter,
+	.write = new_sync_write,
+	.write_iter = generic_file_write_iter,
+#else
+	.read_iter = generic_file_read_iter,
+	.write_iter = generic_file_write_iter,
+#endif
 	.llseek = wtfs_llseek,
-	.open = wtfs_open,
+	.mmap = wtfs_file_mmap,
+	.splice_read = generic_file_splice_read,
+	.fallocate = wtfs_fallocate,
 	.release = wtfs_release,
+	.fsync = wtfs_fsync,
 };
 
-/* structure to store I/O position */
-struct wtfs_file_pos
-{
-	/* current read/write position */
-	uint64_t pos;
+/* declaration of vm operations */
+static int wtfs_page_mkwrite(struct vm_area_struct * vma,
+	struct vm_fault * vmf);
 
-	/* block available to read/write */
-	uint64_t blk_no;
+static const struct vm_operations_struct wtfs_file_vm_ops = {
+	.fault = filemap_fault,
+	.map_pages = filemap_map_pages,
+	.page_mkwrite = wtfs_page_mkwrite,
+};
+
+/* declaration of address space operations */
+static int wtfs_readpage(struct file * file, struct page * page);
+static int wtfs_readpages(struct file * file, struct address_space * mapping,
+	struct list_head * pages, unsigned nr_pages);
+static int wtfs_writepage(struct page * page, struct writeback_control * wbc);
+static void wtfs_end_buffer_write(struct buffer_head * bh, int uptodate);
+static int wtfs_writepages(struct address_space * mapping,
+	struct writeback_control * wbc);
+static int wtfs_map_delayed(struct address_space * mapping,
+	struct writeback_control * wbc);
+static int __wtfs_map_delayed_pages(struct inode * vi, struct page ** pages,
+	unsigned int nr);
+static int __wtfs_alloc_range(struct inode * vi, uint64_t start,
+	uint64_t length);
+static int __wtfs_flush_batch(struct inode * vi, struct page ** batch,
+	unsigned int * nr);
+static int wtfs_write_begin(struct file * file, struct address_space * mapping,
+	loff_t pos, unsigned len, unsigned flags, struct page ** pagep,
+	void ** fsdata);
+static int wtfs_write_end(struct file * file, struct address_space * mapping,
+	loff_t pos, unsigned len, unsigned copied, struct page * page,
+	void * fsdata);
+static void wtfs_drop_delayed(struct address_space * mapping, pgoff_t index);
+static void wtfs_invalidatepage(struct page * page, unsigned int offset,
+	unsigned int length);
+static int wtfs_releasepage(struct page * page, gfp_t gfp);
+static sector_t wtfs_bmap(struct address_space * mapping, sector_t block);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 7, 0)
+static ssize_t wtfs_direct_IO(struct kiocb * iocb, struct iov_iter * iter);
+static int wtfs_dio_get_block(struct inode * vi, sector_t iblock,
+	struct buffer_head * bh_result, int create);
+static int wtfs_end_dio_write(struct kiocb * iocb, loff_t offset,
+	ssize_t size, void * private);
+#endif
+
+const struct address_space_operations wtfs_aops = {
+	.readpage = wtfs_readpage,
+	.readpages = wtfs_readpages,
+	.writepage = wtfs_writepage,
+	.writepages = wtfs_writepages,
+	.write_begin = wtfs_write_begin,
+	.write_end = wtfs_write_end,
+	.invalidatepage = wtfs_invalidatepage,
+	.releasepage = wtfs_releasepage,
+	.bmap = wtfs_bmap,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 7, 0)
+	.direct_IO = wtfs_direct_IO,
+#endif
 };
 
-/********************* implementation of read *********************************/
+/********************* implementation of get_block ****************************/
 
 /*
- * routine called to read the content of a file
+ * map a run of logical blocks of a regular file to a buffer_head, used by the
+ * generic page cache and direct I/O routines
  *
- * @file: the VFS file structure
- * @buf: the userspace buffer to hold the content
- * @length: length of the buffer in byte
- * @ppos: current position to read
+ * the caller tells how many blocks it wants in bh_result->b_size, and we map
+ * as many of them as are physically contiguous with a single extent lookup,
+ * so that mpage and direct I/O can build one large bio for the whole run
+ *
+ * unwritten blocks to write are mapped with BH_Unwritten set, and converted
+ * only after the data is on disk, by wtfs_end_buffer_write for writeback and
+ * wtfs_end_dio_write for direct I/O
+ *
+ * @vi: the VFS inode of the regular file
+ * @iblock: the first logical block index in the file
+ * @bh_result: the buffer_head to map
+ * @create: whether to allocate a new block if the logical block is a hole
  *
- * return: size of content actually read on success, error code otherwise
+ * return: 0 on success, error code otherwise
  */
-static ssize_t wtfs_read(struct file * file, char __user * buf, size_t length,
-	loff_t * ppos)
+static int wtfs_get_block(struct inode * vi, sector_t iblock,
+	struct buffer_head * bh_result, int create)
 {
-	struct inode * vi = file_inode(file);
-	struct super_block * vsb = vi->i_sb;
 	struct wtfs_inode_info * info = WTFS_INODE_INFO(vi);
-	struct wtfs_file_pos * file_pos = file->private_data;
-	struct wtfs_data_block * block = NULL;
-	struct buffer_head * bh = NULL;
-	uint64_t i, count, offset, remain, next;
-	ssize_t ret = -EIO, nbytes;
+	uint64_t max_blocks = bh_result->b_size >> vi->i_blkbits;
+	uint64_t blk_no, length;
+	handle_t * handle = NULL;
+	int ret;
 
-	wtfs_debug("read called, inode %lu, length %lu, pos %llu\n",
-		vi->i_ino, length, *ppos);
+	if (max_blocks == 0) {
+		max_blocks = 1;
+	}
 
-	/* check if we reach the EOF */
-	if (*ppos >= i_size_read(vi)) {
-		return 0;
+	/* the handle must be started before extent_mutex is taken */
+	if (create) {
+		handle = wtfs_journal_start(vi->i_sb,
+			WTFS_JOURNAL_MAP_CREDITS);
+		if (IS_ERR(handle)) {
+			return PTR_ERR(handle);
+		}
+	}
+
+	/* a whole run of holes is allocated at once for direct I/O */
+	length = max_blocks;
+	mutex_lock(&(info->extent_mutex));
+	ret = wtfs_map_block(vi, iblock, create ? WTFS_MAP_CREATE : 0,
+		&blk_no, &length);
+	mutex_unlock(&(info->extent_mutex));
+	wtfs_journal_stop(handle);
+	if (ret < 0) {
+		return ret;
 	}
 
-	/* calculate which block to start read */
-	count = *ppos / WTFS_DATA_SIZE;
-	offset = *ppos % WTFS_DATA_SIZE;
+	if (length > max_blocks) {
+		length = max_blocks;
+	}
 
-	if (file_pos->pos != 0 && file_pos->pos == *ppos) {
-		/*
-		 * this is the subsequent call of previous read
-		 * use the last block number directly
-		 */
-		next = file_pos->blk_no;
-	} else {
-		/* skip the first count-th blocks from beginning */
-		next = info->first_block;
-		for (i = 0; next != 0 && i < count; ++i) {
-			if ((bh = sb_bread(vsb, next)) == NULL) {
-				wtfs_error("unable to read the block %llu\n",
-					next);
-				goto error;
-			}
-			block = (struct wtfs_data_block *)bh->b_data;
-			next = wtfs64_to_cpu(block->next);
-			brelse(bh);
+	/* leave the buffer_head unmapped for a hole */
+	if (blk_no != 0) {
+		map_bh(bh_result, vi->i_sb, blk_no);
+		/* let the generic routines zero what is not written */
+		if (ret == 1 || ret == 2) {
+			set_buffer_new(bh_result);
+		}
+		if (ret == 2) {
+			set_buffer_unwritten(bh_result);
 		}
 	}
+	bh_result->b_size = length << vi->i_blkbits;
 
-	/* start reading */
-	ret = 0;
-	remain = i_size_read(vi) - count * WTFS_DATA_SIZE - offset;
-	while (remain > 0 && length > 0 && next != 0) {
-		if ((bh = sb_bread(vsb, next)) == NULL) {
-			wtfs_error("unable to read the block %llu\n", next);
-			break;
-		}
-		block = (struct wtfs_data_block *)bh->b_data;
+	/* a delayed block has got its physical block */
+	if (create && buffer_delay(bh_result) && blk_no != 0) {
+		clear_buffer_delay(bh_result);
+		wtfs_release_delayed(vi->i_sb, 1);
+	}
+	return 0;
+}
+
+/*
+ * get_block used by buffered writes, which reserves space for a hole instead
+ * of allocating it, so that physical blocks are chosen at writeback
+ *
+ * the buffer_head of a delayed block is left unmapped with BH_Delay set, so
+ * that writeback either maps it in bulk in wtfs_writepages, or calls
+ * wtfs_get_block for it as for any other unmapped dirty buffer
+ *
+ * @vi: the VFS inode of the regular file
+ * @iblock: the logical block index in the file
+ * @bh_result: the buffer_head to map
+ * @create: always set by the callers
+ *
+ * return: 0 on success, error code otherwise
+ */
+static int wtfs_da_get_block(struct inode * vi, sector_t iblock,
+	struct buffer_head * bh_result, int create)
+{
+	struct wtfs_inode_info * info = WTFS_INODE_INFO(vi);
+	uint64_t blk_no;
+	int ret;
+
+	/* space has been reserved for it by an earlier write */
+	if (buffer_delay(bh_result)) {
+		return 0;
+	}
+
+	mutex_lock(&(info->extent_mutex));
+	ret = wtfs_map_block(vi, iblock, 0, &blk_no, NULL);
+	mutex_unlock(&(info->extent_mutex));
+	if (ret < 0) {
+		return ret;
+	}
+	if (blk_no != 0) {
+		map_bh(bh_result, vi->i_sb, blk_no);
+		return 0;
+	}
 
-		/* max bytes we can read from this block */
-		nbytes = wtfs_min3(WTFS_DATA_SIZE - offset, length, remain);
-		copy_to_user(buf + ret, block->data + offset, nbytes);
+	/* a hole or an unwritten block */
+	if ((ret = wtfs_reserve_delayed(vi->i_sb, 1)) < 0) {
+		return ret;
+	}
+	bh_result->b_bdev = vi->i_sb->s_bdev;
+	bh_result->b_blocknr = (sector_t)-1;
+	set_buffer_new(bh_result);
+	set_buffer_delay(bh_result);
+	return 0;
+}
 
-		/* record correct block number */
-		if (nbytes == WTFS_DATA_SIZE - offset) {
-			file_pos->blk_no = wtfs64_to_cpu(block->next);
+/********************* implementation of llseek *******************************/
+
+/*
+ * routine called by the VFS to change the file position
+ *
+ * SEEK_DATA and SEEK_HOLE are answered by walking the extents of the file,
+ * everything else goes to generic_file_llseek, and seeking beyond EOF never
+ * allocates anything, since holes are left unmapped and read back as zeros
+ *
+ * dirty pages are written back first, since delayed data has no extent and
+ * data in an unwritten extent reads as zeros until then, and both would be
+ * taken for holes
+ *
+ * @file: the VFS file structure
+ * @offset: the offset to seek
+ * @whence: where to seek from
+ *
+ * return: the new file position on success, error code otherwise
+ */
+static loff_t wtfs_llseek(struct file * file, loff_t offset, int whence)
+{
+	struct inode * vi = file->f_mapping->host;
+	struct wtfs_inode_info * info = WTFS_INODE_INFO(vi);
+	uint64_t iblock, blk_no, length;
+	loff_t size, pos;
+	int ret = 0;
+
+	if (whence != SEEK_DATA && whence != SEEK_HOLE) {
+		return generic_file_llseek(file, offset, whence);
+	}
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 5, 0)
+	mutex_lock(&(vi->i_mutex));
+#else
+	inode_lock(vi);
+#endif
+	size = i_size_read(vi);
+	if (offset < 0 || offset >= size) {
+		ret = -ENXIO;
+		goto out;
+	}
+	if ((ret = filemap_write_and_wait_range(vi->i_mapping, offset,
+		size - 1)) < 0) {
+		goto out;
+	}
+
+	/* walk extents and holes from the block containing offset */
+	pos = offset;
+	mutex_lock(&(info->extent_mutex));
+	while (pos < size) {
+		iblock = pos >> vi->i_blkbits;
+		if ((ret = wtfs_map_block(vi, iblock, 0, &blk_no,
+			&length)) < 0) {
+			break;
+		}
+		if ((blk_no != 0) == (whence == SEEK_DATA)) {
+			break;
+		}
+		if (length == (uint64_t)-1 ||
+			length > ((size - 1) >> vi->i_blkbits) - iblock) {
+			pos = size;
 		} else {
-			file_pos->blk_no = next;
+			pos = (iblock + length) << vi->i_blkbits;
 		}
+	}
+	mutex_unlock(&(info->extent_mutex));
+	if (ret < 0) {
+		goto out;
+	}
 
-		/* update bytes read */
-		ret += nbytes;
-		length -= nbytes;
-		remain -= nbytes;
-		offset = 0;
+	/* no data behind offset, while EOF is always a hole */
+	if (pos >= size) {
+		if (whence == SEEK_DATA) {
+			ret = -ENXIO;
+			goto out;
+		}
+		pos = size;
+	}
+	pos = vfs_setpos(file, pos, vi->i_sb->s_maxbytes);
+
+out:
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 5, 0)
+	mutex_unlock(&(vi->i_mutex));
+#else
+	inode_unlock(vi);
+#endif
+	return ret < 0 ? ret : pos;
+}
+
+/********************* implementation of readpage(s) **************************/
 
-		next = wtfs64_to_cpu(block->next);
-		brelse(bh);
+/*
+ * routine called by the VFS to read a page from disk
+ *
+ * @file: the VFS file structure
+ * @page: the locked page to read
+ *
+ * return: 0 on success, error code otherwise
+ */
+static int wtfs_readpage(struct file * file, struct page * page)
+{
+	return block_read_full_page(page, wtfs_get_block);
+}
+
+/*
+ * routine called by the VFS to read pages for readahead
+ *
+ * @file: the VFS file structure
+ * @mapping: the address space of the file
+ * @pages: list of pages to read
+ * @nr_pages: count of pages in the list
+ *
+ * return: 0 on success, error code otherwise
+ */
+static int wtfs_readpages(struct file * file, struct address_space * mapping,
+	struct list_head * pages, unsigned nr_pages)
+{
+	return mpage_readpages(mapping, pages, nr_pages, wtfs_get_block);
+}
+
+/********************* implementation of writepage(s) *************************/
+
+/*
+ * routine called by the VM to write a dirty page to disk
+ *
+ * this is also where mpage sends every page holding a buffer of an unwritten
+ * block, which is left unmapped until here, so that the writeback of the page
+ * ends only after wtfs_end_buffer_write has converted the block
+ *
+ * @page: the locked page to write
+ * @wbc: a control structure which tells the writeback code what to do
+ *
+ * return: 0 on success, error code otherwise
+ */
+static int wtfs_writepage(struct page * page, struct writeback_control * wbc)
+{
+	struct inode * vi = page->mapping->host;
+	loff_t size = i_size_read(vi);
+
+	/* a page beyond the EOF is only dropped */
+	if (page_offset(page) >= size) {
+		return block_write_full_page(page, wtfs_get_block, wbc);
 	}
 
-	wtfs_debug("read %ld bytes\n", ret);
+	/* and the part of a page beyond the EOF is zeroed */
+	if (page->index == size >> PAGE_SHIFT) {
+		zero_user_segment(page, size & (PAGE_SIZE - 1), PAGE_SIZE);
+	}
+	return __block_write_full_page(vi, page, wtfs_get_block, wbc,
+		wtfs_end_buffer_write);
+}
 
-	/* update position pointer */
-	*ppos += ret;
+/*
+ * routine called when the write of a buffer of a page completes, which may be
+ * in interrupt context, so a buffer of an unwritten block is handed over to
+ * wtfs_end_unwritten to convert the block and then end its write
+ *
+ * @bh: the buffer_head written
+ * @uptodate: whether the write succeeded
+ */
+static void wtfs_end_buffer_write(struct buffer_head * bh, int uptodate)
+{
+	struct inode * vi = bh->b_page->mapping->host;
+	struct wtfs_sb_info * sbi = WTFS_SB_INFO(vi->i_sb);
+	unsigned long flags;
 
-	/* record the position read */
-	file_pos->pos = *ppos;
+	if (!buffer_unwritten(bh)) {
+		end_buffer_async_write(bh, uptodate);
+		return;
+	}
 
-	return ret;
+	/* the block stays unwritten, so map it again on the next write */
+	if (!uptodate) {
+		clear_buffer_unwritten(bh);
+		clear_buffer_mapped(bh);
+		end_buffer_async_write(bh, uptodate);
+		return;
+	}
 
-error:
-	if (bh != NULL) {
-		brelse(bh);
+	spin_lock_irqsave(&(sbi->unwritten_lock), flags);
+	bh->b_private = sbi->unwritten_list;
+	sbi->unwritten_list = bh;
+	spin_unlock_irqrestore(&(sbi->unwritten_lock), flags);
+	schedule_work(&(sbi->unwritten_work));
+}
+
+/*
+ * the work converting unwritten blocks whose data has been written back, and
+ * ending the write of their buffers
+ *
+ * @work: unwritten_work of the sb_info
+ */
+void wtfs_end_unwritten(struct work_struct * work)
+{
+	struct wtfs_sb_info * sbi = container_of(work, struct wtfs_sb_info,
+		unwritten_work);
+	struct buffer_head * bh = NULL, * next = NULL;
+	struct inode * vi = NULL;
+	uint64_t iblock;
+	int ret;
+
+	spin_lock_irq(&(sbi->unwritten_lock));
+	bh = sbi->unwritten_list;
+	sbi->unwritten_list = NULL;
+	spin_unlock_irq(&(sbi->unwritten_lock));
+
+	for (; bh != NULL; bh = next) {
+		next = bh->b_private;
+		bh->b_private = NULL;
+
+		vi = bh->b_page->mapping->host;
+		iblock = ((uint64_t)bh->b_page->index <<
+			(PAGE_SHIFT - vi->i_blkbits)) +
+			(bh_offset(bh) >> vi->i_blkbits);
+		if ((ret = wtfs_convert_range(vi, iblock, 1)) < 0) {
+			wtfs_error("unable to convert block %llu of inode "
+				"%lu\n", iblock, vi->i_ino);
+		}
+		clear_buffer_unwritten(bh);
+		end_buffer_async_write(bh, ret == 0);
 	}
-	return ret;
 }
 
-/********************* implementation of write ********************************/
+/*
+ * routine called by the VM to write dirty pages of an address space to disk
+ *
+ * @mapping: the address space of the file
+ * @wbc: a control structure which tells the writeback code what to do
+ *
+ * return: 0 on success, error code otherwise
+ */
+static int wtfs_writepages(struct address_space * mapping,
+	struct writeback_control * wbc)
+{
+	int ret;
+
+	/* choose blocks for delayed data first, so that mpage writes runs */
+	if ((ret = wtfs_map_delayed(mapping, wbc)) < 0) {
+		return ret;
+	}
+	return mpage_writepages(mapping, wbc, wtfs_get_block);
+}
 
 /*
- * routine called to write content to a file
+ * internal function used to allocate blocks for all delayed buffers of locked
+ * pages, each run of delayed blocks at once, and map the buffers
  *
- * @file: the VFS file structure
- * @buf: the userspace buffer holding the content to write
- * @length: length of the content
- * @ppos: current position to write
+ * @vi: the VFS inode of the regular file
+ * @pages: the locked pages, in ascending order
+ * @nr: count of pages
  *
- * return: size of content actually written on success, error code otherwise
+ * return: 0 on success, error code otherwise
  */
-static ssize_t wtfs_write(struct file * file, const char __user * buf,
-	size_t length, loff_t * ppos)
+static int __wtfs_map_delayed_pages(struct inode * vi, struct page ** pages,
+	unsigned int nr)
 {
-	struct inode * vi = file_inode(file);
-	struct super_block * vsb = vi->i_sb;
 	struct wtfs_inode_info * info = WTFS_INODE_INFO(vi);
-	struct wtfs_file_pos * file_pos = file->private_data;
-	struct wtfs_data_block * block = NULL;
-	struct buffer_head * bh = NULL, * bh2 = NULL;
-	uint64_t i, count, offset, next;
-	ssize_t ret = -EIO, nbytes;
-
-	wtfs_debug("write called, inode %lu, buf_size %lu, pos %llu\n",
-		vi->i_ino, length, *ppos);
-
-	/* calculate which block to start write */
-	count = *ppos / WTFS_DATA_SIZE;
-	offset = *ppos % WTFS_DATA_SIZE;
-
-	if (file_pos->pos != 0 && file_pos->pos == *ppos) {
-		/*
-		 * this is the subsequent call of previous write
-		 * use the last block number directly
-		 */
-		next = file_pos->blk_no;
-	} else {
-		/* skip the first count-th blocks from beginning */
-		next = info->first_block;
-		for (i = 0; next != 0 && i < count; ++i) {
-			if ((bh = sb_bread(vsb, next)) == NULL) {
-				wtfs_error("unable to read the block %llu\n",
-					next);
-				goto error;
+	struct buffer_head * bh = NULL, * head = NULL;
+	uint64_t start = 0, length = 0, iblock, blk_no, mapped = 0;
+	handle_t * handle = NULL;
+	unsigned int i;
+	int ret = 0;
+
+	/* every block of the batch may start a run of its own */
+	handle = wtfs_journal_start(vi->i_sb,
+		WTFS_DELALLOC_BATCH * WTFS_JOURNAL_MAP_CREDITS);
+	if (IS_ERR(handle)) {
+		return PTR_ERR(handle);
+	}
+	mutex_lock(&(info->extent_mutex));
+
+	/* find runs of delayed blocks and allocate each of them at once */
+	for (i = 0; i < nr; ++i) {
+		iblock = (uint64_t)pages[i]->index <<
+			(PAGE_SHIFT - vi->i_blkbits);
+		bh = head = page_buffers(pages[i]);
+		do {
+			if (!buffer_delay(bh) || buffer_mapped(bh)) {
+				continue;
 			}
-			block = (struct wtfs_data_block *)bh->b_data;
-			next = wtfs64_to_cpu(block->next);
-			brelse(bh);
-		}
+			if (length > 0 && iblock != start + length) {
+				if ((ret = __wtfs_alloc_range(vi, start,
+					length)) < 0) {
+					goto out;
+				}
+				length = 0;
+			}
+			if (length == 0) {
+				start = iblock;
+			}
+			++length;
+		} while (++iblock, (bh = bh->b_this_page) != head);
+	}
+	if (length > 0 && (ret = __wtfs_alloc_range(vi, start, length)) < 0) {
+		goto out;
 	}
 
-	/* start writing */
-	ret = 0;
-	while (length > 0) {
-		if ((bh = sb_bread(vsb, next)) == NULL) {
-			wtfs_error("unable to read the block %llu\n", next);
-			break;
-		}
-		block = (struct wtfs_data_block *)bh->b_data;
-
-		/* max bytes we can write to this block */
-		nbytes = wtfs_min(WTFS_DATA_SIZE - offset, length);
-		copy_from_user(block->data + offset, buf + ret, nbytes);
-		mark_buffer_dirty(bh);
-
-		/* record block number */
-		if (nbytes == WTFS_DATA_SIZE - offset) {
-			file_pos->blk_no = wtfs64_to_cpu(block->next);
-			/*
-			 * if we reach the last block, pre-allocate a new data
-			 * block
-			 */
-			if (file_pos->blk_no == 0) {
-				if ((file_pos->blk_no = wtfs_alloc_block(vsb))
-					== 0) {
-					/*
-					 * here failure is not allowed, nor
-					 * in the following
-					 */
-					goto error;
-				}
-				bh2 = wtfs_init_linked_block(vsb,
-					file_pos->blk_no, bh);
-				if (IS_ERR(bh2)) {
-					wtfs_free_block(vsb, file_pos->blk_no);
-					goto error;
-				}
-				brelse(bh2);
-				++vi->i_blocks;
-				mark_inode_dirty(vi);
+	/* now every delayed block is mapped, so map the buffers */
+	for (i = 0; i < nr; ++i) {
+		iblock = (uint64_t)pages[i]->index <<
+			(PAGE_SHIFT - vi->i_blkbits);
+		bh = head = page_buffers(pages[i]);
+		do {
+			if (!buffer_delay(bh) || buffer_mapped(bh)) {
+				continue;
 			}
-		} else {
-			file_pos->blk_no = next;
+			if ((ret = wtfs_map_block(vi, iblock, 0, &blk_no,
+				NULL)) < 0) {
+				goto out;
+			}
+
+			/* an unwritten block is left to wtfs_writepage */
+			if (blk_no == 0) {
+				continue;
+			}
+			map_bh(bh, vi->i_sb, blk_no);
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 10, 0)
+			unmap_underlying_metadata(bh->b_bdev, blk_no);
+#else
+			clean_bdev_bh_alias(bh);
+#endif
+			clear_buffer_new(bh);
+			clear_buffer_delay(bh);
+			++mapped;
+		} while (++iblock, (bh = bh->b_this_page) != head);
+	}
+
+out:
+	mutex_unlock(&(info->extent_mutex));
+	wtfs_journal_stop(handle);
+	wtfs_release_delayed(vi->i_sb, mapped);
+	return ret;
+}
+
+/*
+ * internal function used to allocate blocks for a range of logical blocks,
+ * with extent_mutex held
+ *
+ * @vi: the VFS inode of the regular file
+ * @start: the first logical block index
+ * @length: count of blocks
+ *
+ * return: 0 on success, error code otherwise
+ */
+static int __wtfs_alloc_range(struct inode * vi, uint64_t start,
+	uint64_t length)
+{
+	uint64_t blk_no, n;
+	int ret;
+
+	while (length > 0) {
+		n = length;
+		if ((ret = wtfs_map_block(vi, start, WTFS_MAP_CREATE, &blk_no,
+			&n)) < 0) {
+			return ret;
 		}
+		n = wtfs_min(n, length);
+		start += n;
+		length -= n;
+	}
+	return 0;
+}
 
-		/* update bytes write */
-		ret += nbytes;
-		length -= nbytes;
-		offset = 0;
+/*
+ * internal function used to map delayed buffers of a batch of locked pages,
+ * and unlock and put the pages
+ *
+ * @vi: the VFS inode of the regular file
+ * @batch: the locked pages, in ascending order
+ * @nr: count of pages, set to zero on return
+ *
+ * return: 0 on success, error code otherwise
+ */
+static int __wtfs_flush_batch(struct inode * vi, struct page ** batch,
+	unsigned int * nr)
+{
+	int ret = __wtfs_map_delayed_pages(vi, batch, *nr);
 
-		next = wtfs64_to_cpu(block->next);
-		brelse(bh);
+	while (*nr > 0) {
+		--*nr;
+		unlock_page(batch[*nr]);
+		put_page(batch[*nr]);
 	}
+	return ret;
+}
 
-	wtfs_debug("write %ld bytes\n", ret);
+/*
+ * internal function used to allocate blocks for delayed data of dirty pages
+ * to be written back, in batches of consecutive pages locked at once
+ *
+ * @mapping: the address space of the file
+ * @wbc: a control structure which tells the writeback code what to do
+ *
+ * return: 0 on success, error code otherwise
+ */
+static int wtfs_map_delayed(struct address_space * mapping,
+	struct writeback_control * wbc)
+{
+	struct inode * vi = mapping->host;
+	struct page * batch[WTFS_DELALLOC_BATCH];
+	struct page * page = NULL;
+	struct buffer_head * bh = NULL, * head = NULL;
+	struct pagevec pvec;
+	pgoff_t index, end;
+	unsigned int nr = 0, i;
+	int delayed, err, ret = 0;
+
+	if (wbc->range_cyclic) {
+		index = 0;
+		end = -1;
+	} else {
+		index = wbc->range_start >> PAGE_SHIFT;
+		end = wbc->range_end >> PAGE_SHIFT;
+	}
 
-	/* update position pointer */
-	*ppos += ret;
+	pagevec_init(&pvec, 0);
+	while (ret == 0 && index <= end &&
+		pagevec_lookup_tag(&pvec, mapping, &index, PAGECACHE_TAG_DIRTY,
+		PAGEVEC_SIZE)) {
+		for (i = 0; i < pagevec_count(&pvec); ++i) {
+			page = pvec.pages[i];
+			if (page->index > end) {
+				break;
+			}
 
-	/* update file size */
-	i_size_write(vi, *ppos);
-	mark_inode_dirty(vi);
+			/* a batch holds consecutive pages only */
+			if (nr > 0 && (nr == WTFS_DELALLOC_BATCH ||
+				batch[nr - 1]->index + 1 != page->index)) {
+				ret = __wtfs_flush_batch(vi, batch, &nr);
+				if (ret < 0) {
+					break;
+				}
+			}
 
-	/* record the position written */
-	file_pos->pos = *ppos;
+			lock_page(page);
+			delayed = 0;
+			if (page->mapping == mapping && PageDirty(page) &&
+				page_has_buffers(page)) {
+				bh = head = page_buffers(page);
+				do {
+					if (buffer_delay(bh) &&
+						!buffer_mapped(bh)) {
+						delayed = 1;
+					}
+				} while ((bh = bh->b_this_page) != head);
+			}
+			if (delayed) {
+				get_page(page);
+				batch[nr++] = page;
+			} else {
+				unlock_page(page);
+			}
+		}
+		pagevec_release(&pvec);
+		cond_resched();
+	}
 
+	if (nr > 0 && (err = __wtfs_flush_batch(vi, batch, &nr)) < 0 &&
+		ret == 0) {
+		ret = err;
+	}
 	return ret;
+}
+
+/********************* implementation of write_begin **************************/
 
-error:
-	if (bh != NULL) {
-		brelse(bh);
+/*
+ * drop the page cache and blocks instantiated beyond the EOF by a failed write
+ *
+ * @mapping: the address space of the file
+ * @to: the end position of the failed write
+ */
+static void wtfs_write_failed(struct address_space * mapping, loff_t to)
+{
+	struct inode * vi = mapping->host;
+	loff_t size = i_size_read(vi);
+
+	if (to > size) {
+		truncate_pagecache(vi, size);
+		wtfs_truncate_extents(vi, DIV_ROUND_UP(size, WTFS_DATA_SIZE));
+	}
+}
+
+/*
+ * routine called by the generic buffered write code to prepare a page to write
+ *
+ * @file: the VFS file structure
+ * @mapping: the address space of the file
+ * @pos: position to write
+ * @len: length to write
+ * @flags: flags for grab_cache_page_write_begin()
+ * @pagep: place to store the locked page
+ * @fsdata: private data passed to write_end, unused here
+ *
+ * return: 0 on success, error code otherwise
+ */
+static int wtfs_write_begin(struct file * file, struct address_space * mapping,
+	loff_t pos, unsigned len, unsigned flags, struct page ** pagep,
+	void ** fsdata)
+{
+	int ret;
+
+	ret = block_write_begin(mapping, pos, len, flags, pagep,
+		wtfs_da_get_block);
+	if (ret < 0) {
+		wtfs_drop_delayed(mapping, pos >> PAGE_SHIFT);
+		wtfs_write_failed(mapping, pos + len);
 	}
 	return ret;
 }
 
-/********************* implementation of llseek *******************************/
+/********************* implementation of write_end ****************************/
 
 /*
- * routine called when the VFS needs to move the file position index
+ * routine called by the generic buffered write code after data is copied into
+ * the page, which gives back the space reserved for delayed blocks left
+ * without data by a short copy
  *
  * @file: the VFS file structure
- * @offset: the offset to move from the current position
- * @whence: the current position to start seeking, can be SEEK_SET, SEEK_CUR or
- *          SEEK_END
+ * @mapping: the address space of the file
+ * @pos: position written
+ * @len: length meant to be written
+ * @copied: length actually copied
+ * @page: the locked page
+ * @fsdata: private data from write_begin, unused here
  *
- * return: the offset from the beginning of the file after seeking on success,
- *         error code otherwise
+ * return: bytes committed on success, error code otherwise
  */
-static loff_t wtfs_llseek(struct file * file, loff_t offset, int whence)
+static int wtfs_write_end(struct file * file, struct address_space * mapping,
+	loff_t pos, unsigned len, unsigned copied, struct page * page,
+	void * fsdata)
 {
-	struct inode * vi = file_inode(file);
-	struct super_block * vsb = vi->i_sb;
-	struct wtfs_inode_info * info = WTFS_INODE_INFO(vi);
-	struct wtfs_file_pos * file_pos = file->private_data;
-	struct buffer_head * bh = NULL, * bh2 = NULL;
-	uint64_t file_size = i_size_read(vi);
-	uint64_t seek_pos;
-	uint64_t seek_blk, current_blk, last_blk, i;
-	uint64_t blk_no;
-	int ret = -EINVAL;
+	int ret;
 
-	wtfs_debug("llseek called, inode %lu, file size %llu, "
-		"current pos %llu, start pos %d, offset %llu\n",
-		vi->i_ino, file_size, file->f_pos, whence, offset);
+	ret = generic_write_end(file, mapping, pos, len, copied, page, fsdata);
+	if (copied < len) {
+		wtfs_drop_delayed(mapping, pos >> PAGE_SHIFT);
+	}
+	return ret;
+}
 
-	/*
-	 * in llseek, we update not only file position pointer, but also blk_no
-	 * field in struct wtfs_file_pos
-	 */
-	switch (whence) {
-	case SEEK_SET:
-		/* check if exceeding the file size */
-		seek_pos = offset;
-		if (seek_pos < 0) {
-			goto error;
-		}
-		if (seek_pos > file_size) {
-			goto beyond_eof;
-		}
+/*
+ * drop the delayed buffers of a page that hold no data, which are left clean
+ * by a failed or short write, and give back the space reserved for them
+ *
+ * @mapping: the address space of the file
+ * @index: index of the page
+ */
+static void wtfs_drop_delayed(struct address_space * mapping, pgoff_t index)
+{
+	struct buffer_head * bh = NULL, * head = NULL;
+	struct page * page = NULL;
+	uint64_t delayed = 0;
 
-		/* get block number of the seek_blk-th block */
-		seek_blk = seek_pos / WTFS_DATA_SIZE;
-		bh = wtfs_get_linked_block(vsb, info->first_block, seek_blk,
-			&blk_no);
-		if (IS_ERR(bh)) {
-			ret = PTR_ERR(bh);
-			goto error;
-		}
-		brelse(bh);
+	if ((page = find_lock_page(mapping, index)) == NULL) {
+		return;
+	}
+	if (page->mapping == mapping && page_has_buffers(page)) {
+		bh = head = page_buffers(page);
+		do {
+			if (buffer_delay(bh) && !buffer_mapped(bh) &&
+				!buffer_dirty(bh)) {
+				clear_buffer_delay(bh);
+				clear_buffer_new(bh);
+				++delayed;
+			}
+		} while ((bh = bh->b_this_page) != head);
+	}
+	unlock_page(page);
+	put_page(page);
+	wtfs_release_delayed(mapping->host->i_sb, delayed);
+}
+
+/********************* implementation of invalidatepage ***********************/
 
-		file->f_pos = file_pos->pos = offset;
-		file_pos->blk_no = blk_no; /* update block number */
+/*
+ * routine called by the VM when a page is removed from the page cache, in
+ * whole or in part, which gives back the space reserved for its delayed blocks
+ *
+ * @page: the locked page
+ * @offset: the start of the range to invalidate in the page
+ * @length: the length of the range
+ */
+static void wtfs_invalidatepage(struct page * page, unsigned int offset,
+	unsigned int length)
+{
+	struct buffer_head * bh = NULL, * head = NULL;
+	unsigned int start = 0, stop = offset + length;
+	uint64_t delayed = 0;
+
+	if (page_has_buffers(page)) {
+		bh = head = page_buffers(page);
+		do {
+			/* only buffers wholly in the range are discarded */
+			if (start >= offset && start + bh->b_size <= stop &&
+				buffer_delay(bh) && !buffer_mapped(bh)) {
+				++delayed;
+			}
+			start += bh->b_size;
+		} while ((bh = bh->b_this_page) != head);
+	}
 
-		wtfs_debug("seek to %llu-th block %llu\n", seek_blk, blk_no);
+	block_invalidatepage(page, offset, length);
+	wtfs_release_delayed(page->mapping->host->i_sb, delayed);
+}
 
-		return file->f_pos;
+/********************* implementation of releasepage **************************/
 
-	case SEEK_CUR:
-		/* check if exceeding the file size */
-		seek_pos = file->f_pos + offset;
-		if (seek_pos < 0) {
-			goto error;
-		}
-		if (seek_pos > file_size) {
-			goto beyond_eof;
+/*
+ * routine called by the VM to free the buffers of a clean page before the page
+ * is reclaimed, which also gives back the space reserved for delayed buffers
+ * among them
+ *
+ * @page: the locked page
+ * @gfp: allocation flags, unused here
+ *
+ * return: 1 if the buffers are freed, 0 otherwise
+ */
+static int wtfs_releasepage(struct page * page, gfp_t gfp)
+{
+	struct super_block * vsb = page->mapping->host->i_sb;
+	struct buffer_head * bh = NULL, * head = NULL;
+	uint64_t delayed = 0;
+
+	bh = head = page_buffers(page);
+	do {
+		if (buffer_delay(bh) && !buffer_mapped(bh)) {
+			++delayed;
 		}
+	} while ((bh = bh->b_this_page) != head);
 
-		seek_blk = seek_pos / WTFS_DATA_SIZE;
-		current_blk = file->f_pos / WTFS_DATA_SIZE;
-		if (seek_blk == current_blk) {
-			/*
-			 * current position and seeking position are in the
-			 * same block
-			 */
-			file->f_pos = file_pos->pos = seek_pos;
-
-			wtfs_debug("seek to %llu-th block %llu\n",
-				seek_blk, file_pos->blk_no);
-
-			return file->f_pos;
-		} else if (seek_blk > current_blk) {
-			/*
-			 * current position and seeking position are not in the
-			 * same block, and the seeking position is ahead of the
-			 * current, so we do seeking by starting reading the
-			 * link from the current block
-			 */
-			bh = wtfs_get_linked_block(vsb, file_pos->blk_no,
-				seek_blk - current_blk, &blk_no);
-			if (IS_ERR(bh)) {
-				ret = PTR_ERR(bh);
-				goto error;
-			}
-			brelse(bh);
+	if (!try_to_free_buffers(page)) {
+		return 0;
+	}
+	wtfs_release_delayed(vsb, delayed);
+	return 1;
+}
 
-			file->f_pos = file_pos->pos = seek_pos;
-			file_pos->blk_no = blk_no; /* update block number */
+/********************* implementation of bmap *********************************/
 
-			wtfs_debug("seek to %llu-th block %llu\n",
-				seek_blk, blk_no);
+/*
+ * routine called by the VFS to map a logical block to a physical block
+ *
+ * @mapping: the address space of the file
+ * @block: logical block index in the file
+ *
+ * return: the physical block number, 0 if it is a hole
+ */
+static sector_t wtfs_bmap(struct address_space * mapping, sector_t block)
+{
+	return generic_block_bmap(mapping, block, wtfs_get_block);
+}
 
-			return file->f_pos;
-		}
-		/*
-		 * in other cases, we have no efficient way to do seeking from
-		 * the current position, so just seek from the beginning
-		 */
-		return wtfs_llseek(file, seek_pos, SEEK_SET);
-
-	case SEEK_END:
-		/* check if exceeding the file size */
-		seek_pos = file_size + offset;
-		if (seek_pos < 0) {
-			goto error;
-		}
-		if (seek_pos > file_size) {
-			goto beyond_eof;
-		}
+/********************* implementation of direct_IO ****************************/
 
-		seek_blk = seek_pos / WTFS_DATA_SIZE;
-		current_blk = file->f_pos / WTFS_DATA_SIZE;
-		if (seek_blk == current_blk) {
-			/*
-			 * current position and seeking position are in the
-			 * same block
-			 *
-			 * this is the only special case we can fast deal with
-			 * in a single-chained file
-			 */
-			file->f_pos = file_pos->pos = seek_pos;
-
-			wtfs_debug("seek to %llu-th block %llu\n",
-				seek_blk, file_pos->blk_no);
-
-			return file->f_pos;
-		}
-		/*
-		 * in other cases, we have no efficient way to do seeking from
-		 * the EOF, so just seek from the beginning
-		 */
-		return wtfs_llseek(file, seek_pos, SEEK_SET);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 7, 0)
+/*
+ * routine called by the generic read/write code for O_DIRECT requests, the
+ * blocks of the whole request are mapped run by run via wtfs_get_block and
+ * each physically contiguous run is submitted as one bio
+ *
+ * @iocb: the kernel I/O control block
+ * @iter: the user buffers
+ *
+ * return: bytes transferred on success, error code otherwise
+ */
+static ssize_t wtfs_direct_IO(struct kiocb * iocb, struct iov_iter * iter)
+{
+	struct address_space * mapping = iocb->ki_filp->f_mapping;
+	struct inode * vi = mapping->host;
+	size_t count = iov_iter_count(iter);
+	loff_t offset = iocb->ki_pos;
+	ssize_t ret;
+
+	if (iov_iter_rw(iter) == READ) {
+		return blockdev_direct_IO(iocb, vi, iter, wtfs_get_block);
+	}
 
-	default:
-		goto error;
+	ret = __blockdev_direct_IO(iocb, vi, vi->i_sb->s_bdev, iter,
+		wtfs_dio_get_block, wtfs_end_dio_write, NULL,
+		DIO_LOCKING | DIO_SKIP_HOLES);
+	if (ret < 0) {
+		wtfs_write_failed(mapping, offset + count);
 	}
+	return ret;
+}
 
-	/*
-	 * seeking position beyond the EOF, we have to first pre-allocate enough
-	 * blocks for the hole and then update those stuffs
-	 */
-beyond_eof:
-	seek_blk = seek_pos / WTFS_DATA_SIZE;
-	current_blk = file->f_pos / WTFS_DATA_SIZE;
+/*
+ * get_block used by direct writes, which defers the completion of a request
+ * writing to unwritten blocks to process context, and tells it by b_private,
+ * which direct I/O keeps across calls and passes to wtfs_end_dio_write
+ *
+ * @vi: the VFS inode of the regular file
+ * @iblock: the first logical block index in the file
+ * @bh_result: the buffer_head to map
+ * @create: whether to allocate a new block if the logical block is a hole
+ *
+ * return: 0 on success, error code otherwise
+ */
+static int wtfs_dio_get_block(struct inode * vi, sector_t iblock,
+	struct buffer_head * bh_result, int create)
+{
+	int ret = wtfs_get_block(vi, iblock, bh_result, create);
+
+	if (ret == 0 && buffer_unwritten(bh_result)) {
+		set_buffer_defer_completion(bh_result);
+		bh_result->b_private = vi;
+	}
+	return ret;
+}
+
+/*
+ * routine called when a direct write completes, converting the unwritten
+ * blocks it has written to
+ *
+ * @iocb: the kernel I/O control block
+ * @offset: the start of the range written
+ * @size: bytes written
+ * @private: non-NULL if any block written was unwritten
+ *
+ * return: 0 on success, error code otherwise
+ */
+static int wtfs_end_dio_write(struct kiocb * iocb, loff_t offset,
+	ssize_t size, void * private)
+{
+	struct inode * vi = file_inode(iocb->ki_filp);
+	uint64_t first, last;
+
+	if (private == NULL || size <= 0) {
+		return 0;
+	}
+	first = offset >> vi->i_blkbits;
+	last = (offset + size - 1) >> vi->i_blkbits;
+	return wtfs_convert_range(vi, first, last - first + 1);
+}
+#endif
 
-	/* get the last block */
-	bh = wtfs_get_last_linked_block(vsb, file_pos->blk_no, &last_blk,
-		&blk_no);
-	if (IS_ERR(bh)) {
-		ret = PTR_ERR(bh);
-		goto error;
+/********************* implementation of release ******************************/
+
+/*
+ * routine called by the VFS when the last reference to an open file is closed
+ *
+ * @vi: the VFS inode of the regular file
+ * @file: the VFS file structure
+ *
+ * return: 0
+ */
+static int wtfs_release(struct inode * vi, struct file * file)
+{
+	/* the last writer gives back the blocks reserved for appending */
+	if ((file->f_mode & FMODE_WRITE) &&
+		atomic_read(&(vi->i_writecount)) == 1) {
+		wtfs_rsv_release(vi);
+	}
+	return 0;
+}
+
+/********************* implementation of fsync ********************************/
+
+/*
+ * routine called by the fsync(2) and fdatasync(2) system calls
+ *
+ * only what belongs to this file is written back: data in the range, which
+ * also allocates its delayed blocks, the extent blocks attached to the inode,
+ * the inode itself and the bitmaps dirtied since the last fsync
+ *
+ * with a journal, all of the metadata is in the transaction recorded in the
+ * inode, so we only wait for its commit, which also carries the changes of
+ * everyone else made in the meantime
+ *
+ * @file: the VFS file structure
+ * @start: offset of the first byte to sync
+ * @end: offset of the last byte to sync
+ * @datasync: nonzero for fdatasync(2)
+ *
+ * return: 0 on success, error code otherwise
+ */
+static int wtfs_fsync(struct file * file, loff_t start, loff_t end,
+	int datasync)
+{
+	struct inode * vi = file->f_mapping->host;
+	int ret;
+
+	if (WTFS_SB_INFO(vi->i_sb)->journal != NULL) {
+		ret = filemap_write_and_wait_range(file->f_mapping, start,
+			end);
+		if (ret < 0) {
+			return ret;
+		}
+		return wtfs_journal_sync_inode(vi, datasync);
 	}
-	last_blk += current_blk;
 
 	/*
-	 * make a cross-block hole
-	 * here we do not free previously allocated blocks if an error
-	 * occurred because those blocks will be freed when releasing
-	 * the file
+	 * for fdatasync(2) this skips the inode if it is only I_DIRTY_SYNC,
+	 * which is the case when nothing but timestamps has changed
 	 */
-	i = seek_blk - last_blk;
-	while (i > 0) {
-		if ((blk_no = wtfs_alloc_block(vsb)) == 0) {
-			brelse(bh);
-			ret = -ENOSPC;
-			goto error;
-		}
-		bh2 = wtfs_init_linked_block(vsb, blk_no, bh);
-		if (IS_ERR(bh2)) {
-			wtfs_free_block(vsb, blk_no);
-			brelse(bh);
-			ret = -EIO;
-			goto error;
-		}
-		brelse(bh);
-		bh = bh2;
-		--i;
+	if ((ret = __generic_file_fsync(file, start, end, datasync)) < 0) {
+		return ret;
 	}
-	brelse(bh);
-	vi->i_blocks += seek_blk - last_blk;
-	mark_inode_dirty(vi);
+	if ((ret = wtfs_sync_bitmaps(vi->i_sb)) < 0) {
+		return ret;
+	}
+	return blkdev_issue_flush(vi->i_sb->s_bdev, GFP_KERNEL, NULL);
+}
+
+/********************* implementation of mmap *********************************/
 
-	file->f_pos = file_pos->pos = seek_pos;
-	file_pos->blk_no = blk_no; /* update block number */
+/*
+ * routine called by the VFS to map a regular file into memory
+ *
+ * @file: the VFS file structure
+ * @vma: the virtual memory area to map
+ *
+ * return: 0 on success, error code otherwise
+ */
+static int wtfs_file_mmap(struct file * file, struct vm_area_struct * vma)
+{
+	file_accessed(file);
+	vma->vm_ops = &wtfs_file_vm_ops;
+	return 0;
+}
 
-	wtfs_debug("seek to %llu-th block %llu\n", seek_blk, blk_no);
+/*
+ * routine called when a read-only mapped page is about to become writable,
+ * we allocate its blocks here so that running out of space is reported to
+ * the writer instead of being lost at writeback
+ *
+ * @vma: the virtual memory area
+ * @vmf: the fault information
+ *
+ * return: VM_FAULT_* code
+ */
+static int wtfs_page_mkwrite(struct vm_area_struct * vma,
+	struct vm_fault * vmf)
+{
+	struct inode * vi = file_inode(vma->vm_file);
+	int ret;
 
-	return file->f_pos;
+	sb_start_pagefault(vi->i_sb);
+	file_update_time(vma->vm_file);
+	ret = block_page_mkwrite(vma, vmf, wtfs_da_get_block);
+	sb_end_pagefault(vi->i_sb);
 
-error:
-	return ret;
+	return block_page_mkwrite_return(ret);
 }
 
-/********************* implementation of open *********************************/
+/********************* implementation of truncate *****************************/
 
 /*
- * routine called by the VFS when an inode should be opened
+ * truncate a regular file to the specified size
  *
- * @vi: the VFS inode to open
- * @file: the VFS file structure
+ * @vi: the VFS inode of the regular file
+ * @size: the new size
  *
  * return: 0 on success, error code otherwise
  */
-static int wtfs_open(struct inode * vi, struct file * file)
+int wtfs_truncate(struct inode * vi, loff_t size)
+{
+	int ret;
+
+	wtfs_debug("truncate called, inode %lu, size %llu\n", vi->i_ino, size);
+
+	/* zero the tail of the last block so that extending reads zeros */
+	ret = block_truncate_page(vi->i_mapping, size, wtfs_get_block);
+	if (ret < 0) {
+		return ret;
+	}
+
+	/* drop the page cache behind the new EOF */
+	truncate_setsize(vi, size);
+
+	/* then free all blocks behind the EOF */
+	ret = wtfs_truncate_extents(vi, DIV_ROUND_UP(size, WTFS_DATA_SIZE));
+	if (ret < 0) {
+		wtfs_error("failed to truncate inode %lu\n", vi->i_ino);
+		return ret;
+	}
+
+	vi->i_ctime = vi->i_mtime = CURRENT_TIME_SEC;
+	mark_inode_dirty(vi);
+	return 0;
+}
+
+/********************* implementation of fallocate ****************************/
+
+/*
+ * internal function used to zero part of a block through the page cache, if
+ * it is inside the EOF and mapped to a block or cached in a page
+ *
+ * a page may hold data of a block not allocated yet or of an unwritten one,
+ * which would be written back later, so only a hole without any page cached
+ * is skipped
+ *
+ * @vi: the VFS inode of the regular file
+ * @pos: position to zero from
+ * @len: length to zero, not crossing the block
+ *
+ * return: 0 on success, error code otherwise
+ */
+static int __wtfs_zero_partial(struct inode * vi, loff_t pos, loff_t len)
 {
 	struct wtfs_inode_info * info = WTFS_INODE_INFO(vi);
-	struct wtfs_file_pos * data = NULL;
-	int ret = -EINVAL;
-
-	wtfs_debug("open called, inode %lu\n", vi->i_ino);
-
-	if (file->private_data == NULL) {
-		/* alloc a new struct wtfs_file_pos */
-		data = (struct wtfs_file_pos *)kzalloc(sizeof(*data),
-			GFP_KERNEL);
-		if (data == NULL) {
-			ret = -ENOMEM;
-			goto error;
-		}
+	struct address_space * mapping = vi->i_mapping;
+	struct page * page = NULL;
+	void * fsdata = NULL;
+	uint64_t blk_no;
+	loff_t size = i_size_read(vi);
+	int ret;
 
-		/* set private_data */
-		data->blk_no = info->first_block;
-		file->private_data = data;
+	if (pos >= size) {
 		return 0;
 	}
+	if (len > size - pos) {
+		len = size - pos;
+	}
 
-error:
-	return ret;
+	mutex_lock(&(info->extent_mutex));
+	ret = wtfs_map_block(vi, pos >> vi->i_blkbits, 0, &blk_no, NULL);
+	mutex_unlock(&(info->extent_mutex));
+	if (ret < 0) {
+		return ret;
+	}
+
+	/* nothing to do with a hole that has no page */
+	if (blk_no == 0) {
+		page = find_get_page(mapping, pos >> PAGE_SHIFT);
+		if (page == NULL) {
+			return 0;
+		}
+		put_page(page);
+		page = NULL;
+	}
+
+	ret = pagecache_write_begin(NULL, mapping, pos, len, 0, &page, &fsdata);
+	if (ret < 0) {
+		return ret;
+	}
+	zero_user(page, pos & (PAGE_SIZE - 1), len);
+	ret = pagecache_write_end(NULL, mapping, pos, len, len, page, fsdata);
+	return ret < 0 ? ret : 0;
 }
 
-/********************* implementation of release ******************************/
+/*
+ * internal function used to free the blocks of a range of a regular file
+ *
+ * blocks fully inside the range are freed, while partial blocks at both ends
+ * are zeroed
+ *
+ * @vi: the VFS inode of the regular file
+ * @offset: the start of the range
+ * @len: the length of the range
+ *
+ * return: 0 on success, error code otherwise
+ */
+static int wtfs_punch_hole(struct inode * vi, loff_t offset, loff_t len)
+{
+	loff_t end = offset + len;
+	loff_t first = round_up(offset, WTFS_DATA_SIZE);
+	loff_t last = round_down(end, WTFS_DATA_SIZE);
+	int ret;
+
+	/* the range is inside a single block */
+	if (first > last) {
+		return __wtfs_zero_partial(vi, offset, len);
+	}
+
+	if (offset < first &&
+		(ret = __wtfs_zero_partial(vi, offset, first - offset)) < 0) {
+		return ret;
+	}
+	if (last < end &&
+		(ret = __wtfs_zero_partial(vi, last, end - last)) < 0) {
+		return ret;
+	}
+	if (first == last) {
+		return 0;
+	}
+
+	truncate_pagecache_range(vi, first, last - 1);
+	return wtfs_punch_range(vi, first >> vi->i_blkbits,
+		last >> vi->i_blkbits);
+}
 
 /*
- * routine called when the last reference to an open file is closed
+ * internal function used to preallocate blocks for a range of a regular file
  *
- * @vi: the VFS inode associated with the file
- * @file: the VFS file structure
+ * blocks are allocated as unwritten extents, which read back as zeros until
+ * they are written
  *
- * return: 0
+ * @vi: the VFS inode of the regular file
+ * @offset: the start of the range
+ * @len: the length of the range
+ *
+ * return: 0 on success, error code otherwise
  */
-static int wtfs_release(struct inode * vi, struct file * file)
+static int wtfs_preallocate(struct inode * vi, loff_t offset, loff_t len)
 {
-	struct super_block * vsb = vi->i_sb;
 	struct wtfs_inode_info * info = WTFS_INODE_INFO(vi);
-	struct buffer_head * bh = NULL;
-	struct wtfs_data_block * blk = NULL;
-	uint64_t min_blocks = i_size_read(vi) / WTFS_DATA_SIZE + 1;
-	uint64_t next;
-	uint64_t i;
-
-	wtfs_debug("release called, inode %lu\n", vi->i_ino);
-
-	if (file->private_data != NULL) {
-		/* release the memory we alloc at the open call */
-		kfree(file->private_data);
-	}
-
-	/* do shrink on files that hold one or more idle blocks */
-	if (min_blocks < vi->i_blocks) {
-		/* skip active blocks */
-		i = 0;
-		next = info->first_block;
-		while (next != 0) {
-			if ((bh = sb_bread(vsb, next)) == NULL) {
-				wtfs_error("unable to read the block %llu\n",
-					next);
-				goto error;
-			}
-			blk = (struct wtfs_data_block *)bh->b_data;
-
-			next = wtfs64_to_cpu(blk->next);
-			/* set the pointer of the last active block to 0 */
-			if ((++i) == min_blocks) {
-				blk->next = 0;
-				mark_buffer_dirty(bh);
-				brelse(bh);
-				break;
-			}
-			brelse(bh);
+	uint64_t iblock = offset >> vi->i_blkbits;
+	uint64_t end = (offset + len + WTFS_DATA_SIZE - 1) >> vi->i_blkbits;
+	uint64_t blk_no, length;
+	handle_t * handle = NULL;
+	int ret = 0;
+
+	/* each run allocated is a transaction of its own */
+	while (iblock < end) {
+		if (fatal_signal_pending(current)) {
+			ret = -EINTR;
+			break;
 		}
-
-		if (i < min_blocks || next == 0) {
-			wtfs_error("something strange happened on inode %lu\n",
-				vi->i_ino);
-			goto error;
+		handle = wtfs_journal_start(vi->i_sb,
+			WTFS_JOURNAL_MAP_CREDITS);
+		if (IS_ERR(handle)) {
+			ret = PTR_ERR(handle);
+			break;
+		}
+		length = end - iblock;
+		mutex_lock(&(info->extent_mutex));
+		ret = wtfs_map_block(vi, iblock,
+			WTFS_MAP_CREATE | WTFS_MAP_UNWRITTEN, &blk_no,
+			&length);
+		mutex_unlock(&(info->extent_mutex));
+		wtfs_journal_stop(handle);
+		if (ret < 0) {
+			break;
 		}
+		iblock += length;
+	}
+	return ret < 0 ? ret : 0;
+}
 
-		/* recycle remaining idle blocks */
-		while (i < vi->i_blocks && next != 0) {
-			if ((bh = sb_bread(vsb, next)) == NULL) {
-				wtfs_error("unable to read the block %llu\n",
-					next);
-				goto error;
-			}
-			blk = (struct wtfs_data_block *)bh->b_data;
+/*
+ * routine called by the VFS to manipulate the space of a regular file
+ *
+ * @file: the VFS file structure
+ * @mode: FALLOC_FL_KEEP_SIZE to preallocate without changing the size, or
+ *        FALLOC_FL_PUNCH_HOLE with it to free a range
+ * @offset: the start of the range
+ * @len: the length of the range
+ *
+ * return: 0 on success, error code otherwise
+ */
+static long wtfs_fallocate(struct file * file, int mode, loff_t offset,
+	loff_t len)
+{
+	struct inode * vi = file_inode(file);
+	long ret = 0;
 
-			wtfs_free_block(vsb, next);
-			next = wtfs64_to_cpu(blk->next);
-			++i;
-			brelse(bh);
-		}
+	wtfs_debug("fallocate called, inode %lu, mode %d, offset %lld, "
+		"len %lld\n", vi->i_ino, mode, offset, len);
 
-		vi->i_blocks = min_blocks;
-		mark_inode_dirty(vi);
+	if (mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE)) {
+		return -EOPNOTSUPP;
 	}
 
-	return 0;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 5, 0)
+	mutex_lock(&(vi->i_mutex));
+#else
+	inode_lock(vi);
+#endif
 
-error:
-	wtfs_error("failed to do shrink on inode %lu\n", vi->i_ino);
-	return 0;
+	if (mode & FALLOC_FL_PUNCH_HOLE) {
+		ret = wtfs_punch_hole(vi, offset, len);
+	} else {
+		if (!(mode & FALLOC_FL_KEEP_SIZE) &&
+			offset + len > i_size_read(vi) &&
+			(ret = inode_newsize_ok(vi, offset + len)) < 0) {
+			goto out;
+		}
+		ret = wtfs_preallocate(vi, offset, len);
+		if (ret == 0 && !(mode & FALLOC_FL_KEEP_SIZE) &&
+			offset + len > i_size_read(vi)) {
+			i_size_write(vi, offset + len);
+		}
+	}
+	if (ret == 0) {
+		vi->i_ctime = vi->i_mtime = CURRENT_TIME_SEC;
+	}
+	mark_inode_dirty(vi);
+
+out:
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 5, 0)
+	mutex_unlock(&(vi->i_mutex));
+#else
+	inode_unlock(vi);
+#endif
+	return ret;
 }
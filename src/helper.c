@@ -24,13 +24,37 @@
 #include <linux/vfs.h>
 #include <linux/buffer_head.h>
 #include <linux/err.h>
+#include <linux/vmalloc.h>
 
 #include "wtfs.h"
 
 /* declaration of internal helper functions */
-static uint64_t __wtfs_alloc_obj(struct super_block * vsb, uint64_t entry);
-static void __wtfs_free_obj(struct super_block * vsb, uint64_t entry,
+static uint64_t __wtfs_alloc_obj(struct super_block * vsb, uint64_t entry,
+	uint64_t goal, uint64_t min, uint64_t max,
+	struct wtfs_rsv_window * rsv, uint64_t * count);
+static uint64_t __wtfs_rsv_take(struct super_block * vsb,
+	struct wtfs_rsv_window * rsv, uint64_t goal, uint64_t max,
+	uint64_t * count);
+static uint64_t __wtfs_rsv_clip(struct wtfs_sb_info * sbi, uint64_t start,
+	uint64_t end, uint64_t * clipped_end);
+static void __wtfs_rsv_insert(struct wtfs_sb_info * sbi,
+	struct wtfs_rsv_window * rsv);
+static void __wtfs_rsv_remove(struct wtfs_sb_info * sbi,
+	struct wtfs_rsv_window * rsv);
+static int __wtfs_new_symlink_inode(struct super_block * vsb, uint64_t owner,
+	uint64_t inode_no, const char * path, size_t length);
+static void __wtfs_delete_symlink_inode(struct super_block * vsb,
+	uint64_t inode_no);
+static int __wtfs_free_obj(struct super_block * vsb, uint64_t entry,
 	uint64_t no);
+static void __wtfs_dirty_bitmap(struct super_block * vsb, uint64_t entry,
+	uint64_t count, struct buffer_head * bh);
+static int __wtfs_sync_bitmaps(struct super_block * vsb, uint64_t entry,
+	uint64_t total, unsigned long * dirty);
+static struct buffer_head * wtfs_get_entry_at(struct inode * dir_vi,
+	struct dentry * dentry, int * slot);
+static struct buffer_head * __wtfs_locate_entry(struct inode * dir_vi,
+	struct dentry * dentry, int * slot);
 
 /********************* implementation of wtfs_iget ****************************/
 
@@ -103,6 +127,7 @@ struct inode * wtfs_iget(struct super_block * vsb, uint64_t inode_no)
 		i_size_write(vi, wtfs64_to_cpu(inode->file_size));
 		vi->i_op = &wtfs_file_inops;
 		vi->i_fop = &wtfs_file_ops;
+		vi->i_mapping->a_ops = &wtfs_aops;
 		break;
 
 	case S_IFLNK:
@@ -146,7 +171,7 @@ struct wtfs_inode * wtfs_get_inode(struct super_block * vsb, uint64_t inode_no,
 	struct buffer_head ** pbh)
 {
 	struct wtfs_sb_info * sbi = WTFS_SB_INFO(vsb);
-	uint64_t count, offset;
+	uint64_t count, offset, blk_no;
 	int ret = -EINVAL;
 
 	/* first check if inode number is valid */
@@ -159,11 +184,16 @@ struct wtfs_inode * wtfs_get_inode(struct super_block * vsb, uint64_t inode_no,
 	count = (inode_no - WTFS_ROOT_INO) / WTFS_INODE_COUNT_PER_TABLE;
 	offset = (inode_no - WTFS_ROOT_INO) % WTFS_INODE_COUNT_PER_TABLE;
 
-	/* get the count-th inode table from linked list */
-	*pbh = wtfs_get_linked_block(vsb, sbi->inode_table_first, count, NULL);
-	if (IS_ERR(*pbh)) {
-		ret = PTR_ERR(*pbh);
-		*pbh = NULL;
+	/* get the count-th inode table by the index built at mount */
+	if (count >= sbi->inode_table_count) {
+		wtfs_error("invalid inode table %llu\n", count);
+		goto error;
+	}
+	blk_no = wtfs_meta_block(sbi->inode_table_index,
+		sbi->inode_table_first, count);
+	if ((*pbh = sb_bread(vsb, blk_no)) == NULL) {
+		wtfs_error("unable to read the block %llu\n", blk_no);
+		ret = -EIO;
 		goto error;
 	}
 
@@ -260,6 +290,65 @@ error:
 	return ERR_PTR(ret);
 }
 
+/********************* implementation of wtfs_build_linked_index **************/
+
+/*
+ * walk the block linked list once and record the block number of each block
+ *
+ * @vsb: the VFS super block structure
+ * @entry: the entry block number
+ * @count: count of blocks expected in the linked list
+ *
+ * return: the array of block numbers on success, error code otherwise
+ *         it must be freed by vfree() outside after this function being called
+ */
+uint64_t * wtfs_build_linked_index(struct super_block * vsb, uint64_t entry,
+	uint64_t count)
+{
+	struct wtfs_sb_info * sbi = WTFS_SB_INFO(vsb);
+	struct wtfs_linked_block * blk = NULL;
+	struct buffer_head * bh = NULL;
+	uint64_t * index = NULL;
+	uint64_t next, i;
+	int ret = -EINVAL;
+
+	if (count == 0) {
+		wtfs_error("empty linked list at block %llu\n", entry);
+		goto error;
+	}
+
+	if ((index = vmalloc(count * sizeof(uint64_t))) == NULL) {
+		ret = -ENOMEM;
+		goto error;
+	}
+
+	next = entry;
+	for (i = 0; i < count; ++i) {
+		if (next < WTFS_RB_INODE_TABLE || next >= sbi->block_count) {
+			wtfs_error("invalid block number %llu in linked list\n",
+				next);
+			goto error;
+		}
+		if ((bh = sb_bread(vsb, next)) == NULL) {
+			wtfs_error("unable to read the block %llu\n", next);
+			ret = -EIO;
+			goto error;
+		}
+		blk = (struct wtfs_linked_block *)bh->b_data;
+		index[i] = next;
+		next = wtfs64_to_cpu(blk->next);
+		brelse(bh);
+	}
+
+	return index;
+
+error:
+	if (index != NULL) {
+		vfree(index);
+	}
+	return ERR_PTR(ret);
+}
+
 /********************* implementation of wtfs_get_last_linked_block ***********/
 
 /*
@@ -324,85 +413,105 @@ error:
 /********************* implementation of bitmap operations ********************/
 
 /*
- * set a bit in bitmap
+ * get the specified bitmap by the index built at mount
  *
- * @vsb: the VSF super block structure
+ * @vsb: the VFS super block structure
  * @entry: block number of the first bitmap
  * @count: index of bitmap
- * @offset: index of the bit in bitmap
  *
- * return: 0 on success, error code otherwise
+ * return: the buffer_head of the bitmap on success, error code otherwise
+ *         it must be released outside after this function being called
  */
-int wtfs_set_bitmap_bit(struct super_block * vsb, uint64_t entry,
-	uint64_t count, uint64_t offset)
+struct buffer_head * wtfs_get_bitmap_block(struct super_block * vsb,
+	uint64_t entry, uint64_t count)
 {
+	struct wtfs_sb_info * sbi = WTFS_SB_INFO(vsb);
 	struct buffer_head * bh = NULL;
+	struct buffer_head ** pinned = NULL;
+	uint64_t * index = NULL;
+	uint64_t total, blk_no;
+
+	/* find out which bitmap chain it is */
+	if (entry == sbi->block_bitmap_first) {
+		index = sbi->block_bitmap_index;
+		pinned = sbi->block_bitmap_bh;
+		total = sbi->block_bitmap_count;
+	} else if (entry == sbi->inode_bitmap_first) {
+		index = sbi->inode_bitmap_index;
+		pinned = sbi->inode_bitmap_bh;
+		total = sbi->inode_bitmap_count;
+	} else {
+		return wtfs_get_linked_block(vsb, entry, count, NULL);
+	}
 
-	bh = wtfs_get_linked_block(vsb, entry, count, NULL);
-	if (IS_ERR(bh)) {
-		return PTR_ERR(bh);
+	if (count >= total) {
+		wtfs_error("invalid bitmap %llu of chain %llu\n", count, entry);
+		return ERR_PTR(-EINVAL);
 	}
 
-	if (!wtfs_test_bit(offset, bh->b_data)) {
-		wtfs_set_bit(offset, bh->b_data);
-		mark_buffer_dirty(bh);
+	/* pinned bitmaps need no I/O at all */
+	if (pinned != NULL) {
+		get_bh(pinned[count]);
+		return pinned[count];
 	}
-	brelse(bh);
-	return 0;
+
+	blk_no = wtfs_meta_block(index, entry, count);
+	if ((bh = sb_bread(vsb, blk_no)) == NULL) {
+		wtfs_error("unable to read the bitmap %llu\n", blk_no);
+		return ERR_PTR(-EIO);
+	}
+	return bh;
 }
 
 /*
- * clear a bit in bitmap
+ * test a bit in bitmap
  *
  * @vsb: the VSF super block structure
  * @entry: block number of the first bitmap
  * @count: index of bitmap
  * @offset: index of the bit in bitmap
  *
- * return: 0 on success, error code otherwise
+ * return: bit status (0 or 1) on success, error code otherwise
  */
-int wtfs_clear_bitmap_bit(struct super_block * vsb, uint64_t entry,
+int wtfs_test_bitmap_bit(struct super_block * vsb, uint64_t entry,
 		uint64_t count, uint64_t offset)
 {
 	struct buffer_head * bh = NULL;
+	int ret;
 
-	bh = wtfs_get_linked_block(vsb, entry, count, NULL);
+	bh = wtfs_get_bitmap_block(vsb, entry, count);
 	if (IS_ERR(bh)) {
 		return PTR_ERR(bh);
 	}
 
-	if (wtfs_test_bit(offset, bh->b_data)) {
-		wtfs_clear_bit(offset, bh->b_data);
-		mark_buffer_dirty(bh);
-	}
+	ret = wtfs_test_bit(offset, bh->b_data);
 	brelse(bh);
-	return 0;
+	return ret;
 }
 
 /*
- * test a bit in bitmap
+ * mark a bitmap dirty, and remember it for the next fsync
  *
- * @vsb: the VSF super block structure
+ * bitmaps are shared by all files, so unlike extent blocks they cannot be
+ * attached to the inode that dirtied them, with a journal the fsync waits for
+ * the commit instead
+ *
+ * @vsb: the VFS super block structure
  * @entry: block number of the first bitmap
  * @count: index of bitmap
- * @offset: index of the bit in bitmap
- *
- * return: bit status (0 or 1) on success, error code otherwise
+ * @bh: buffer_head of the bitmap
  */
-int wtfs_test_bitmap_bit(struct super_block * vsb, uint64_t entry,
-		uint64_t count, uint64_t offset)
+static void __wtfs_dirty_bitmap(struct super_block * vsb, uint64_t entry,
+	uint64_t count, struct buffer_head * bh)
 {
-	struct buffer_head * bh = NULL;
-	int ret;
+	struct wtfs_sb_info * sbi = WTFS_SB_INFO(vsb);
 
-	bh = wtfs_get_linked_block(vsb, entry, count, NULL);
-	if (IS_ERR(bh)) {
-		return PTR_ERR(bh);
+	wtfs_journal_dirty(vsb, NULL, bh);
+	if (entry == sbi->block_bitmap_first) {
+		set_bit(count, sbi->block_bitmap_dirty);
+	} else if (entry == sbi->inode_bitmap_first) {
+		set_bit(count, sbi->inode_bitmap_dirty);
 	}
-
-	ret = wtfs_test_bit(offset, bh->b_data);
-	brelse(bh);
-	return ret;
 }
 
 /********************* implementation of wtfs_init_linked_block ***************/
@@ -430,14 +539,20 @@ struct buffer_head * wtfs_init_linked_block(struct super_block * vsb,
 		goto error;
 	}
 
+	if ((ret = wtfs_journal_access(vsb, bh)) < 0) {
+		goto error;
+	}
 	blk = (struct wtfs_linked_block *)bh->b_data;
 	memset(blk, 0, sizeof(*blk));
-	mark_buffer_dirty(bh);
+	wtfs_journal_dirty(vsb, NULL, bh);
 
 	if (prev != NULL) {
+		if ((ret = wtfs_journal_access(vsb, prev)) < 0) {
+			goto error;
+		}
 		blk = (struct wtfs_linked_block *)prev->b_data;
 		blk->next = cpu_to_wtfs64(blk_no);
-		mark_buffer_dirty(prev);
+		wtfs_journal_dirty(vsb, NULL, prev);
 	}
 
 	return bh;
@@ -459,173 +574,656 @@ error:
  * return: block number on success, 0 otherwise
  */
 uint64_t wtfs_alloc_block(struct super_block * vsb)
+{
+	return wtfs_alloc_blocks(vsb, 0, 1, 1, NULL);
+}
+
+/*
+ * alloc a run of physically contiguous free blocks near a goal
+ *
+ * @vsb: the VFS super block structure
+ * @goal: the block number we would like to start from, 0 if no preference
+ * @min: the least count of blocks acceptable
+ * @max: the most count of blocks wanted
+ * @count: place to store how many blocks are allocated, can be NULL
+ *
+ * return: the first block number on success, 0 otherwise
+ */
+uint64_t wtfs_alloc_blocks(struct super_block * vsb, uint64_t goal,
+	uint64_t min, uint64_t max, uint64_t * count)
 {
 	struct wtfs_sb_info * sbi = WTFS_SB_INFO(vsb);
-	uint64_t blk_no;
+	uint64_t blk_no, n = 0;
 
-	/*
-	 * if total block count is smaller than that one block bitmap can state,
-	 * we have to do this check explicitly
-	 */
-	if (sbi->free_block_count == 0) {
-		return 0;
+	blk_no = __wtfs_alloc_obj(vsb, sbi->block_bitmap_first, goal, min, max,
+		NULL, &n);
+	if (blk_no != 0) {
+		percpu_counter_sub(&(sbi->free_block_count), n);
 	}
+	if (count != NULL) {
+		*count = n;
+	}
+	return blk_no;
+}
 
-	blk_no = __wtfs_alloc_obj(vsb, sbi->block_bitmap_first);
-	if (blk_no != 0) {
-		--sbi->free_block_count;
-		wtfs_sync_super(vsb, 0);
+/*
+ * alloc a run of data blocks for a regular file from its reservation window
+ *
+ * as long as the file is appended, that is, goal is where the window starts,
+ * blocks are handed out from the window, otherwise a new window is reserved
+ * behind the blocks allocated, and the window grows each time it is used up
+ *
+ * @vi: the VFS inode of the regular file
+ * @goal: the block number we would like to start from
+ * @max: the most count of blocks wanted
+ * @count: place to store how many blocks are allocated, can be NULL
+ *
+ * return: the first block number on success, 0 otherwise
+ */
+uint64_t wtfs_alloc_blocks_rsv(struct inode * vi, uint64_t goal,
+	uint64_t max, uint64_t * count)
+{
+	struct super_block * vsb = vi->i_sb;
+	struct wtfs_sb_info * sbi = WTFS_SB_INFO(vsb);
+	uint64_t blk_no, n = 0;
 
-		wtfs_debug("free blocks: %llu\n", sbi->free_block_count);
+	blk_no = __wtfs_alloc_obj(vsb, sbi->block_bitmap_first, goal, 1, max,
+		&(WTFS_INODE_INFO(vi)->rsv), &n);
+	if (blk_no != 0) {
+		percpu_counter_sub(&(sbi->free_block_count), n);
+	}
+	if (count != NULL) {
+		*count = n;
 	}
 	return blk_no;
 }
 
 /*
- * internal function used to alloc a free block/inode
+ * internal function used to alloc a run of free blocks/inodes
+ *
+ * allocation is next-fit: without a goal we start from where the last object
+ * was allocated, by this CPU for blocks, and groups known to have fewer free
+ * bits than wanted by their in-memory free counts are skipped without their
+ * bitmaps being read, so the cost does not grow as the filesystem fills
+ *
+ * within a group we take the first run of max free bits, or the longest run
+ * of at least min bits if there is no such one, and runs never cross groups
+ *
+ * free blocks in reservation windows are skipped, unless they are in the
+ * window given, from which blocks are taken first, and if there is no space
+ * left but in windows, all windows are dropped and we try again
  *
  * @vsb: the VFS super block structure
  * @entry: block number of the first block/inode bitmap
+ * @goal: the block/inode number to search from, 0 to use the rotor
+ * @min: the least count of objects acceptable
+ * @max: the most count of objects wanted
+ * @rsv: the reservation window to allocate blocks from, can be NULL
+ * @count: place to store how many objects are allocated
  *
- * return: block/inode number on success, 0 otherwise
+ * return: the first block/inode number on success, 0 otherwise
  */
-static uint64_t __wtfs_alloc_obj(struct super_block * vsb, uint64_t entry)
+static uint64_t __wtfs_alloc_obj(struct super_block * vsb, uint64_t entry,
+	uint64_t goal, uint64_t min, uint64_t max,
+	struct wtfs_rsv_window * rsv, uint64_t * count)
 {
+	struct wtfs_sb_info * sbi = WTFS_SB_INFO(vsb);
 	struct wtfs_bitmap_block * bitmap = NULL;
+	struct wtfs_group * groups = NULL, * group = NULL;
 	struct buffer_head * bh = NULL;
-	uint64_t next, i, j;
+	void * scan = NULL;
+	uint64_t total, limit, valid, start, from, i, j, k, e, n, no = 0;
+	uint64_t best = 0, best_len, len, want, base;
+	int is_block, skip_rsv, seen_free, retried = 0;
+
+	is_block = (entry == sbi->block_bitmap_first);
+	if (is_block) {
+		total = sbi->block_bitmap_count;
+		limit = sbi->block_count;
+		groups = sbi->block_groups;
+	} else {
+		total = sbi->inode_bitmap_count;
+		limit = total * WTFS_BITMAP_SIZE * 8;
+		groups = sbi->inode_groups;
+	}
+	max = wtfs_max(wtfs_min(max, WTFS_BITMAP_SIZE * 8), 1);
+	min = wtfs_min(wtfs_max(min, 1), max);
 
-	/* find the first zero bit in bitmaps */
-	next = entry;
-	i = 0; /* bitmap counter */
-	while (next != 0) {
-		if ((bh = sb_bread(vsb, next)) == NULL) {
-			wtfs_error("unable to read the bitmap %llu\n", next);
-			goto error;
+	if (goal == 0 || goal >= limit) {
+		goal = (is_block ? this_cpu_read(*(sbi->block_alloc_rotor)) :
+			sbi->inode_alloc_rotor);
+	}
+
+	/* hand out blocks from the window first */
+	if (rsv != NULL && (no = __wtfs_rsv_take(vsb, rsv, goal, max,
+		count)) != 0) {
+		return no;
+	}
+
+	/* look for a whole new window if we are to reserve one */
+	want = (rsv != NULL ? wtfs_max(max, rsv->size) : max);
+
+again:
+	skip_rsv = (is_block && sbi->rsv_count > 0);
+
+	/* one more round than total so that the start group wraps around */
+	start = goal / (WTFS_BITMAP_SIZE * 8);
+	for (n = 0; n <= total; ++n) {
+		i = (start + n) % total;
+		group = &(groups[i]);
+		if (group->free < min) {
+			continue;
 		}
-		bitmap = (struct wtfs_bitmap_block *)bh->b_data;
 
-		wtfs_debug("finding first zero bit in bitmap %llu\n", next);
-		j = wtfs_find_first_zero_bit(bitmap->data, WTFS_BITMAP_SIZE * 8);
-		if (j < WTFS_BITMAP_SIZE * 8) {
-			wtfs_debug("find a zero bit %llu in bitmap %llu\n",
-				j, next);
-			wtfs_set_bit(j, bitmap->data);
-			mark_buffer_dirty(bh);
+		/* reading and journaling may sleep, so do them unlocked */
+		bh = wtfs_get_bitmap_block(vsb, entry, i);
+		if (IS_ERR(bh)) {
+			return 0;
+		}
+		if (wtfs_journal_access(vsb, bh) < 0) {
 			brelse(bh);
-			break;
+			return 0;
 		}
+		bitmap = (struct wtfs_bitmap_block *)bh->b_data;
 
-		++i;
-		next = wtfs64_to_cpu(bitmap->next);
-		brelse(bh);
-	}
+		spin_lock(&(group->lock));
+
+		/* blocks freed but not committed yet are still taken */
+		scan = (is_block ? wtfs_journal_bitmap(vsb, bh) : bitmap->data);
+
+		/* the last bitmap may state fewer objects than it can */
+		valid = wtfs_min(limit - i * WTFS_BITMAP_SIZE * 8,
+			WTFS_BITMAP_SIZE * 8);
+
+		/* search behind the goal first, the last round wraps around */
+		from = (n == 0 ? goal % (WTFS_BITMAP_SIZE * 8) : 0);
+		base = i * WTFS_BITMAP_SIZE * 8;
+		best_len = 0;
+		seen_free = 0;
+		for (j = wtfs_find_next_zero_bit(scan, valid, from);
+			j < valid;
+			j = wtfs_find_next_zero_bit(scan, valid, k)) {
+			k = wtfs_find_next_bit(scan, valid, j);
+			seen_free = 1;
+
+			/* cut off what is reserved for others */
+			if (skip_rsv) {
+				spin_lock(&(sbi->rsv_lock));
+				j = __wtfs_rsv_clip(sbi, base + j, base + k,
+					&e) - base;
+				spin_unlock(&(sbi->rsv_lock));
+				if (j >= k) {
+					continue;
+				}
+				k = e - base;
+			}
 
-	/* obj used up */
-	if (next == 0) {
-		return 0;
-	}
+			if (k - j > best_len) {
+				best = j;
+				best_len = k - j;
+			}
+			if (best_len >= want) {
+				break;
+			}
+		}
 
-	j += i * WTFS_BITMAP_SIZE * 8;
-	return j;
+		if (best_len >= min) {
+			len = wtfs_min(best_len, max);
+			wtfs_debug("find %llu zero bits from %llu in bitmap "
+				"%llu\n", len, best, i);
+			wtfs_bitmap_set(bitmap->data, best, len);
+			group->free -= len;
+			no = base + best;
+			if (is_block) {
+				this_cpu_write(*(sbi->block_alloc_rotor),
+					no + len - 1);
+			} else {
+				sbi->inode_alloc_rotor = no + len - 1;
+			}
+			*count = len;
+
+			/* keep the rest of the run for the file */
+			if (rsv != NULL && wtfs_min(best_len, want) > len) {
+				rsv->start = no + len;
+				rsv->end = no + wtfs_min(best_len, want);
+				spin_lock(&(sbi->rsv_lock));
+				__wtfs_rsv_insert(sbi, rsv);
+				spin_unlock(&(sbi->rsv_lock));
+			}
+			spin_unlock(&(group->lock));
 
-error:
-	if (bh != NULL) {
+			__wtfs_dirty_bitmap(vsb, entry, i, bh);
+			brelse(bh);
+			return no;
+		}
+
+		/* the count was wrong, correct it */
+		if (from == 0 && !seen_free) {
+			wtfs_error("bitmap %llu has no free bit but %llu "
+				"counted\n", i, group->free);
+			group->free = 0;
+		}
+		spin_unlock(&(group->lock));
 		brelse(bh);
 	}
+
+	/* free space may be held by windows only */
+	if (skip_rsv && !retried) {
+		spin_lock(&(sbi->rsv_lock));
+		wtfs_rsv_drop(sbi, (uint64_t)-1);
+		spin_unlock(&(sbi->rsv_lock));
+		retried = 1;
+		goto again;
+	}
 	return 0;
 }
 
-/********************* implementation of wtfs_alloc_free_inode ****************/
+/********************* implementation of reservation windows ******************/
 
 /*
- * alloc a free inode
+ * internal function used to take blocks from the front of a reservation
+ * window, which is dropped if the file is not appended where it starts
+ *
+ * the window is looked at under rsv_lock, as others may drop it at any time,
+ * and looked at again once the lock of its group is taken
  *
  * @vsb: the VFS super block structure
+ * @rsv: the reservation window
+ * @goal: the block number the file would like to allocate
+ * @max: the most count of blocks wanted
+ * @count: place to store how many blocks are allocated
  *
- * return: inode number on success, 0 otherwise
+ * return: the first block number on success, 0 otherwise
  */
-uint64_t wtfs_alloc_free_inode(struct super_block * vsb)
+static uint64_t __wtfs_rsv_take(struct super_block * vsb,
+	struct wtfs_rsv_window * rsv, uint64_t goal, uint64_t max,
+	uint64_t * count)
 {
 	struct wtfs_sb_info * sbi = WTFS_SB_INFO(vsb);
-	uint64_t inode_no;
+	struct wtfs_bitmap_block * bitmap = NULL;
+	struct wtfs_group * group = NULL;
+	struct buffer_head * bh = NULL;
+	uint64_t i, offset, start, n = 0, no = 0;
 
-	inode_no = __wtfs_alloc_obj(vsb, sbi->inode_bitmap_first);
-	if (inode_no != 0) {
-		++sbi->inode_count;
-		wtfs_sync_super(vsb, 0);
+	spin_lock(&(sbi->rsv_lock));
+	if (RB_EMPTY_NODE(&(rsv->node))) {
+		spin_unlock(&(sbi->rsv_lock));
+		return 0;
+	}
+	if (goal != rsv->start) {
+		goto drop;
+	}
+	start = rsv->start;
+	spin_unlock(&(sbi->rsv_lock));
 
-		wtfs_debug("inodes: %llu\n", sbi->inode_count);
+	i = start / (WTFS_BITMAP_SIZE * 8);
+	offset = start % (WTFS_BITMAP_SIZE * 8);
+	bh = wtfs_get_bitmap_block(vsb, sbi->block_bitmap_first, i);
+	if (IS_ERR(bh)) {
+		spin_lock(&(sbi->rsv_lock));
+		goto drop;
 	}
-	return inode_no;
-}
+	if (wtfs_journal_access(vsb, bh) < 0) {
+		brelse(bh);
+		spin_lock(&(sbi->rsv_lock));
+		goto drop;
+	}
+	bitmap = (struct wtfs_bitmap_block *)bh->b_data;
+	group = &(sbi->block_groups[i]);
 
-/********************* implementation of wtfs_new_inode ***********************/
+	spin_lock(&(group->lock));
+	spin_lock(&(sbi->rsv_lock));
+
+	/* dropped meanwhile */
+	if (RB_EMPTY_NODE(&(rsv->node)) || rsv->start != start) {
+		spin_unlock(&(sbi->rsv_lock));
+		spin_unlock(&(group->lock));
+		brelse(bh);
+		return 0;
+	}
+
+	/* bits in the window are free, as all others skip them */
+	n = wtfs_min(max, rsv->end - rsv->start);
+	n = wtfs_find_next_bit(bitmap->data, offset + n, offset) - offset;
+	if (n > 0) {
+		wtfs_bitmap_set(bitmap->data, offset, n);
+		group->free -= n;
+		sbi->rsv_blocks -= n;
+		no = rsv->start;
+		rsv->start += n;
+		*count = n;
+	}
+
+	/* used up, so the file is streamed and deserves a larger one */
+	if (n > 0 && rsv->start >= rsv->end) {
+		rsv->size = wtfs_min(rsv->size * 2, WTFS_RSV_MAX);
+	}
+	if (n == 0 || rsv->start >= rsv->end) {
+		__wtfs_rsv_remove(sbi, rsv);
+	}
+	spin_unlock(&(sbi->rsv_lock));
+	spin_unlock(&(group->lock));
+
+	if (n > 0) {
+		__wtfs_dirty_bitmap(vsb, sbi->block_bitmap_first, i, bh);
+	}
+	brelse(bh);
+	return no;
+
+drop:
+	/* the caller of this label holds rsv_lock */
+	if (!RB_EMPTY_NODE(&(rsv->node))) {
+		__wtfs_rsv_remove(sbi, rsv);
+	}
+	spin_unlock(&(sbi->rsv_lock));
+	return 0;
+}
 
 /*
- * create a new inode
+ * internal function used to find the first part of a run of free blocks not
+ * reserved by any window
  *
- * @dir_vi: directory inode
- * @mode: file mode
- * @path: path linking to, only valid when the new inode is to be a symlink
- * @length: length of path, only valid when the new inode is to be a symlink
+ * the caller must hold rsv_lock
  *
- * return: the new inode on success, error code otherwise
+ * @sbi: the sb_info
+ * @start: the first block of the run
+ * @end: the block behind the last one of the run
+ * @clipped_end: place to store the block behind the last one of the part
+ *
+ * return: the first block of the part, no less than clipped_end if the whole
+ *         run is reserved
  */
-struct inode * wtfs_new_inode(struct inode * dir_vi, umode_t mode,
-	const char * path, size_t length)
+static uint64_t __wtfs_rsv_clip(struct wtfs_sb_info * sbi, uint64_t start,
+	uint64_t end, uint64_t * clipped_end)
 {
-	struct super_block * vsb = dir_vi->i_sb;
-	struct wtfs_sb_info * sbi = WTFS_SB_INFO(vsb);
-	struct inode * vi = NULL;
-	struct wtfs_inode_info * info = NULL;
-	struct wtfs_symlink_block * symlink = NULL;
-	struct buffer_head * bh = NULL;
-	int ret = -EINVAL;
+	struct rb_node * node = sbi->rsv_root.rb_node;
+	struct wtfs_rsv_window * rsv = NULL, * found = NULL;
+
+	/* find the first window ending behind start */
+	while (node != NULL) {
+		rsv = rb_entry(node, struct wtfs_rsv_window, node);
+		if (rsv->end <= start) {
+			node = node->rb_right;
+		} else {
+			found = rsv;
+			node = node->rb_left;
+		}
+	}
 
-	/* alloc a new VFS inode */
-	vi = new_inode(vsb);
-	if (vi == NULL) {
-		ret = -ENOMEM;
-		goto error;
+	/* skip windows covering start, and stop at the next one */
+	while (found != NULL && found->start < end && start < end) {
+		if (found->start > start) {
+			end = found->start;
+			break;
+		}
+		start = found->end;
+		node = rb_next(&(found->node));
+		found = (node != NULL ?
+			rb_entry(node, struct wtfs_rsv_window, node) : NULL);
 	}
-	info = WTFS_INODE_INFO(vi);
+	*clipped_end = end;
+	return start;
+}
 
-	/* set file type relevant stuffs */
-	switch (mode & S_IFMT) {
-	case S_IFDIR:
-		vi->i_op = &wtfs_dir_inops;
-		vi->i_fop = &wtfs_dir_ops;
-		info->dir_entry_count = 0;
-		i_size_write(vi, sbi->block_size);
-		break;
+/*
+ * internal function used to put a reservation window into sb_info
+ *
+ * the caller must hold rsv_lock
+ *
+ * @sbi: the sb_info
+ * @rsv: the reservation window, not in the tree
+ */
+static void __wtfs_rsv_insert(struct wtfs_sb_info * sbi,
+	struct wtfs_rsv_window * rsv)
+{
+	struct rb_node ** p = &(sbi->rsv_root.rb_node), * parent = NULL;
+	struct wtfs_rsv_window * cur = NULL;
+
+	while (*p != NULL) {
+		parent = *p;
+		cur = rb_entry(parent, struct wtfs_rsv_window, node);
+		if (rsv->start < cur->start) {
+			p = &(parent->rb_left);
+		} else {
+			p = &(parent->rb_right);
+		}
+	}
+	rb_link_node(&(rsv->node), parent, p);
+	rb_insert_color(&(rsv->node), &(sbi->rsv_root));
+	++sbi->rsv_count;
+	sbi->rsv_blocks += rsv->end - rsv->start;
+}
 
-	case S_IFREG:
-		vi->i_op = &wtfs_file_inops;
-		vi->i_fop = &wtfs_file_ops;
-		i_size_write(vi, 0);
-		break;
+/*
+ * internal function used to take a reservation window out of sb_info
+ *
+ * the caller must hold rsv_lock
+ *
+ * @sbi: the sb_info
+ * @rsv: the reservation window, in the tree
+ */
+static void __wtfs_rsv_remove(struct wtfs_sb_info * sbi,
+	struct wtfs_rsv_window * rsv)
+{
+	rb_erase(&(rsv->node), &(sbi->rsv_root));
+	RB_CLEAR_NODE(&(rsv->node));
+	--sbi->rsv_count;
+	sbi->rsv_blocks -= rsv->end - rsv->start;
+	rsv->start = rsv->end = 0;
+}
 
-	case S_IFLNK:
-		vi->i_op = &wtfs_symlink_inops;
-		i_size_write(vi, length);
-		break;
+/*
+ * give back the reservation window of a regular file
+ *
+ * @vi: the VFS inode of the regular file
+ */
+void wtfs_rsv_release(struct inode * vi)
+{
+	struct wtfs_sb_info * sbi = WTFS_SB_INFO(vi->i_sb);
+	struct wtfs_rsv_window * rsv = &(WTFS_INODE_INFO(vi)->rsv);
 
-	default:
-		wtfs_error("special file type not supported\n");
-		goto error;
+	spin_lock(&(sbi->rsv_lock));
+	if (!RB_EMPTY_NODE(&(rsv->node))) {
+		__wtfs_rsv_remove(sbi, rsv);
+	}
+	rsv->size = WTFS_RSV_MIN;
+	spin_unlock(&(sbi->rsv_lock));
+}
+
+/*
+ * drop reservation windows of all files
+ *
+ * the caller must hold rsv_lock
+ *
+ * @sbi: the sb_info
+ * @nr: the most count of windows to drop
+ *
+ * return: count of windows dropped
+ */
+uint64_t wtfs_rsv_drop(struct wtfs_sb_info * sbi, uint64_t nr)
+{
+	struct rb_node * node = NULL;
+	uint64_t dropped = 0;
+
+	while (dropped < nr && (node = rb_first(&(sbi->rsv_root))) != NULL) {
+		__wtfs_rsv_remove(sbi,
+			rb_entry(node, struct wtfs_rsv_window, node));
+		++dropped;
+	}
+	return dropped;
+}
+
+/********************* implementation of delayed allocation *******************/
+
+/*
+ * reserve space for blocks of buffered writes, which are allocated later at
+ * writeback, failing if free blocks not promised yet are not enough
+ *
+ * a little more is kept back for extent blocks that writeback may need
+ *
+ * @vsb: the VFS super block structure
+ * @n: count of blocks
+ *
+ * return: 0 on success, -ENOSPC otherwise
+ */
+int wtfs_reserve_delayed(struct super_block * vsb, uint64_t n)
+{
+	struct wtfs_sb_info * sbi = WTFS_SB_INFO(vsb);
+	s64 free, delayed, need;
+
+	free = percpu_counter_read_positive(&(sbi->free_block_count));
+	delayed = percpu_counter_read_positive(&(sbi->delayed_block_count));
+	need = delayed + n + (delayed + n) / WTFS_EXTENT_COUNT_PER_BLOCK + 1;
+
+	/* the approximate values may be off by the percpu batches */
+	if (free < need + 2 * percpu_counter_batch * num_online_cpus()) {
+		free = percpu_counter_sum_positive(&(sbi->free_block_count));
+		delayed = percpu_counter_sum_positive(
+			&(sbi->delayed_block_count));
+		need = delayed + n + (delayed + n) /
+			WTFS_EXTENT_COUNT_PER_BLOCK + 1;
+		if (free < need) {
+			return -ENOSPC;
+		}
+	}
+	percpu_counter_add(&(sbi->delayed_block_count), n);
+	return 0;
+}
+
+/*
+ * give back space reserved for blocks of buffered writes, when they are
+ * allocated or thrown away
+ *
+ * @vsb: the VFS super block structure
+ * @n: count of blocks
+ */
+void wtfs_release_delayed(struct super_block * vsb, uint64_t n)
+{
+	struct wtfs_sb_info * sbi = WTFS_SB_INFO(vsb);
+
+	if (n > 0) {
+		percpu_counter_sub(&(sbi->delayed_block_count), n);
+	}
+}
+
+/********************* implementation of wtfs_alloc_free_inode ****************/
+
+/*
+ * alloc a free inode
+ *
+ * @vsb: the VFS super block structure
+ * @goal: the inode number to search from, 0 for where the last one was
+ *
+ * return: inode number on success, 0 otherwise
+ */
+uint64_t wtfs_alloc_free_inode(struct super_block * vsb, uint64_t goal)
+{
+	struct wtfs_sb_info * sbi = WTFS_SB_INFO(vsb);
+	uint64_t inode_no, n;
+
+	inode_no = __wtfs_alloc_obj(vsb, sbi->inode_bitmap_first, goal, 1, 1,
+		NULL, &n);
+	if (inode_no != 0) {
+		percpu_counter_inc(&(sbi->inode_count));
+	}
+	return inode_no;
+}
+
+/********************* implementation of wtfs_new_inode ***********************/
+
+/*
+ * create a new inode
+ *
+ * @dir_vi: directory inode
+ * @mode: file mode
+ * @path: path linking to, only valid when the new inode is to be a symlink
+ * @length: length of path, only valid when the new inode is to be a symlink
+ *
+ * return: the new inode on success, error code otherwise
+ */
+struct inode * wtfs_new_inode(struct inode * dir_vi, umode_t mode,
+	const char * path, size_t length)
+{
+	struct super_block * vsb = dir_vi->i_sb;
+	struct wtfs_sb_info * sbi = WTFS_SB_INFO(vsb);
+	struct inode * vi = NULL;
+	struct wtfs_inode_info * info = NULL;
+	struct wtfs_symlink_block * symlink = NULL;
+	struct buffer_head * bh = NULL;
+	int ret = -EINVAL;
+
+	/* alloc a new VFS inode */
+	vi = new_inode(vsb);
+	if (vi == NULL) {
+		ret = -ENOMEM;
+		goto error;
+	}
+	info = WTFS_INODE_INFO(vi);
+
+	/* set file type relevant stuffs */
+	switch (mode & S_IFMT) {
+	case S_IFDIR:
+		vi->i_op = &wtfs_dir_inops;
+		vi->i_fop = &wtfs_dir_ops;
+		info->dir_entry_count = 0;
+		i_size_write(vi, sbi->block_size);
+		break;
+
+	case S_IFREG:
+		vi->i_op = &wtfs_file_inops;
+		vi->i_fop = &wtfs_file_ops;
+		vi->i_mapping->a_ops = &wtfs_aops;
+		i_size_write(vi, 0);
+		break;
+
+	case S_IFLNK:
+		vi->i_op = &wtfs_symlink_inops;
+		i_size_write(vi, length);
+		break;
+
+	default:
+		wtfs_error("special file type not supported\n");
+		goto error;
 	}
 
 	/* alloc an inode number */
-	vi->i_ino = wtfs_alloc_free_inode(vsb);
+	vi->i_ino = wtfs_alloc_free_inode(vsb, 0);
 	if (vi->i_ino == 0) {
 		wtfs_error("inode numbers have used up\n");
 		ret = -ENOSPC;
 		goto error;
 	}
 
-	/* alloc a data block and initialize it */
-	info->first_block = wtfs_alloc_block(vsb);
+	/* the inode table holding it may never have been initialized */
+	if ((ret = wtfs_init_inode_table(vsb, vi->i_ino)) < 0) {
+		goto error;
+	}
+
+	/* a short symlink takes an inode slot next to it instead of a block */
+	if (S_ISLNK(mode) && length < WTFS_FAST_SYMLINK_MAX &&
+		(sbi->features & WTFS_FEATURE_FAST_SYMLINK)) {
+		info->first_block = wtfs_alloc_free_inode(vsb, vi->i_ino + 1);
+		if (info->first_block == 0) {
+			wtfs_error("inode numbers have used up\n");
+			ret = -ENOSPC;
+			goto error;
+		}
+		if ((ret = __wtfs_new_symlink_inode(vsb, vi->i_ino,
+			info->first_block, path, length)) < 0) {
+			wtfs_free_inode(vsb, info->first_block);
+			info->first_block = 0;
+			goto error;
+		}
+		vi->i_blocks = 0;
+		goto init;
+	}
+
+	/*
+	 * alloc a data block near the parent and initialize it
+	 * for regular files, this is the first extent block
+	 */
+	info->first_block = wtfs_alloc_blocks(vsb,
+		WTFS_INODE_INFO(dir_vi)->first_block, 1, 1, NULL);
 	if (info->first_block == 0) {
 		wtfs_error("free blocks have used up\n");
 		ret = -ENOSPC;
@@ -640,14 +1238,18 @@ struct inode * wtfs_new_inode(struct inode * dir_vi, umode_t mode,
 		symlink = (struct wtfs_symlink_block *)bh->b_data;
 		symlink->length = cpu_to_wtfs16(length);
 		memcpy(symlink->path, path, length);
-		mark_buffer_dirty(bh);
+		wtfs_journal_dirty(vsb, NULL, bh);
+	} else if (S_ISREG(mode)) {
+		/* so that fsync of the new file also writes its extent block */
+		wtfs_journal_dirty(vsb, vi, bh);
 	}
 	brelse(bh);
+	vi->i_blocks = 1;
 
+init:
 	/* set other things */
 	inode_init_owner(vi, dir_vi, mode);
 	vi->i_atime = vi->i_ctime = vi->i_mtime = CURRENT_TIME_SEC;
-	vi->i_blocks = 1;
 	insert_inode_hash(vi);
 	mark_inode_dirty(vi);
 
@@ -667,6 +1269,71 @@ error:
 	return ERR_PTR(ret);
 }
 
+/*
+ * internal function used to write the extended inode record of a fast
+ * symlink
+ *
+ * @vsb: the VFS super block structure
+ * @owner: inode number of the symlink
+ * @inode_no: inode number of the record, allocated already
+ * @path: path linking to
+ * @length: length of path, less than WTFS_FAST_SYMLINK_MAX
+ *
+ * return: 0 on success, error code otherwise
+ */
+static int __wtfs_new_symlink_inode(struct super_block * vsb, uint64_t owner,
+	uint64_t inode_no, const char * path, size_t length)
+{
+	struct wtfs_symlink_inode * record = NULL;
+	struct buffer_head * bh = NULL;
+	int ret;
+
+	/* the record may be in another inode table than its owner */
+	if ((ret = wtfs_init_inode_table(vsb, inode_no)) < 0) {
+		return ret;
+	}
+
+	record = (struct wtfs_symlink_inode *)wtfs_get_inode(vsb, inode_no,
+		&bh);
+	if (IS_ERR(record)) {
+		return PTR_ERR(record);
+	}
+	if ((ret = wtfs_journal_access(vsb, bh)) < 0) {
+		brelse(bh);
+		return ret;
+	}
+	memset(record, 0, sizeof(*record));
+	record->owner = cpu_to_wtfs64(owner);
+	memcpy(record->path, path, length);
+	wtfs_journal_dirty(vsb, NULL, bh);
+	brelse(bh);
+	return 0;
+}
+
+/*
+ * internal function used to clear and free the extended inode record of a
+ * fast symlink
+ *
+ * @vsb: the VFS super block structure
+ * @inode_no: inode number of the record
+ */
+static void __wtfs_delete_symlink_inode(struct super_block * vsb,
+	uint64_t inode_no)
+{
+	struct wtfs_inode * inode = NULL;
+	struct buffer_head * bh = NULL;
+
+	inode = wtfs_get_inode(vsb, inode_no, &bh);
+	if (!IS_ERR(inode)) {
+		if (wtfs_journal_access(vsb, bh) == 0) {
+			memset(inode, 0, sizeof(struct wtfs_inode));
+			wtfs_journal_dirty(vsb, NULL, bh);
+		}
+		brelse(bh);
+	}
+	wtfs_free_inode(vsb, inode_no);
+}
+
 /********************* implementation of wtfs_free_block **********************/
 
 /*
@@ -679,12 +1346,9 @@ void wtfs_free_block(struct super_block * vsb, uint64_t blk_no)
 {
 	struct wtfs_sb_info * sbi = WTFS_SB_INFO(vsb);
 
-	if (sbi->free_block_count < sbi->block_count) {
-		__wtfs_free_obj(vsb, sbi->block_bitmap_first, blk_no);
-		++sbi->free_block_count; /* increase free block counter */
-		wtfs_sync_super(vsb, 0);
-
-		wtfs_debug("free blocks: %llu\n", sbi->free_block_count);
+	if (__wtfs_free_obj(vsb, sbi->block_bitmap_first, blk_no)) {
+		/* increase free block counter */
+		percpu_counter_inc(&(sbi->free_block_count));
 	}
 }
 
@@ -694,15 +1358,48 @@ void wtfs_free_block(struct super_block * vsb, uint64_t blk_no)
  * @vsb: the VFS super block structure
  * @entry: block number of the first block/inode bitmap
  * @no: the block/inode number
+ *
+ * return: 1 if the object was in use and is freed now, 0 otherwise
  */
-static void __wtfs_free_obj(struct super_block * vsb, uint64_t entry,
+static int __wtfs_free_obj(struct super_block * vsb, uint64_t entry,
 	uint64_t no)
 {
+	struct wtfs_sb_info * sbi = WTFS_SB_INFO(vsb);
+	struct wtfs_group * group = NULL;
+	struct buffer_head * bh = NULL;
 	uint64_t block, offset;
+	int ret = 0;
 
 	block = no / (WTFS_BITMAP_SIZE * 8);
 	offset = no % (WTFS_BITMAP_SIZE * 8);
-	wtfs_clear_bitmap_bit(vsb, entry, block, offset);
+	group = (entry == sbi->block_bitmap_first ? sbi->block_groups :
+		sbi->inode_groups) + block;
+
+	bh = wtfs_get_bitmap_block(vsb, entry, block);
+	if (IS_ERR(bh)) {
+		return 0;
+	}
+
+	/*
+	 * freed blocks must not be reused before the freeing is committed,
+	 * which the journal keeps a copy of bitmaps for
+	 */
+	if ((entry == sbi->block_bitmap_first ?
+		wtfs_journal_undo_access(vsb, bh) :
+		wtfs_journal_access(vsb, bh)) == 0) {
+		spin_lock(&(group->lock));
+		if (wtfs_test_bit(offset, bh->b_data)) {
+			wtfs_clear_bit(offset, bh->b_data);
+			++group->free;
+			ret = 1;
+		}
+		spin_unlock(&(group->lock));
+		if (ret) {
+			__wtfs_dirty_bitmap(vsb, entry, block, bh);
+		}
+	}
+	brelse(bh);
+	return ret;
 }
 
 /********************* implementation of wtfs_free_inode **********************/
@@ -717,19 +1414,18 @@ void wtfs_free_inode(struct super_block * vsb, uint64_t inode_no)
 {
 	struct wtfs_sb_info * sbi = WTFS_SB_INFO(vsb);
 
-	if (inode_no != 0 && inode_no != WTFS_ROOT_INO) {
-		__wtfs_free_obj(vsb, sbi->inode_bitmap_first, inode_no);
-		--sbi->inode_count; /* decrease inode counter */
-		wtfs_sync_super(vsb, 0);
-
-		wtfs_debug("inodes: %llu\n", sbi->inode_count);
+	if (inode_no != 0 && inode_no != WTFS_ROOT_INO &&
+		__wtfs_free_obj(vsb, sbi->inode_bitmap_first, inode_no)) {
+		/* decrease inode counter */
+		percpu_counter_dec(&(sbi->inode_count));
 	}
 }
 
 /********************* implementation of wtfs_sync_super **********************/
 
 /*
- * write back super block information to disk
+ * write back super block information to disk, this is the only place where
+ * the in-memory counters are folded into the super block
  *
  * @vsb: the VFS super block structure
  * @wait: whether to wait for the super block to be synced to disk
@@ -759,8 +1455,15 @@ int wtfs_sync_super(struct super_block * vsb, int wait)
 	sb->block_bitmap_count = cpu_to_wtfs64(sbi->block_bitmap_count);
 	sb->inode_bitmap_first = cpu_to_wtfs64(sbi->inode_bitmap_first);
 	sb->inode_bitmap_count = cpu_to_wtfs64(sbi->inode_bitmap_count);
-	sb->inode_count = cpu_to_wtfs64(sbi->inode_count);
-	sb->free_block_count = cpu_to_wtfs64(sbi->free_block_count);
+	sb->inode_count = cpu_to_wtfs64(
+		percpu_counter_sum_positive(&(sbi->inode_count)));
+	sb->free_block_count = cpu_to_wtfs64(
+		percpu_counter_sum_positive(&(sbi->free_block_count)));
+	sb->state = cpu_to_wtfs64(sbi->state);
+	sb->features = cpu_to_wtfs64(sbi->features);
+	sb->journal_first = cpu_to_wtfs64(sbi->journal_first);
+	sb->journal_count = cpu_to_wtfs64(sbi->journal_count);
+	sb->inode_table_inited = cpu_to_wtfs64(sbi->inode_table_inited);
 
 	mark_buffer_dirty(bh);
 	if (wait) {
@@ -781,6 +1484,71 @@ error:
 	return ret;
 }
 
+/********************* implementation of wtfs_sync_bitmaps ********************/
+
+/*
+ * write back and wait on the bitmaps dirtied since the last call
+ *
+ * @vsb: the VFS super block structure
+ *
+ * return: 0 on success, error code otherwise
+ */
+int wtfs_sync_bitmaps(struct super_block * vsb)
+{
+	struct wtfs_sb_info * sbi = WTFS_SB_INFO(vsb);
+	int ret;
+
+	ret = __wtfs_sync_bitmaps(vsb, sbi->block_bitmap_first,
+		sbi->block_bitmap_count, sbi->block_bitmap_dirty);
+	if (ret == 0) {
+		ret = __wtfs_sync_bitmaps(vsb, sbi->inode_bitmap_first,
+			sbi->inode_bitmap_count, sbi->inode_bitmap_dirty);
+	}
+	return ret;
+}
+
+/*
+ * write back one chain of bitmaps marked in the dirty map
+ *
+ * a bitmap that has already been written back by the flusher is skipped, and
+ * one that has left the buffer cache must have been written back too
+ *
+ * @vsb: the VFS super block structure
+ * @entry: block number of the first bitmap
+ * @total: number of bitmaps in the chain
+ * @dirty: the dirty map of the chain
+ *
+ * return: 0 on success, error code otherwise
+ */
+static int __wtfs_sync_bitmaps(struct super_block * vsb, uint64_t entry,
+	uint64_t total, unsigned long * dirty)
+{
+	struct wtfs_sb_info * sbi = WTFS_SB_INFO(vsb);
+	struct buffer_head * bh = NULL;
+	uint64_t * index = NULL;
+	uint64_t i, blk_no;
+	int ret = 0;
+
+	index = (entry == sbi->block_bitmap_first ? sbi->block_bitmap_index :
+		sbi->inode_bitmap_index);
+	for (i = find_first_bit(dirty, total); i < total;
+		i = find_next_bit(dirty, total, i + 1)) {
+		/* clear it first, a racing dirtier will set it again */
+		clear_bit(i, dirty);
+		blk_no = wtfs_meta_block(index, entry, i);
+		if ((bh = sb_find_get_block(vsb, blk_no)) == NULL) {
+			continue;
+		}
+		if (buffer_dirty(bh) && sync_dirty_buffer(bh) < 0) {
+			wtfs_error("bitmap %llu sync failed\n", blk_no);
+			set_bit(i, dirty);
+			ret = -EIO;
+		}
+		brelse(bh);
+	}
+	return ret;
+}
+
 /********************* implementation of wtfs_find_inode **********************/
 
 /*
@@ -788,48 +1556,38 @@ error:
  *
  * @dir_vi: the VFS inode of the directory
  * @dentry: the dentry to search
+ * @loc: place to store where the entry is, can be NULL
  *
  * return: inode number on success, 0 otherwise
  */
-uint64_t wtfs_find_inode(struct inode * dir_vi, struct dentry * dentry)
+uint64_t wtfs_find_inode(struct inode * dir_vi, struct dentry * dentry,
+	struct wtfs_dentry_loc * loc)
 {
-	struct super_block * vsb = dir_vi->i_sb;
-	struct wtfs_inode_info * info = WTFS_INODE_INFO(dir_vi);
 	struct wtfs_dir_block * blk = NULL;
 	struct buffer_head * bh = NULL;
-	uint64_t next = info->first_block, inode_no;
-	int i;
+	uint64_t inode_no;
+	int slot;
 
 	/* first check if name is too long */
 	if (dentry->d_name.len >= WTFS_FILENAME_MAX) {
-		goto error;
+		return 0;
 	}
 
 	/* do search */
-	while (next != 0) {
-		if ((bh = sb_bread(vsb, next)) == NULL) {
-			wtfs_error("unable to read the block %llu\n", next);
-			goto error;
-		}
-		blk = (struct wtfs_dir_block *)bh->b_data;
-		for (i = 0; i < WTFS_INODE_COUNT_PER_TABLE; ++i) {
-			inode_no = wtfs64_to_cpu(blk->entries[i].inode_no);
-			if (inode_no != 0 && strcmp(blk->entries[i].filename,
-					dentry->d_name.name) == 0) {
-				brelse(bh);
-				return inode_no;
-			}
-		}
-		next = wtfs64_to_cpu(blk->next);
-		brelse(bh);
+	bh = wtfs_find_entry(dir_vi, dentry->d_name.name, dentry->d_name.len,
+		&slot);
+	if (IS_ERR_OR_NULL(bh)) {
+		return 0;
 	}
-	return 0;
-
-error:
-	if (bh != NULL) {
-		brelse(bh);
+	blk = (struct wtfs_dir_block *)bh->b_data;
+	inode_no = wtfs64_to_cpu(blk->entries[slot].inode_no);
+	if (loc != NULL) {
+		loc->blk_no = bh->b_blocknr;
+		loc->slot = slot;
+		loc->gen = WTFS_INODE_INFO(dir_vi)->dir_gen;
 	}
-	return 0;
+	brelse(bh);
+	return inode_no;
 }
 
 /********************* implementation of wtfs_add_entry ***********************/
@@ -837,21 +1595,27 @@ error:
 /*
  * add a new entry to a directory
  *
+ * the first block is always filled first, then the entry goes to its bucket
+ * if the directory is indexed, or to the first empty slot in the block chain
+ * otherwise, a directory whose WTFS_DIR_INDEX_MIN_BLOCKS or more blocks are all
+ * full is indexed here instead of growing if the dir_index mount option is on
+ *
  * @dir_vi: the VFS inode of the directory
  * @inode_no: inode number of the new entry
  * @filename: name of the new entry
  * @length: size of name
+ * @loc: place to store where the entry is, can be NULL
  *
  * return: 0 on success, error code otherwise
  */
 int wtfs_add_entry(struct inode * dir_vi, uint64_t inode_no,
-	const char * filename, size_t length)
+	const char * filename, size_t length, struct wtfs_dentry_loc * loc)
 {
 	struct super_block * vsb = dir_vi->i_sb;
 	struct wtfs_sb_info * sbi = WTFS_SB_INFO(vsb);
 	struct wtfs_inode_info * dir_info = WTFS_INODE_INFO(dir_vi);
 	struct wtfs_dir_block * blk = NULL;
-	struct buffer_head * bh = NULL, * bh2 = NULL;
+	struct buffer_head * bh = NULL, * bh2 = NULL, * first_bh = NULL;
 	uint64_t next = dir_info->first_block, blk_no = 0;
 	int i;
 	int ret = -EIO;
@@ -868,41 +1632,71 @@ int wtfs_add_entry(struct inode * dir_vi, uint64_t inode_no,
 		goto error;
 	}
 
+	/* the first block is searched first in any case */
+	if ((first_bh = sb_bread(vsb, next)) == NULL) {
+		wtfs_error("unable to read the block %llu\n", next);
+		goto error;
+	}
+	blk = (struct wtfs_dir_block *)first_bh->b_data;
+	for (i = 0; i < WTFS_DENTRY_COUNT_PER_BLOCK; ++i) {
+		if (blk->entries[i].inode_no == 0) {
+			bh = first_bh;
+			first_bh = NULL;
+			goto found;
+		}
+	}
+
+	/* indexed directory, put it into its bucket */
+	if (blk->index != 0) {
+		goto indexed;
+	}
+
 	/* find an empty entry in existing entries */
-	while (1) {
+	next = wtfs64_to_cpu(blk->next);
+	bh = first_bh;
+	get_bh(bh);
+	while (next != 0) {
+		brelse(bh);
 		if ((bh = sb_bread(vsb, next)) == NULL) {
 			wtfs_error("unable to read the block %llu\n", next);
 			goto error;
 		}
 		blk = (struct wtfs_dir_block *)bh->b_data;
-		for (i = 0; i < WTFS_INODE_COUNT_PER_TABLE; ++i) {
+		for (i = 0; i < WTFS_DENTRY_COUNT_PER_BLOCK; ++i) {
 			/* find it */
 			if (blk->entries[i].inode_no == 0) {
-				blk->entries[i].inode_no = inode_no;
-				strncpy(blk->entries[i].filename, filename,
-					length);
-				mark_buffer_dirty(bh);
-				brelse(bh);
-				dir_vi->i_ctime = CURRENT_TIME_SEC;
-				dir_vi->i_mtime = CURRENT_TIME_SEC;
-				++dir_info->dir_entry_count;
-				mark_inode_dirty(dir_vi);
-				return 0;
+				goto found;
 			}
 		}
-		next = wtfs64_to_cpu(blk->next);
 		/*
-		 * do not release the last block because we are to set its
-		 * pointer
+		 * the last block is not released in the next round because we
+		 * are to set its pointer
 		 */
-		if (next == 0) {
-			break;
+		next = wtfs64_to_cpu(blk->next);
+	}
+
+	/*
+	 * entries used up, so index the directory if it is large enough, it
+	 * stays unindexed for now if the current transaction cannot take it
+	 */
+	if ((sbi->options & WTFS_OPT_DIR_INDEX) &&
+		dir_vi->i_blocks >= WTFS_DIR_INDEX_MIN_BLOCKS) {
+		ret = wtfs_build_dir_index(dir_vi, first_bh);
+		if (ret == 0) {
+			brelse(bh);
+			bh = NULL;
+			goto indexed;
+		}
+		if (ret != -EAGAIN) {
+			goto error;
 		}
-		brelse(bh);
 	}
+	brelse(first_bh);
+	first_bh = NULL;
 
-	/* entries used up, so we have to create a new data block */
-	if ((blk_no = wtfs_alloc_block(vsb)) == 0) {
+	/* otherwise we have to create a new data block */
+	if ((blk_no = wtfs_alloc_blocks(vsb, bh->b_blocknr, 1, 1,
+		NULL)) == 0) {
 		ret = -ENOSPC;
 		goto error;
 	}
@@ -913,28 +1707,55 @@ int wtfs_add_entry(struct inode * dir_vi, uint64_t inode_no,
 		goto error;
 	}
 	brelse(bh); /* now we can release the previous block */
-	blk = (struct wtfs_dir_block *)bh2->b_data;
-	blk->entries[0].inode_no = inode_no;
-	strncpy(blk->entries[0].filename, filename, length);
-	mark_buffer_dirty(bh2);
-	brelse(bh2);
+	bh = bh2;
+	blk = (struct wtfs_dir_block *)bh->b_data;
+	i = 0;
 
-	/* update parent directory's information */
-	dir_vi->i_ctime = dir_vi->i_mtime = CURRENT_TIME_SEC;
+	/* update parent directory's size */
 	++dir_vi->i_blocks;
 	i_size_write(dir_vi, i_size_read(dir_vi) + sbi->block_size);
+
+found:
+	if ((ret = wtfs_journal_access(vsb, bh)) < 0) {
+		goto error;
+	}
+	blk->entries[i].inode_no = cpu_to_wtfs64(inode_no);
+	memcpy(blk->entries[i].filename, filename, length);
+	wtfs_journal_dirty(vsb, NULL, bh);
+	if (loc != NULL) {
+		loc->blk_no = bh->b_blocknr;
+		loc->slot = i;
+		loc->gen = dir_info->dir_gen;
+	}
+	brelse(bh);
+	if (first_bh != NULL) {
+		brelse(first_bh);
+	}
+	goto out;
+
+indexed:
+	ret = wtfs_index_add_entry(dir_vi, first_bh, inode_no, filename,
+		length, loc);
+	if (ret < 0) {
+		goto error;
+	}
+	brelse(first_bh);
+
+out:
+	/* update parent directory's information */
+	dir_vi->i_ctime = dir_vi->i_mtime = CURRENT_TIME_SEC;
 	++dir_info->dir_entry_count;
 	mark_inode_dirty(dir_vi);
 	return 0;
 
 error:
+	if (first_bh != NULL) {
+		brelse(first_bh);
+	}
 	if (bh != NULL) {
 		brelse(bh);
 	}
-	if (bh2 != NULL) {
-		brelse(bh2);
-	}
-	if (blk_no != 0) {
+	if (blk_no != 0 && bh2 == NULL) {
 		wtfs_free_block(vsb, blk_no);
 	}
 	return ret;
@@ -942,58 +1763,170 @@ error:
 
 /********************* implementation of wtfs_delete_entry ********************/
 
+/*
+ * internal function used to get the entry of a dentry by the location recorded
+ * in its inode
+ *
+ * the location is only trusted if the entries of the directory have not been
+ * moved since it was recorded, and the entry there still names the inode
+ *
+ * @dir_vi: the VFS inode of the directory
+ * @dentry: the dentry
+ * @slot: place to store the index of the entry in the returned block
+ *
+ * return: the buffer_head of the block containing the entry, NULL if the
+ *         location is unknown or stale
+ *         it must be released outside after this function being called
+ */
+static struct buffer_head * wtfs_get_entry_at(struct inode * dir_vi,
+	struct dentry * dentry, int * slot)
+{
+	struct wtfs_dentry_loc * loc = NULL;
+	struct wtfs_dir_block * blk = NULL;
+	struct wtfs_dentry * entry = NULL;
+	struct buffer_head * bh = NULL;
+
+	if (dentry->d_inode == NULL) {
+		return NULL;
+	}
+	loc = &(WTFS_INODE_INFO(dentry->d_inode)->loc);
+	if (loc->blk_no == 0 || loc->gen != WTFS_INODE_INFO(dir_vi)->dir_gen) {
+		return NULL;
+	}
+
+	if ((bh = sb_bread(dir_vi->i_sb, loc->blk_no)) == NULL) {
+		return NULL;
+	}
+	blk = (struct wtfs_dir_block *)bh->b_data;
+	entry = &(blk->entries[loc->slot]);
+	if (wtfs64_to_cpu(entry->inode_no) != dentry->d_inode->i_ino ||
+		strnlen(entry->filename, WTFS_FILENAME_MAX) !=
+			dentry->d_name.len ||
+		memcmp(entry->filename, dentry->d_name.name,
+			dentry->d_name.len) != 0) {
+		brelse(bh);
+		return NULL;
+	}
+
+	*slot = loc->slot;
+	return bh;
+}
+
+/*
+ * internal function used to get the entry of a dentry, by the location
+ * recorded in its inode if still valid, or by name otherwise
+ *
+ * @dir_vi: the VFS inode of the directory
+ * @dentry: the dentry
+ * @slot: place to store the index of the entry in the returned block
+ *
+ * return: the buffer_head of the block containing the entry on success, error
+ *         code otherwise
+ *         it must be released outside after this function being called
+ */
+static struct buffer_head * __wtfs_locate_entry(struct inode * dir_vi,
+	struct dentry * dentry, int * slot)
+{
+	struct buffer_head * bh = NULL;
+
+	/* try the recorded location first */
+	bh = wtfs_get_entry_at(dir_vi, dentry, slot);
+
+	/* otherwise find the specified entry by name */
+	if (bh == NULL) {
+		bh = wtfs_find_entry(dir_vi, dentry->d_name.name,
+			dentry->d_name.len, slot);
+	}
+	if (bh == NULL) {
+		return ERR_PTR(-ENOENT);
+	}
+	return bh;
+}
+
 /*
  * delete an entry of a directory
  *
+ * the entry is cleared in place if the location recorded in the inode is still
+ * valid, so that no directory block but the one holding it is read
+ *
  * @dir_vi: the VFS inode of the directory
- * @inode_no: inode number of the entry to delete
+ * @dentry: dentry of the entry to delete
  *
  * return: 0 on success, error code otherwise
  */
-int wtfs_delete_entry(struct inode * dir_vi, uint64_t inode_no)
+int wtfs_delete_entry(struct inode * dir_vi, struct dentry * dentry)
 {
-	struct super_block * vsb = dir_vi->i_sb;
 	struct wtfs_inode_info * dir_info = WTFS_INODE_INFO(dir_vi);
 	struct wtfs_dir_block * blk = NULL;
 	struct buffer_head * bh = NULL;
-	uint64_t next = dir_info->first_block;
-	int i;
-	int ret = -EIO;
+	int slot, ret;
 
-	/* find the specified entry in existing entries */
-	while (next != 0) {
-		if ((bh = sb_bread(vsb, next)) == NULL) {
-			wtfs_error("unable to read the block %llu\n", next);
-			goto error;
-		}
-		blk = (struct wtfs_dir_block *)bh->b_data;
-		for (i = 0; i < WTFS_INODE_COUNT_PER_TABLE; ++i) {
-			if (blk->entries[i].inode_no == inode_no) {
-				memset(&(blk->entries[i]), 0,
-					sizeof(struct wtfs_dentry));
-				mark_buffer_dirty(bh);
-				brelse(bh);
-
-				/* also, update parent dir's info */
-				dir_vi->i_ctime = CURRENT_TIME_SEC;
-				dir_vi->i_mtime = CURRENT_TIME_SEC;
-				--dir_info->dir_entry_count;
-				mark_inode_dirty(dir_vi);
-				return 0;
-			}
-		}
-		next = wtfs64_to_cpu(blk->next);
+	bh = __wtfs_locate_entry(dir_vi, dentry, &slot);
+	if (IS_ERR(bh)) {
+		return PTR_ERR(bh);
+	}
+
+	if ((ret = wtfs_journal_access(dir_vi->i_sb, bh)) < 0) {
 		brelse(bh);
+		return ret;
+	}
+	blk = (struct wtfs_dir_block *)bh->b_data;
+	memset(&(blk->entries[slot]), 0, sizeof(struct wtfs_dentry));
+	wtfs_journal_dirty(dir_vi->i_sb, NULL, bh);
+	brelse(bh);
+	if (dentry->d_inode != NULL) {
+		WTFS_INODE_INFO(dentry->d_inode)->loc.blk_no = 0;
 	}
 
-	/* not found */
-	return -ENOENT;
+	/* also, update parent dir's info */
+	dir_vi->i_ctime = dir_vi->i_mtime = CURRENT_TIME_SEC;
+	--dir_info->dir_entry_count;
+	mark_inode_dirty(dir_vi);
+	return 0;
+}
 
-error:
-	if (bh != NULL) {
+/********************* implementation of wtfs_replace_entry *******************/
+
+/*
+ * make an existing entry of a directory name another inode in place, so that
+ * the name is never missing
+ *
+ * @dir_vi: the VFS inode of the directory
+ * @dentry: dentry of the entry, still naming its old inode
+ * @vi: the VFS inode the entry is to name
+ *
+ * return: 0 on success, error code otherwise
+ */
+int wtfs_replace_entry(struct inode * dir_vi, struct dentry * dentry,
+	struct inode * vi)
+{
+	struct wtfs_dentry_loc * loc = &(WTFS_INODE_INFO(vi)->loc);
+	struct wtfs_dir_block * blk = NULL;
+	struct buffer_head * bh = NULL;
+	int slot, ret;
+
+	bh = __wtfs_locate_entry(dir_vi, dentry, &slot);
+	if (IS_ERR(bh)) {
+		return PTR_ERR(bh);
+	}
+
+	if ((ret = wtfs_journal_access(dir_vi->i_sb, bh)) < 0) {
 		brelse(bh);
+		return ret;
 	}
-	return ret;
+	blk = (struct wtfs_dir_block *)bh->b_data;
+	blk->entries[slot].inode_no = cpu_to_wtfs64(vi->i_ino);
+	wtfs_journal_dirty(dir_vi->i_sb, NULL, bh);
+	WTFS_INODE_INFO(dentry->d_inode)->loc.blk_no = 0;
+	loc->blk_no = bh->b_blocknr;
+	loc->slot = slot;
+	loc->gen = WTFS_INODE_INFO(dir_vi)->dir_gen;
+	brelse(bh);
+
+	/* also, update parent dir's info */
+	dir_vi->i_ctime = dir_vi->i_mtime = CURRENT_TIME_SEC;
+	mark_inode_dirty(dir_vi);
+	return 0;
 }
 
 /********************* implementation of wtfs_delete_inode ********************/
@@ -1001,43 +1934,53 @@ error:
 /*
  * delete an inode on disk
  *
+ * this is done by evict_inode once an unlinked inode is no longer used, after
+ * its page cache is dropped so that no dirty page is written to freed blocks
+ *
  * @vi: the VFS inode structure
  */
 void wtfs_delete_inode(struct inode * vi)
 {
 	struct super_block * vsb = vi->i_sb;
-	struct wtfs_sb_info * sbi = WTFS_SB_INFO(vsb);
 	struct wtfs_inode_info * info = WTFS_INODE_INFO(vi);
-	struct wtfs_data_block * blk = NULL;
-	struct wtfs_inode_table * table = NULL;
+	struct wtfs_linked_block * blk = NULL;
+	struct wtfs_inode * inode = NULL;
 	struct buffer_head * bh = NULL;
 	uint64_t i, next;
 
-	/* first free inode number in inode bitmap */
-	wtfs_free_inode(vsb, vi->i_ino);
+	/*
+	 * data blocks of regular files are mapped by extents, and freed first
+	 * in as many transactions as they take
+	 */
+	if (S_ISREG(vi->i_mode)) {
+		wtfs_truncate_extents(vi, 0);
+	}
 
-	/* then clear inode data in inode table */
-	next = sbi->inode_table_first;
-	while (next != 0) {
-		if ((bh = sb_bread(vsb, next)) == NULL) {
-			wtfs_error("unable to read the block %llu\n", next);
-			goto error;
+	/* then clear inode data in inode table, which is directly addressed */
+	inode = wtfs_get_inode(vsb, vi->i_ino, &bh);
+	if (!IS_ERR(inode)) {
+		if (wtfs_journal_access(vsb, bh) == 0) {
+			memset(inode, 0, sizeof(struct wtfs_inode));
+			wtfs_journal_dirty(vsb, NULL, bh);
 		}
-		table = (struct wtfs_inode_table *)bh->b_data;
-		for (i = 0; i < WTFS_INODE_COUNT_PER_TABLE; ++i) {
-			if (table->inodes[i].inode_no == vi->i_ino) {
-				memset(&(table->inodes[i]), 0,
-					sizeof(struct wtfs_inode));
-				mark_buffer_dirty(bh);
-				brelse(bh);
-				goto out;
-			}
-		}
-		next = wtfs64_to_cpu(table->next);
 		brelse(bh);
+		bh = NULL;
+	}
+
+	/* then free inode number in inode bitmap */
+	wtfs_free_inode(vsb, vi->i_ino);
+
+	/* the index block of a directory is not on its block chain */
+	if (S_ISDIR(vi->i_mode)) {
+		wtfs_free_dir_index(vi);
+	}
+
+	/* a fast symlink has its extended inode record instead of blocks */
+	if (wtfs_is_fast_symlink(vi)) {
+		__wtfs_delete_symlink_inode(vsb, info->first_block);
+		return;
 	}
 
-out:
 	/* finally release file data blocks */
 	next = info->first_block;
 	while (next != 0) {
@@ -1045,11 +1988,18 @@ out:
 			wtfs_error("unable to read the block %llu\n", next);
 			goto error;
 		}
-		blk = (struct wtfs_data_block *)bh->b_data;
+		blk = (struct wtfs_linked_block *)bh->b_data;
 		i = wtfs64_to_cpu(blk->next);
+		brelse(bh);
+		bh = NULL;
+
+		/* a long chain may not fit into one transaction */
+		if (wtfs_journal_extend(vsb, 2) == -EAGAIN) {
+			wtfs_journal_restart(vsb, WTFS_JOURNAL_CREDITS);
+		}
+		wtfs_journal_forget(vsb, next);
 		wtfs_free_block(vsb, next);
 		next = i;
-		brelse(bh);
 	}
 
 	return;
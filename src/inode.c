@@ -62,6 +62,9 @@ static const char * wtfs_get_link(struct dentry * dentry, struct inode * vi,
 static void wtfs_put_link(void * cookie);
 #endif
 
+static const char * __wtfs_read_link(struct inode * vi,
+	struct buffer_head ** pbh);
+
 /* inode operations for directory */
 const struct inode_operations wtfs_dir_inops = {
 	.create = wtfs_create,
@@ -112,19 +115,27 @@ static int wtfs_create(struct inode * dir_vi, struct dentry * dentry,
 	umode_t mode, bool excl)
 {
 	struct inode * vi = NULL;
+	handle_t * handle = NULL;
 
 	wtfs_debug("create called, dir inode %lu, file '%s'\n", dir_vi->i_ino,
 		dentry->d_name.name);
 
+	handle = wtfs_journal_start(dir_vi->i_sb, WTFS_JOURNAL_CREDITS);
+	if (IS_ERR(handle)) {
+		return PTR_ERR(handle);
+	}
+
 	/* create a new inode */
 	vi = wtfs_new_inode(dir_vi, mode | S_IFREG, NULL, 0);
 	if (IS_ERR(vi)) {
+		wtfs_journal_stop(handle);
 		return PTR_ERR(vi);
 	}
 
 	/* add an entry to its parent directory */
 	wtfs_add_entry(dir_vi, vi->i_ino, dentry->d_name.name,
-		dentry->d_name.len);
+		dentry->d_name.len, &(WTFS_INODE_INFO(vi)->loc));
+	wtfs_journal_stop(handle);
 
 	d_instantiate(dentry, vi);
 
@@ -146,17 +157,19 @@ static struct dentry * wtfs_lookup(struct inode * dir_vi,
 	struct dentry * dentry, unsigned int flags)
 {
 	struct inode * vi = NULL;
+	struct wtfs_dentry_loc loc;
 	uint64_t inode_no;
 
 	wtfs_debug("lookup called, dir inode %lu, file '%s'\n", dir_vi->i_ino,
 		dentry->d_name.name);
 
-	/* find inode by name */
-	if ((inode_no = wtfs_find_inode(dir_vi, dentry)) != 0) {
+	/* find inode by name, and remember where it is for unlink */
+	if ((inode_no = wtfs_find_inode(dir_vi, dentry, &loc)) != 0) {
 		vi = wtfs_iget(dir_vi->i_sb, inode_no);
 		if (IS_ERR(vi)) {
 			return ERR_CAST(vi);
 		}
+		WTFS_INODE_INFO(vi)->loc = loc;
 	}
 
 	/* we should call d_add() no matter if we find the inode */
@@ -169,6 +182,9 @@ static struct dentry * wtfs_lookup(struct inode * dir_vi,
 /*
  * routine called to delete an inode
  *
+ * only the entry is removed here, and the inode itself is deleted when it is
+ * evicted, so that a file still open keeps its blocks until it is closed
+ *
  * @dir_vi: the VFS inode of the parent directory
  * @dentry: dentry of the file to delete
  *
@@ -176,24 +192,26 @@ static struct dentry * wtfs_lookup(struct inode * dir_vi,
  */
 static int wtfs_unlink(struct inode * dir_vi, struct dentry * dentry)
 {
-	uint64_t inode_no;
-	int ret = -ENOENT;
+	struct inode * vi = dentry->d_inode;
+	handle_t * handle = NULL;
+	int ret;
 
 	wtfs_debug("unlink called, file '%s' of inode %lu\n",
 		dentry->d_name.name, dentry->d_inode->i_ino);
 
-	/* find inode in directory entries */
-	if ((inode_no = wtfs_find_inode(dir_vi, dentry)) == 0) {
-		return ret;
+	handle = wtfs_journal_start(dir_vi->i_sb, WTFS_JOURNAL_CREDITS);
+	if (IS_ERR(handle)) {
+		return PTR_ERR(handle);
 	}
 
-	/* delete entry and inode */
-	if ((ret = wtfs_delete_entry(dir_vi, inode_no)) < 0) {
-		return ret;
+	/* delete entry, and leave the inode to evict_inode */
+	if ((ret = wtfs_delete_entry(dir_vi, dentry)) == 0) {
+		vi->i_ctime = dir_vi->i_ctime;
+		clear_nlink(vi);
 	}
-	wtfs_delete_inode(dentry->d_inode);
 
-	return 0;
+	wtfs_journal_stop(handle);
+	return ret;
 }
 
 /********************* implementation of mkdir ********************************/
@@ -211,23 +229,31 @@ static int wtfs_mkdir(struct inode * dir_vi, struct dentry * dentry,
 	umode_t mode)
 {
 	struct inode * vi = NULL;
+	handle_t * handle = NULL;
 
 	wtfs_debug("mkdir called, parent inode %lu, dir to create '%s', "
 		"mode 0%o\n", dir_vi->i_ino, dentry->d_name.name, mode);
 
+	handle = wtfs_journal_start(dir_vi->i_sb, WTFS_JOURNAL_CREDITS);
+	if (IS_ERR(handle)) {
+		return PTR_ERR(handle);
+	}
+
 	/* create a new inode */
 	vi = wtfs_new_inode(dir_vi, mode | S_IFDIR, NULL, 0);
 	if (IS_ERR(vi)) {
+		wtfs_journal_stop(handle);
 		return PTR_ERR(vi);
 	}
 
 	/* add an entry to its parent directory */
 	wtfs_add_entry(dir_vi, vi->i_ino, dentry->d_name.name,
-		dentry->d_name.len);
+		dentry->d_name.len, &(WTFS_INODE_INFO(vi)->loc));
 
 	/* add two entries of '.' and '..' to itself */
-	wtfs_add_entry(vi, vi->i_ino, ".", 1);
-	wtfs_add_entry(vi, dir_vi->i_ino, "..", 2);
+	wtfs_add_entry(vi, vi->i_ino, ".", 1, NULL);
+	wtfs_add_entry(vi, dir_vi->i_ino, "..", 2, NULL);
+	wtfs_journal_stop(handle);
 
 	d_instantiate(dentry, vi);
 
@@ -265,6 +291,10 @@ static int wtfs_rmdir(struct inode * dir_vi, struct dentry * dentry)
 /*
  * routine called to rename an inode
  *
+ * all entries are changed in one transaction, and an existing destination is
+ * unlinked by naming the inode in its entry instead, while the inode it named
+ * is deleted on eviction
+ *
  * @old_dir: the VFS inode of the old parent directory
  * @old_dentry: the old dentry of the inode
  * @new_dir: the VFS inode of the new parent directory
@@ -277,44 +307,61 @@ static int wtfs_rename(struct inode * old_dir, struct dentry * old_dentry,
 {
 	struct inode * old_vi = old_dentry->d_inode;
 	struct inode * new_vi = new_dentry->d_inode;
+	handle_t * handle = NULL;
 	int ret = -EINVAL;
 
 	wtfs_debug("rename called to move '%s' in dir of inode %lu to "
 		"'%s' in dir of inode %lu\n", old_dentry->d_name.name,
 		old_dir->i_ino, new_dentry->d_name.name, new_dir->i_ino);
 
-	/* destination entry exists, remove it */
+	handle = wtfs_journal_start(old_dir->i_sb, WTFS_JOURNAL_CREDITS);
+	if (IS_ERR(handle)) {
+		return PTR_ERR(handle);
+	}
+
+	/* destination entry exists, check if it can be replaced */
 	if (new_vi != NULL) {
 		switch (new_vi->i_mode & S_IFMT) {
 		case S_IFDIR:
-			if ((ret = wtfs_rmdir(new_dir, new_dentry)) < 0) {
-				return ret;
+			/* only '.' and '..' are left in an empty directory */
+			if (WTFS_INODE_INFO(new_vi)->dir_entry_count != 2) {
+				ret = -ENOTEMPTY;
+				goto out;
 			}
 			break;
 
 		case S_IFREG:
 		case S_IFLNK:
-			if ((ret = wtfs_unlink(new_dir, new_dentry)) < 0) {
-				return ret;
-			}
 			break;
 
 		default:
 			wtfs_error("special file type not supported\n");
-			return ret;
+			goto out;
 		}
 	}
 
-	/* remove entry in old directory */
-	if ((ret = wtfs_delete_entry(old_dir, old_vi->i_ino)) < 0) {
-		return ret;
+	/* remove entry in old directory while its location is still recorded */
+	if ((ret = wtfs_delete_entry(old_dir, old_dentry)) < 0) {
+		goto out;
 	}
 
-	/* add a new entry in new directory */
-	wtfs_add_entry(new_dir, old_vi->i_ino, new_dentry->d_name.name,
-		new_dentry->d_name.len);
+	/* make the destination entry name the inode, or add a new one */
+	if (new_vi != NULL) {
+		if ((ret = wtfs_replace_entry(new_dir, new_dentry,
+			old_vi)) < 0) {
+			goto out;
+		}
+		new_vi->i_ctime = new_dir->i_ctime;
+		clear_nlink(new_vi);
+	} else {
+		ret = wtfs_add_entry(new_dir, old_vi->i_ino,
+			new_dentry->d_name.name, new_dentry->d_name.len,
+			&(WTFS_INODE_INFO(old_vi)->loc));
+	}
 
-	return 0;
+out:
+	wtfs_journal_stop(handle);
+	return ret;
 }
 
 /********************* implementation of setattr ******************************/
@@ -340,6 +387,14 @@ static int wtfs_setattr(struct dentry * dentry, struct iattr * attr)
 		return ret;
 	}
 
+	/* regular files need their page cache and blocks truncated */
+	if ((attr->ia_valid & ATTR_SIZE) && S_ISREG(vi->i_mode) &&
+		attr->ia_size != i_size_read(vi)) {
+		if ((ret = wtfs_truncate(vi, attr->ia_size)) < 0) {
+			return ret;
+		}
+	}
+
 	/* do set attributes */
 	setattr_copy(vi, attr);
 	if (attr->ia_valid & ATTR_SIZE) {
@@ -396,6 +451,7 @@ static int wtfs_symlink(struct inode * dir_vi, struct dentry * dentry,
 	const char * symname)
 {
 	struct inode * vi = NULL;
+	handle_t * handle = NULL;
 	size_t length;
 
 	wtfs_debug("symlink called, dir inode %lu, file '%s' linking to '%s'\n",
@@ -407,15 +463,22 @@ static int wtfs_symlink(struct inode * dir_vi, struct dentry * dentry,
 		return -ENAMETOOLONG;
 	}
 
+	handle = wtfs_journal_start(dir_vi->i_sb, WTFS_JOURNAL_CREDITS);
+	if (IS_ERR(handle)) {
+		return PTR_ERR(handle);
+	}
+
 	/* create a new inode */
 	vi = wtfs_new_inode(dir_vi, S_IFLNK | S_IRWXUGO, symname, length);
 	if (IS_ERR(vi)) {
+		wtfs_journal_stop(handle);
 		return PTR_ERR(vi);
 	}
 
 	/* add an entry to its parent directory */
 	wtfs_add_entry(dir_vi, vi->i_ino, dentry->d_name.name,
-		dentry->d_name.len);
+		dentry->d_name.len, &(WTFS_INODE_INFO(vi)->loc));
+	wtfs_journal_stop(handle);
 
 	d_instantiate(dentry, vi);
 
@@ -489,41 +552,100 @@ static const char * wtfs_get_link(struct dentry * dentry, struct inode * vi,
 	struct inode * vi = dentry->d_inode;
 #endif
 
-	struct super_block * vsb = vi->i_sb;
-	struct wtfs_inode_info * info = WTFS_INODE_INFO(vi);
-	struct wtfs_symlink_block * symlink = NULL;
 	struct buffer_head * bh = NULL;
-	int ret = -EINVAL;
+	const char * path = NULL;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 2, 0)
+	char * link = NULL;
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 5, 0)
+	/* reading the target may block, which RCU walk must not */
+	if (dentry == NULL) {
+		return ERR_PTR(-ECHILD);
+	}
+#endif
 
 	wtfs_debug("follow_link called, file '%s' of inode %lu\n",
 		dentry->d_name.name, vi->i_ino);
 
-	/* read symlink block */
-	if ((bh = sb_bread(vsb, info->first_block)) == NULL) {
-		wtfs_error("unable to read the block %llu\n",
-			info->first_block);
-		ret = -EIO;
-		goto error;
+	path = __wtfs_read_link(vi, &bh);
+	if (IS_ERR(path)) {
+		return ERR_CAST(path);
 	}
-	symlink = (struct wtfs_symlink_block *)bh->b_data;
 
 	/* set link */
 #if LINUX_VERSION_CODE < KERNEL_VERSION(4, 2, 0)
-	nd_set_link(nd, symlink->path);
+	nd_set_link(nd, (char *)path);
 	return bh;
-#elif LINUX_VERSION_CODE < KERNEL_VERSION(4, 5, 0)
+#else
+	/*
+	 * keep a copy in i_link, so that the VFS follows the symlink from then
+	 * on without calling us, nor reading any block
+	 */
+	link = kstrndup(path, i_size_read(vi), GFP_NOFS);
+	if (link != NULL) {
+		if (cmpxchg(&(vi->i_link), NULL, link) != NULL) {
+			kfree(link);
+		}
+		brelse(bh);
+		bh = NULL;
+		path = vi->i_link;
+	}
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 5, 0)
 	*cookie = bh;
-	return symlink->path;
 #else
-	set_delayed_call(done, wtfs_put_link, bh);
-	return symlink->path;
+	if (bh != NULL) {
+		set_delayed_call(done, wtfs_put_link, bh);
+	}
+#endif
+	return path;
 #endif
+}
 
-error:
-	if (bh != NULL) {
-		brelse(bh);
+/*
+ * internal function used to read the target of a symlink, from its symlink
+ * block or, for a fast symlink, from its extended inode record
+ *
+ * @vi: the VFS inode of the symlink file
+ * @pbh: place to store the buffer_head holding the target, which must be
+ *       released after this function being called
+ *
+ * return: the target on success, error code otherwise
+ */
+static const char * __wtfs_read_link(struct inode * vi,
+	struct buffer_head ** pbh)
+{
+	struct super_block * vsb = vi->i_sb;
+	struct wtfs_inode_info * info = WTFS_INODE_INFO(vi);
+	struct wtfs_symlink_block * symlink = NULL;
+	struct wtfs_symlink_inode * record = NULL;
+
+	if (wtfs_is_fast_symlink(vi)) {
+		record = (struct wtfs_symlink_inode *)wtfs_get_inode(vsb,
+			info->first_block, pbh);
+		if (IS_ERR(record)) {
+			return ERR_CAST(record);
+		}
+		if (wtfs64_to_cpu(record->owner) != vi->i_ino) {
+			wtfs_error("inode %llu is not the record of symlink "
+				"%lu\n", info->first_block, vi->i_ino);
+			brelse(*pbh);
+			*pbh = NULL;
+			return ERR_PTR(-EIO);
+		}
+		return record->path;
 	}
-	return ERR_PTR(ret);
+
+	/* read symlink block */
+	if ((*pbh = sb_bread(vsb, info->first_block)) == NULL) {
+		wtfs_error("unable to read the block %llu\n",
+			info->first_block);
+		return ERR_PTR(-EIO);
+	}
+	symlink = (struct wtfs_symlink_block *)(*pbh)->b_data;
+	return symlink->path;
 }
 
 /********************* implementation of put_link *****************************/
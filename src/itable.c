@@ -0,0 +1,326 @@
+/*
+ * itable.c - implementation of wtfs lazy inode table initialization.
+ *
+ * Copyright (C) 2015 Chaos Shen
+ *
+ * This file is part of wtfs, What the fxck filesystem.  You may take
+ * the letter 'f' from, at your option, either 'fxck' or 'filesystem'.
+ *
+ * wtfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * wtfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with wtfs.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <linux/fs.h>
+#include <linux/buffer_head.h>
+#include <linux/kthread.h>
+#include <linux/sched.h>
+#include <linux/version.h>
+#include <linux/err.h>
+
+#include "wtfs.h"
+
+/*
+ * With WTFS_FEATURE_LAZY_ITABLE, mkfs.wtfs writes only the first inode table
+ * and leaves the rest of them holding whatever was on the device.  Tables
+ * before inode_table_inited of the super block are known to be zeroed or in
+ * use, the others are tracked by inode_table_ready in memory.
+ *
+ * A table holding an inode in use at mount time was initialized before, so it
+ * is ready from the start.  Any other table that is not ready is zeroed in
+ * memory under itable_mutex when an inode is allocated in it.  The inode
+ * bitmap is not consulted after mount, since a bit is set there before the
+ * table of the inode is zeroed.  Meanwhile a thread of the lowest priority
+ * zeroes the remaining tables on disk a batch at a time, sleeping several
+ * times as long as each batch took so that it yields the device to foreground
+ * I/O, and moves inode_table_inited forward behind itself.
+ *
+ * Inodes are only ever read from tables where they are in use, so the
+ * watermark on disk does not need to be exact after a crash.
+ */
+
+/* inode tables zeroed in one batch by the thread */
+#define WTFS_ITABLE_BATCH 32
+
+/* the thread sleeps this many times as long as a batch took */
+#define WTFS_ITABLE_WAIT_MULT 10
+
+/* declaration of internal helper functions */
+static int __wtfs_itable_in_use(struct super_block * vsb, uint64_t count);
+static struct buffer_head * __wtfs_zero_itable(struct super_block * vsb,
+	uint64_t count);
+static int wtfs_itable_thread(void * data);
+
+/********************* implementation of wtfs_init_inode_table ****************/
+
+/*
+ * make sure the inode table holding a newly allocated inode is initialized,
+ * zeroing it in memory if it has never been
+ *
+ * @vsb: the VFS super block structure
+ * @inode_no: the inode just allocated
+ *
+ * return: 0 on success, error code otherwise
+ */
+int wtfs_init_inode_table(struct super_block * vsb, uint64_t inode_no)
+{
+	struct wtfs_sb_info * sbi = WTFS_SB_INFO(vsb);
+	struct buffer_head * bh = NULL;
+	uint64_t count;
+	int ret = 0;
+
+	count = (inode_no - WTFS_ROOT_INO) / WTFS_INODE_COUNT_PER_TABLE;
+	if (sbi->inode_table_ready == NULL ||
+		test_bit(count, sbi->inode_table_ready)) {
+		return 0;
+	}
+
+	mutex_lock(&(sbi->itable_mutex));
+	if (test_bit(count, sbi->inode_table_ready)) {
+		goto out;
+	}
+
+	bh = __wtfs_zero_itable(vsb, count);
+	if (IS_ERR(bh)) {
+		ret = PTR_ERR(bh);
+		goto out;
+	}
+	if ((ret = wtfs_journal_access(vsb, bh)) < 0) {
+		brelse(bh);
+		goto out;
+	}
+	wtfs_journal_dirty(vsb, NULL, bh);
+	brelse(bh);
+	set_bit(count, sbi->inode_table_ready);
+
+out:
+	mutex_unlock(&(sbi->itable_mutex));
+	return ret;
+}
+
+/********************* implementation of wtfs_scan_inode_tables **************/
+
+/*
+ * mark the inode tables behind the watermark holding any inode in use as
+ * ready, which must be done at mount time before any inode is allocated
+ *
+ * @vsb: the VFS super block structure
+ *
+ * return: 0 on success, error code otherwise
+ */
+int wtfs_scan_inode_tables(struct super_block * vsb)
+{
+	struct wtfs_sb_info * sbi = WTFS_SB_INFO(vsb);
+	uint64_t count;
+	int ret;
+
+	for (count = sbi->inode_table_inited; count < sbi->inode_table_count;
+		++count) {
+		if ((ret = __wtfs_itable_in_use(vsb, count)) < 0) {
+			return ret;
+		}
+		if (ret == 1) {
+			set_bit(count, sbi->inode_table_ready);
+		}
+	}
+	return 0;
+}
+
+/********************* implementation of wtfs_start_itable_thread *************/
+
+/*
+ * start zeroing inode tables in the background if any is left, which must
+ * only be called for a filesystem mounted or being remounted read-write
+ *
+ * without the thread, tables are still zeroed when first used
+ *
+ * @vsb: the VFS super block structure
+ */
+void wtfs_start_itable_thread(struct super_block * vsb)
+{
+	struct wtfs_sb_info * sbi = WTFS_SB_INFO(vsb);
+	struct task_struct * task = NULL;
+
+	if (sbi->inode_table_ready == NULL ||
+		sbi->inode_table_inited >= sbi->inode_table_count ||
+		sbi->itable_thread != NULL) {
+		return;
+	}
+
+	task = kthread_run(wtfs_itable_thread, vsb, "wtfs_itable/%s",
+		vsb->s_id);
+	if (IS_ERR(task)) {
+		wtfs_error("unable to start the inode table thread\n");
+		return;
+	}
+	sbi->itable_thread = task;
+}
+
+/********************* implementation of wtfs_stop_itable_thread **************/
+
+/*
+ * stop zeroing inode tables in the background, safe to call more than once
+ *
+ * @sbi: the sb_info of the filesystem
+ */
+void wtfs_stop_itable_thread(struct wtfs_sb_info * sbi)
+{
+	if (sbi->itable_thread != NULL) {
+		kthread_stop(sbi->itable_thread);
+		sbi->itable_thread = NULL;
+	}
+}
+
+/********************* implementation of helper functions *********************/
+
+/*
+ * check if any inode of an inode table is in use
+ *
+ * @vsb: the VFS super block structure
+ * @count: index of the inode table
+ *
+ * return: 1 if so, 0 if not, error code otherwise
+ */
+static int __wtfs_itable_in_use(struct super_block * vsb, uint64_t count)
+{
+	struct wtfs_sb_info * sbi = WTFS_SB_INFO(vsb);
+	uint64_t inode_no, last;
+	int ret;
+
+	inode_no = count * WTFS_INODE_COUNT_PER_TABLE + WTFS_ROOT_INO;
+	last = wtfs_min(inode_no + WTFS_INODE_COUNT_PER_TABLE,
+		sbi->inode_bitmap_count * WTFS_BITMAP_SIZE * 8);
+	for (; inode_no < last; ++inode_no) {
+		ret = wtfs_test_bitmap_bit(vsb, sbi->inode_bitmap_first,
+			inode_no / (WTFS_BITMAP_SIZE * 8),
+			inode_no % (WTFS_BITMAP_SIZE * 8));
+		if (ret != 0) {
+			return ret;
+		}
+	}
+	return 0;
+}
+
+/*
+ * zero an inode table in memory, keeping it linked to the next one
+ *
+ * @vsb: the VFS super block structure
+ * @count: index of the inode table
+ *
+ * return: the buffer_head of the table on success, error code otherwise
+ *         it must be released outside after this function being called
+ */
+static struct buffer_head * __wtfs_zero_itable(struct super_block * vsb,
+	uint64_t count)
+{
+	struct wtfs_sb_info * sbi = WTFS_SB_INFO(vsb);
+	struct wtfs_inode_table * table = NULL;
+	struct buffer_head * bh = NULL;
+
+	bh = sb_getblk(vsb, sbi->inode_table_first + count);
+	if (bh == NULL) {
+		return ERR_PTR(-ENOMEM);
+	}
+
+	lock_buffer(bh);
+	table = (struct wtfs_inode_table *)bh->b_data;
+	memset(table, 0, sizeof(*table));
+	if (count + 1 < sbi->inode_table_count) {
+		table->next = cpu_to_wtfs64(sbi->inode_table_first + count + 1);
+	}
+	set_buffer_uptodate(bh);
+	unlock_buffer(bh);
+	return bh;
+}
+
+/*
+ * the thread zeroing inode tables on disk, from inode_table_inited on
+ *
+ * tables are written and waited for under itable_mutex, so that they are
+ * clean before anyone may journal them
+ *
+ * @data: the VFS super block structure
+ *
+ * return: 0
+ */
+static int wtfs_itable_thread(void * data)
+{
+	struct super_block * vsb = (struct super_block *)data;
+	struct wtfs_sb_info * sbi = WTFS_SB_INFO(vsb);
+	struct buffer_head * bhs[WTFS_ITABLE_BATCH];
+	uint64_t counts[WTFS_ITABLE_BATCH];
+	uint64_t count, end;
+	unsigned long start;
+	int i, n, ret;
+
+	set_user_nice(current, MAX_NICE);
+
+	count = sbi->inode_table_inited;
+	while (count < sbi->inode_table_count && !kthread_should_stop()) {
+		start = jiffies;
+		end = wtfs_min(count + WTFS_ITABLE_BATCH,
+			sbi->inode_table_count);
+		n = 0;
+		ret = 0;
+
+		mutex_lock(&(sbi->itable_mutex));
+		for (; count < end; ++count) {
+			if (test_bit(count, sbi->inode_table_ready)) {
+				continue;
+			}
+			bhs[n] = __wtfs_zero_itable(vsb, count);
+			if (IS_ERR(bhs[n])) {
+				ret = PTR_ERR(bhs[n]);
+				break;
+			}
+			counts[n] = count;
+			mark_buffer_dirty(bhs[n]);
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 8, 0)
+			write_dirty_buffer(bhs[n], WRITE);
+#else
+			write_dirty_buffer(bhs[n], 0);
+#endif
+			++n;
+		}
+		for (i = 0; i < n; ++i) {
+			wait_on_buffer(bhs[i]);
+			if (buffer_uptodate(bhs[i])) {
+				set_bit(counts[i], sbi->inode_table_ready);
+			} else {
+				ret = -EIO;
+			}
+			brelse(bhs[i]);
+		}
+		mutex_unlock(&(sbi->itable_mutex));
+
+		if (ret < 0) {
+			wtfs_error("zeroing inode tables stopped at %llu\n",
+				count);
+			break;
+		}
+		sbi->inode_table_inited = count;
+
+		/* a slower batch means a busier device, so wait longer */
+		schedule_timeout_interruptible(wtfs_max(jiffies - start, 1) *
+			WTFS_ITABLE_WAIT_MULT);
+	}
+
+	/* stay around until stopped, kthread_stop() needs us alive */
+	while (!kthread_should_stop()) {
+		set_current_state(TASK_INTERRUPTIBLE);
+		if (!kthread_should_stop()) {
+			schedule();
+		}
+		__set_current_state(TASK_RUNNING);
+	}
+	return 0;
+}
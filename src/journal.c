@@ -0,0 +1,478 @@
+/*
+ * journal.c - implementation of wtfs metadata journal.
+ *
+ * Copyright (C) 2015 Chaos Shen
+ *
+ * This file is part of wtfs, What the fxck filesystem.  You may take
+ * the letter 'f' from, at your option, either 'fxck' or 'filesystem'.
+ *
+ * wtfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * wtfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with wtfs.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <linux/fs.h>
+#include <linux/buffer_head.h>
+#include <linux/blkdev.h>
+#include <linux/jbd2.h>
+#include <linux/slab.h>
+#include <linux/percpu.h>
+#include <linux/err.h>
+
+#include "wtfs.h"
+
+/*
+ * With WTFS_FEATURE_JOURNAL, every change of metadata blocks (inode tables,
+ * bitmaps, directory, index, extent and symlink blocks) is made in a jbd2
+ * handle.  All handles started within a commit interval join one running
+ * transaction, so that many operations are committed to the journal with a
+ * single write and flush, and checkpointed to their home blocks later.  Data
+ * blocks are written in place and not ordered against the commit.
+ *
+ * Without a journal, all functions here fall back to plainly dirtying the
+ * buffers, so callers do not need to care whether the filesystem has one.
+ */
+
+/* declaration of internal helper functions */
+static handle_t * __wtfs_current_handle(struct super_block * vsb);
+
+/********************* implementation of wtfs_load_journal ********************/
+
+/*
+ * load the journal of a filesystem, replaying the transactions committed but
+ * not checkpointed before it went down
+ *
+ * this must be done before anything else is read from the disk, as replaying
+ * writes metadata blocks in place
+ *
+ * @vsb: the VFS super block structure
+ *
+ * return: 0 on success, error code otherwise
+ */
+int wtfs_load_journal(struct super_block * vsb)
+{
+	struct wtfs_sb_info * sbi = WTFS_SB_INFO(vsb);
+	journal_t * journal = NULL;
+	int ret = -EINVAL;
+
+	if (sbi->journal_count < WTFS_JOURNAL_MIN_BLOCKS ||
+		sbi->journal_first <= WTFS_RB_SUPER ||
+		sbi->journal_first + sbi->journal_count > sbi->block_count) {
+		wtfs_error("invalid journal of %llu blocks at %llu\n",
+			sbi->journal_count, sbi->journal_first);
+		goto error;
+	}
+
+	/* buffers to merge a block bitmap with its last committed version */
+	sbi->journal_scan = __alloc_percpu(WTFS_BITMAP_SIZE,
+		sizeof(unsigned long));
+	if (sbi->journal_scan == NULL) {
+		ret = -ENOMEM;
+		goto error;
+	}
+
+	journal = jbd2_journal_init_dev(vsb->s_bdev, vsb->s_bdev,
+		sbi->journal_first, sbi->journal_count, sbi->block_size);
+	if (journal == NULL) {
+		wtfs_error("unable to set up the journal\n");
+		ret = -ENOMEM;
+		goto error;
+	}
+	journal->j_private = vsb;
+	journal->j_flags |= JBD2_BARRIER;
+
+	if ((ret = jbd2_journal_load(journal)) < 0) {
+		wtfs_error("unable to load the journal\n");
+		goto error;
+	}
+	sbi->journal = journal;
+	return 0;
+
+error:
+	if (journal != NULL) {
+		jbd2_journal_destroy(journal);
+	}
+	return ret;
+}
+
+/********************* implementation of wtfs_destroy_journal *****************/
+
+/*
+ * commit and checkpoint everything in the journal and release it
+ *
+ * @sbi: the sb_info of the filesystem
+ */
+void wtfs_destroy_journal(struct wtfs_sb_info * sbi)
+{
+	if (sbi->journal != NULL) {
+		if (jbd2_journal_destroy(sbi->journal) < 0) {
+			wtfs_error("the journal has been aborted\n");
+		}
+		sbi->journal = NULL;
+	}
+	if (sbi->journal_scan != NULL) {
+		free_percpu(sbi->journal_scan);
+		sbi->journal_scan = NULL;
+	}
+}
+
+/********************* implementation of wtfs_journal_start *******************/
+
+/*
+ * start a handle, or join the one this task is already in
+ *
+ * @vsb: the VFS super block structure
+ * @nblocks: the most count of metadata blocks to be dirtied in the handle
+ *
+ * return: the handle on success, NULL if there is no journal, error code
+ *         otherwise
+ */
+handle_t * wtfs_journal_start(struct super_block * vsb, int nblocks)
+{
+	struct wtfs_sb_info * sbi = WTFS_SB_INFO(vsb);
+
+	if (sbi->journal == NULL) {
+		return NULL;
+	}
+	return jbd2_journal_start(sbi->journal, nblocks);
+}
+
+/*
+ * stop a handle started by wtfs_journal_start
+ *
+ * @handle: the handle, can be NULL
+ *
+ * return: 0 on success, error code otherwise
+ */
+int wtfs_journal_stop(handle_t * handle)
+{
+	if (handle == NULL) {
+		return 0;
+	}
+	return jbd2_journal_stop(handle);
+}
+
+/*
+ * make sure the current handle can dirty some more metadata blocks
+ *
+ * @vsb: the VFS super block structure
+ * @nblocks: count of metadata blocks to be dirtied
+ *
+ * return: 0 on success, -EAGAIN if the handle has to be restarted, error code
+ *         otherwise
+ */
+int wtfs_journal_extend(struct super_block * vsb, int nblocks)
+{
+	handle_t * handle = __wtfs_current_handle(vsb);
+	int ret;
+
+	if (handle == NULL || handle->h_buffer_credits >= nblocks) {
+		return 0;
+	}
+	ret = jbd2_journal_extend(handle, nblocks - handle->h_buffer_credits);
+	return (ret > 0 ? -EAGAIN : ret);
+}
+
+/*
+ * commit what the current handle has done so far and go on in a new
+ * transaction, nothing must be locked against the commit by the caller
+ *
+ * @vsb: the VFS super block structure
+ * @nblocks: the most count of metadata blocks to be dirtied from now on
+ *
+ * return: 0 on success, error code otherwise
+ */
+int wtfs_journal_restart(struct super_block * vsb, int nblocks)
+{
+	handle_t * handle = __wtfs_current_handle(vsb);
+
+	if (handle == NULL) {
+		return 0;
+	}
+	return jbd2_journal_restart(handle, nblocks);
+}
+
+/*
+ * internal function used to get the handle this task is in
+ *
+ * @vsb: the VFS super block structure
+ *
+ * return: the handle, NULL if there is no journal or no handle
+ */
+static handle_t * __wtfs_current_handle(struct super_block * vsb)
+{
+	if (WTFS_SB_INFO(vsb)->journal == NULL) {
+		return NULL;
+	}
+	return journal_current_handle();
+}
+
+/********************* implementation of wtfs_journal_access ******************/
+
+/*
+ * get write access to a metadata block before changing it
+ *
+ * @vsb: the VFS super block structure
+ * @bh: buffer_head of the metadata block
+ *
+ * return: 0 on success, error code otherwise
+ */
+int wtfs_journal_access(struct super_block * vsb, struct buffer_head * bh)
+{
+	handle_t * handle = __wtfs_current_handle(vsb);
+	int ret;
+
+	if (handle == NULL) {
+		WARN_ONCE(WTFS_SB_INFO(vsb)->journal != NULL,
+			"wtfs: block %llu changed out of a handle\n",
+			(unsigned long long)bh->b_blocknr);
+		return 0;
+	}
+	if ((ret = jbd2_journal_get_write_access(handle, bh)) < 0) {
+		wtfs_error("unable to journal the block %llu\n",
+			(unsigned long long)bh->b_blocknr);
+	}
+	return ret;
+}
+
+/*
+ * get write access to a block bitmap before freeing blocks in it, so that the
+ * journal keeps a copy of the bitmap as last committed
+ *
+ * @vsb: the VFS super block structure
+ * @bh: buffer_head of the block bitmap
+ *
+ * return: 0 on success, error code otherwise
+ */
+int wtfs_journal_undo_access(struct super_block * vsb,
+	struct buffer_head * bh)
+{
+	handle_t * handle = __wtfs_current_handle(vsb);
+	int ret;
+
+	if (handle == NULL) {
+		return wtfs_journal_access(vsb, bh);
+	}
+	if ((ret = jbd2_journal_get_undo_access(handle, bh)) < 0) {
+		wtfs_error("unable to journal the block %llu\n",
+			(unsigned long long)bh->b_blocknr);
+	}
+	return ret;
+}
+
+/********************* implementation of wtfs_journal_dirty *******************/
+
+/*
+ * mark a metadata block changed, after getting write access to it
+ *
+ * @vsb: the VFS super block structure
+ * @vi: the VFS inode whose fsync must write the block, can be NULL
+ * @bh: buffer_head of the metadata block
+ */
+void wtfs_journal_dirty(struct super_block * vsb, struct inode * vi,
+	struct buffer_head * bh)
+{
+	handle_t * handle = __wtfs_current_handle(vsb);
+	struct wtfs_inode_info * info = NULL;
+
+	if (handle == NULL) {
+		if (WTFS_SB_INFO(vsb)->journal != NULL) {
+			/* already warned by wtfs_journal_access */
+			if (!buffer_jbd(bh)) {
+				mark_buffer_dirty(bh);
+			}
+		} else if (vi != NULL) {
+			mark_buffer_dirty_inode(bh, vi);
+		} else {
+			mark_buffer_dirty(bh);
+		}
+		return;
+	}
+
+	if (jbd2_journal_dirty_metadata(handle, bh) < 0) {
+		wtfs_error("unable to journal the block %llu\n",
+			(unsigned long long)bh->b_blocknr);
+		return;
+	}
+	if (vi != NULL) {
+		info = WTFS_INODE_INFO(vi);
+		info->sync_tid = handle->h_transaction->t_tid;
+		info->datasync_tid = handle->h_transaction->t_tid;
+	}
+}
+
+/*
+ * mark the inode table block of an inode changed
+ *
+ * @vi: the VFS inode
+ * @bh: buffer_head of its inode table
+ * @datasync: whether fdatasync must wait for the change
+ */
+void wtfs_journal_dirty_inode(struct inode * vi, struct buffer_head * bh,
+	int datasync)
+{
+	handle_t * handle = __wtfs_current_handle(vi->i_sb);
+	struct wtfs_inode_info * info = WTFS_INODE_INFO(vi);
+
+	wtfs_journal_dirty(vi->i_sb, NULL, bh);
+	if (handle != NULL) {
+		info->sync_tid = handle->h_transaction->t_tid;
+		if (datasync) {
+			info->datasync_tid = handle->h_transaction->t_tid;
+		}
+	}
+}
+
+/********************* implementation of wtfs_journal_forget ******************/
+
+/*
+ * drop a metadata block about to be freed, so that neither the journal nor
+ * the buffer cache writes it over whatever it is reused for, and replay does
+ * not bring back its old content
+ *
+ * @vsb: the VFS super block structure
+ * @blk_no: block number of the metadata block
+ */
+void wtfs_journal_forget(struct super_block * vsb, uint64_t blk_no)
+{
+	handle_t * handle = __wtfs_current_handle(vsb);
+	struct buffer_head * bh = sb_find_get_block(vsb, blk_no);
+
+	if (handle == NULL) {
+		if (bh != NULL) {
+			bforget(bh);
+		}
+		return;
+	}
+
+	/* the reference of bh is dropped by revoking */
+	if (jbd2_journal_revoke(handle, blk_no, bh) < 0) {
+		wtfs_error("unable to revoke the block %llu\n", blk_no);
+	}
+}
+
+/********************* implementation of wtfs_journal_bitmap *****************/
+
+/*
+ * get the bits of a block bitmap to search free blocks in
+ *
+ * blocks freed in a transaction not committed yet must not be reused, or data
+ * written into them may overwrite metadata a crash brings back, so their bits
+ * are merged from the copy kept by undo access
+ *
+ * the caller must hold the lock of the group of the bitmap, which keeps it on
+ * this CPU as long as the bits returned are used
+ *
+ * @vsb: the VFS super block structure
+ * @bh: buffer_head of the block bitmap
+ *
+ * return: the bits to search in
+ */
+void * wtfs_journal_bitmap(struct super_block * vsb, struct buffer_head * bh)
+{
+	struct wtfs_sb_info * sbi = WTFS_SB_INFO(vsb);
+	unsigned long * scan = NULL;
+	unsigned long * data = (unsigned long *)bh->b_data;
+	unsigned long * committed = NULL;
+	size_t i;
+
+	if (sbi->journal == NULL) {
+		return bh->b_data;
+	}
+	scan = this_cpu_ptr(sbi->journal_scan);
+
+	jbd_lock_bh_state(bh);
+	if (buffer_jbd(bh)) {
+		committed = (unsigned long *)bh2jh(bh)->b_committed_data;
+	}
+	if (committed == NULL) {
+		jbd_unlock_bh_state(bh);
+		return bh->b_data;
+	}
+	for (i = 0; i < WTFS_BITMAP_SIZE / sizeof(unsigned long); ++i) {
+		scan[i] = data[i] | committed[i];
+	}
+	jbd_unlock_bh_state(bh);
+	return scan;
+}
+
+/********************* implementation of wtfs_journal_sync_inode **************/
+
+/*
+ * wait until the changes of an inode are committed to the journal
+ *
+ * @vi: the VFS inode
+ * @datasync: whether changes not needed to read its data can be skipped
+ *
+ * return: 0 on success, error code otherwise
+ */
+int wtfs_journal_sync_inode(struct inode * vi, int datasync)
+{
+	journal_t * journal = WTFS_SB_INFO(vi->i_sb)->journal;
+	struct wtfs_inode_info * info = WTFS_INODE_INFO(vi);
+	tid_t tid = (datasync ? info->datasync_tid : info->sync_tid);
+	int barrier, ret;
+
+	/* data written in place is only flushed if the commit flushes */
+	barrier = !jbd2_trans_will_send_data_barrier(journal, tid);
+	if ((ret = jbd2_complete_transaction(journal, tid)) < 0) {
+		return ret;
+	}
+	if (barrier) {
+		return blkdev_issue_flush(vi->i_sb->s_bdev, GFP_KERNEL, NULL);
+	}
+	return 0;
+}
+
+/********************* implementation of wtfs_journal_commit ******************/
+
+/*
+ * commit the running transaction
+ *
+ * @vsb: the VFS super block structure
+ * @wait: whether to wait for the commit
+ *
+ * return: 0 on success, error code otherwise
+ */
+int wtfs_journal_commit(struct super_block * vsb, int wait)
+{
+	journal_t * journal = WTFS_SB_INFO(vsb)->journal;
+	tid_t tid;
+
+	if (journal == NULL) {
+		return 0;
+	}
+	if (jbd2_journal_start_commit(journal, &tid) && wait) {
+		return jbd2_log_wait_commit(journal, tid);
+	}
+	return 0;
+}
+
+/********************* implementation of wtfs_journal_flush *******************/
+
+/*
+ * commit and checkpoint everything in the journal, so that nothing is left to
+ * be replayed, while keeping it loaded
+ *
+ * @vsb: the VFS super block structure
+ *
+ * return: 0 on success, error code otherwise
+ */
+int wtfs_journal_flush(struct super_block * vsb)
+{
+	journal_t * journal = WTFS_SB_INFO(vsb)->journal;
+
+	if (journal == NULL) {
+		return 0;
+	}
+	return jbd2_journal_flush(journal);
+}
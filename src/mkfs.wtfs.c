@@ -20,6 +20,8 @@
  * along with wtfs.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define _GNU_SOURCE
+
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/ioctl.h>
@@ -33,6 +35,7 @@
 #include <fcntl.h>
 #include <endian.h>
 #include <errno.h>
+#include <linux/falloc.h>
 #include <uuid/uuid.h>
 #include <libmount/libmount.h>
 
@@ -40,23 +43,118 @@
 
 #define BUF_SIZE 4096
 
+/* blocks zeroed by one ioctl or hole punch in deep format, 256 MiB */
+#define ZERO_CHUNK_BLOCKS 65536
+/* blocks written by one write in deep format, 4 MiB */
+#define WRITE_CHUNK_BLOCKS 1024
+
+/* where the initial metadata go */
+struct layout
+{
+	int contiguous;			/* each class in one run of blocks */
+	uint64_t inode_tables_inited;	/* inode tables written by mkfs */
+
+	/* first block of each chain, and where the rest of it starts */
+	uint64_t inode_table_first;
+	uint64_t inode_table_rest;
+	uint64_t block_bitmap_first;
+	uint64_t block_bitmap_rest;
+	uint64_t inode_bitmap_first;
+	uint64_t inode_bitmap_rest;
+
+	uint64_t root_dir;		/* the only block of root directory */
+	uint64_t journal_first;		/* first block of the journal */
+	uint64_t data_first;		/* first block not used by the above */
+};
+
+/* fills the data of the i-th block of a chain */
+typedef void (*fill_block_t)(struct wtfs_linked_block * blk, uint64_t i,
+	const void * arg);
+
+/* ways of zeroing the data area in deep format, from fastest to slowest */
+enum zero_method {
+	ZERO_BY_ZEROOUT,	/* BLKZEROOUT on a block device */
+	ZERO_BY_PUNCH,		/* punching a hole in an image file */
+	ZERO_BY_WRITE,		/* writing zeroed blocks */
+};
+
+/* progress of deep format */
+struct format_progress
+{
+	uint64_t total;		/* blocks to zero */
+	uint64_t done;		/* blocks zeroed so far */
+	uint64_t prev;		/* percentage last printed */
+	struct timespec begin;	/* when zeroing began */
+	int quiet;		/* print nothing */
+};
+
+/* magic number and type of the jbd2 journal super block */
+#define JBD2_MAGIC 0xc03b3998U
+#define JBD2_SUPERBLOCK_V2 4
+
+/* structure for jbd2 journal super block, all fields big-endian */
+struct jbd2_super_block
+{
+	uint32_t h_magic;		/* 4 bytes */
+	uint32_t h_blocktype;		/* 4 bytes */
+	uint32_t h_sequence;		/* 4 bytes */
+
+	uint32_t s_blocksize;		/* 4 bytes */
+	uint32_t s_maxlen;		/* 4 bytes */
+	uint32_t s_first;		/* 4 bytes */
+
+	uint32_t s_sequence;		/* 4 bytes */
+	uint32_t s_start;		/* 4 bytes */
+	int32_t s_errno;		/* 4 bytes */
+
+	uint32_t s_feature_compat;	/* 4 bytes */
+	uint32_t s_feature_incompat;	/* 4 bytes */
+	uint32_t s_feature_ro_compat;	/* 4 bytes */
+	uint8_t s_uuid[16];		/* 16 bytes */
+
+	uint32_t s_nr_users;		/* 4 bytes */
+	uint32_t s_dynsuper;		/* 4 bytes */
+	uint32_t s_max_transaction;	/* 4 bytes */
+	uint32_t s_max_trans_data;	/* 4 bytes */
+
+	uint8_t s_padding[176];		/* 176 bytes */
+	uint8_t s_users[16 * 48];	/* 768 bytes */
+};
+
 #ifdef __cplusplus
 extern "C" {
 #endif /* __cplusplus */
 
 static int check_mounted_fs(const char * filename);
+static void plan_layout(struct layout * lay, int contiguous, int lazy,
+	uint64_t inode_tables, uint64_t blk_bitmaps, uint64_t inode_bitmaps,
+	uint64_t journal_blocks);
+static uint64_t chain_block(uint64_t first, uint64_t rest, uint64_t i);
+static int write_chain(int fd, uint64_t first, uint64_t rest, uint64_t count,
+	uint64_t nr_write, fill_block_t fill, const void * arg);
+static int write_blocks(int fd, const void * buf, uint64_t start,
+	uint64_t count);
 static int write_boot_block(int fd);
 static int write_super_block(int fd, uint64_t blocks, uint64_t inode_tables,
-	uint64_t blk_bitmaps, uint64_t inode_bitmaps,
-	const char * label, uuid_t uuid);
-static int write_inode_table(int fd, uint64_t inode_tables);
-static int write_block_bitmap(int fd, uint64_t inode_tables,
-	uint64_t blk_bitmaps, uint64_t inode_bitmaps);
-static int write_inode_bitmap(int fd, uint64_t inode_tables,
-	uint64_t blk_bitmaps, uint64_t inode_bitmaps);
-static int write_root_dir(int fd);
-static void do_deep_format(int fd, uint64_t blocks, uint64_t inode_tables,
-	uint64_t blk_bitmaps, uint64_t inode_bitmaps, int quiet);
+	uint64_t blk_bitmaps, uint64_t inode_bitmaps, uint64_t journal_blocks,
+	const struct layout * lay, const char * label, uuid_t uuid);
+static int write_journal(int fd, uint64_t first, uint64_t journal_blocks,
+	uuid_t uuid);
+static int write_inode_table(int fd, uint64_t inode_tables,
+	const struct layout * lay);
+static int write_block_bitmap(int fd, uint64_t blk_bitmaps,
+	const struct layout * lay);
+static int write_inode_bitmap(int fd, uint64_t inode_bitmaps,
+	const struct layout * lay);
+static int write_root_dir(int fd, const struct layout * lay);
+static int do_deep_format(int fd, int blkdev, uint64_t blocks,
+	const struct layout * lay, int quiet);
+static int discard_blocks(int fd, uint64_t start, uint64_t count);
+static int zero_blocks(int fd, enum zero_method how, uint64_t start,
+	struct format_progress * prog);
+static int write_zero_chunk(int fd, void * buf, uint64_t start,
+	uint64_t count, int * direct);
+static void report_progress(struct format_progress * prog, uint64_t count);
 
 int main(int argc, char * const * argv)
 {
@@ -66,7 +164,10 @@ int main(int argc, char * const * argv)
 		{ "fast", no_argument, NULL, 'f' },
 		{ "quiet", no_argument, NULL, 'q' },
 		{ "force", no_argument, NULL, 'F' },
+		{ "contiguous", no_argument, NULL, 'c' },
+		{ "lazy-itable", no_argument, NULL, 'l' },
 		{ "imaps", required_argument, NULL, 'i' },
+		{ "journal", required_argument, NULL, 'j' },
 		{ "label", required_argument, NULL, 'L' },
 		{ "uuid", required_argument, NULL, 'U' },
 		{ "version", no_argument, NULL, 'V' },
@@ -75,7 +176,7 @@ int main(int argc, char * const * argv)
 	};
 
 	/* flags */
-	int quick = 0, quiet = 0, force = 0;
+	int quick = 0, quiet = 0, force = 0, contiguous = 0, lazy = 0;
 
 	/* file descriptor */
 	int fd = -1;
@@ -92,6 +193,12 @@ int main(int argc, char * const * argv)
 	/* inode bitmaps (default 1) */
 	int64_t inode_bitmaps = 1;
 
+	/* journal blocks (default 0, no journal) */
+	int64_t journal_blocks = 0;
+
+	/* where the initial metadata go */
+	struct layout lay;
+
 	/* minimum data blocks (not exact) */
 	uint64_t min_data_blks;
 
@@ -114,7 +221,13 @@ int main(int argc, char * const * argv)
 			     "  -f, --fast            quick format\n"
 			     "  -q, --quiet           quiet mode\n"
 			     "  -F, --force           force execution\n"
+			     "  -c, --contiguous      lay out each kind of "
+			     "metadata contiguously\n"
+			     "  -l, --lazy-itable     leave inode tables to be "
+			     "zeroed after mount\n"
 			     "  -i, --imaps=IMAPS     set inode bitmap count\n"
+			     "  -j, --journal=BLOCKS  journal metadata in BLOCKS "
+			     "blocks\n"
 			     "  -L, --label=LABEL     set filesystem label\n"
 			     "  -U, --uuid=UUID       set filesystem UUID\n"
 			     "  -V, --version         show version and exit\n"
@@ -124,7 +237,7 @@ int main(int argc, char * const * argv)
 			     "\n";
 
 	/* parse arguments */
-	while ((opt = getopt_long(argc, argv, "fqFi:L:U:Vh",
+	while ((opt = getopt_long(argc, argv, "fqFcli:j:L:U:Vh",
 		long_options, NULL)) != -1) {
 		switch (opt) {
 		case 'f':
@@ -139,6 +252,16 @@ int main(int argc, char * const * argv)
 			force = 1;
 			break;
 
+		case 'c':
+			contiguous = 1;
+			break;
+
+		case 'l':
+			/* tables not written can only be found by arithmetic */
+			lazy = 1;
+			contiguous = 1;
+			break;
+
 		case 'i':
 			inode_bitmaps = strtol(optarg, NULL, 10);
 			/*
@@ -155,6 +278,17 @@ int main(int argc, char * const * argv)
 			}
 			break;
 
+		case 'j':
+			journal_blocks = strtoll(optarg, NULL, 10);
+			/* the right side is checked with the device size */
+			if (journal_blocks < WTFS_JOURNAL_MIN_BLOCKS) {
+				fprintf(stderr, "%s: journal too small, at "
+					"least %d blocks\n", argv[0],
+					WTFS_JOURNAL_MIN_BLOCKS);
+				goto error;
+			}
+			break;
+
 		case 'L':
 			label = optarg;
 			if (strnlen(label, WTFS_LABEL_MAX) == WTFS_LABEL_MAX) {
@@ -270,6 +404,16 @@ int main(int argc, char * const * argv)
 		++blk_bitmaps;
 	}
 
+	/* the journal follows the bitmaps, leave some data blocks behind */
+	if (journal_blocks > 0 && blocks < inode_tables + blk_bitmaps +
+		inode_bitmaps + 3 + journal_blocks + WTFS_JOURNAL_MIN_BLOCKS) {
+		fprintf(stderr, "%s: journal too large\n", argv[0]);
+		goto error;
+	}
+
+	plan_layout(&lay, contiguous, lazy, inode_tables, blk_bitmaps,
+		inode_bitmaps, journal_blocks);
+
 	/*
 	 * check if the filesystem is already mounted when option 'force' is
 	 * not specified
@@ -294,25 +438,28 @@ int main(int argc, char * const * argv)
 		goto out;
 	}
 	if (write_super_block(fd, blocks, inode_tables, blk_bitmaps,
-			inode_bitmaps, label, uuid) < 0) {
+			inode_bitmaps, journal_blocks, &lay, label, uuid) < 0) {
 		part = "super block";
 		goto out;
 	}
-	if (write_inode_table(fd, inode_tables) < 0) {
+	if (journal_blocks > 0 && write_journal(fd, lay.journal_first,
+		journal_blocks, uuid) < 0) {
+		part = "journal";
+		goto out;
+	}
+	if (write_inode_table(fd, inode_tables, &lay) < 0) {
 		part = "inode table";
 		goto out;
 	}
-	if (write_block_bitmap(fd, inode_tables, blk_bitmaps,
-		inode_bitmaps) < 0) {
+	if (write_block_bitmap(fd, blk_bitmaps, &lay) < 0) {
 		part = "block bitmap";
 		goto out;
 	}
-	if (write_inode_bitmap(fd, inode_tables, blk_bitmaps,
-			inode_bitmaps) < 0) {
+	if (write_inode_bitmap(fd, inode_bitmaps, &lay) < 0) {
 		part = "inode bitmap";
 		goto out;
 	}
-	if (write_root_dir(fd) < 0) {
+	if (write_root_dir(fd, &lay) < 0) {
 		part = "root directory";
 		goto out;
 	}
@@ -320,9 +467,18 @@ int main(int argc, char * const * argv)
 		if (!quiet) {
 			printf("quick format completed\n");
 		}
-	} else {
-		do_deep_format(fd, blocks, inode_tables, blk_bitmaps,
-			inode_bitmaps, quiet);
+	} else if (do_deep_format(fd, S_ISBLK(stat.st_mode), blocks, &lay,
+		quiet) < 0) {
+		part = "data area";
+		goto out;
+	}
+
+	/* everything above is flushed to the device at once */
+	if (fsync(fd) < 0) {
+		snprintf(err_msg, BUF_SIZE, "%s: unable to sync '%s'",
+			argv[0], argv[optind]);
+		perror(err_msg);
+		goto error;
 	}
 
 	close(fd);
@@ -424,39 +580,201 @@ error:
 	return ret;
 }
 
+/*
+ * decide where the initial metadata go
+ *
+ * blocks 0 and 1 are always the boot loader block and the super block; by
+ * default the first inode table, block bitmap and inode bitmap follow at
+ * fixed blocks, then the root directory, then the rest of each chain, while a
+ * contiguous layout puts each chain in one run of blocks and the root
+ * directory behind them; the journal always comes last
+ *
+ * with lazy inode tables only the first one, holding the root directory, is
+ * written, and the kernel zeroes the rest
+ *
+ * @lay: the layout to fill
+ * @contiguous: whether to lay out each chain contiguously
+ * @lazy: whether to leave inode tables uninitialized
+ * @inode_tables: number of inode tables
+ * @blk_bitmaps: number of block bitmaps
+ * @inode_bitmaps: number of inode bitmaps
+ * @journal_blocks: number of journal blocks
+ */
+static void plan_layout(struct layout * lay, int contiguous, int lazy,
+	uint64_t inode_tables, uint64_t blk_bitmaps, uint64_t inode_bitmaps,
+	uint64_t journal_blocks)
+{
+	lay->contiguous = contiguous;
+	lay->inode_tables_inited = lazy ? 1 : inode_tables;
+	if (contiguous) {
+		lay->inode_table_first = WTFS_RB_INODE_TABLE;
+		lay->block_bitmap_first = lay->inode_table_first +
+			inode_tables;
+		lay->inode_bitmap_first = lay->block_bitmap_first +
+			blk_bitmaps;
+		lay->root_dir = lay->inode_bitmap_first + inode_bitmaps;
+		lay->inode_table_rest = lay->inode_table_first + 1;
+		lay->block_bitmap_rest = lay->block_bitmap_first + 1;
+		lay->inode_bitmap_rest = lay->inode_bitmap_first + 1;
+	} else {
+		lay->inode_table_first = WTFS_RB_INODE_TABLE;
+		lay->block_bitmap_first = WTFS_RB_BLOCK_BITMAP;
+		lay->inode_bitmap_first = WTFS_RB_INODE_BITMAP;
+		lay->root_dir = WTFS_DB_FIRST;
+		lay->inode_table_rest = WTFS_DB_FIRST + 1;
+		lay->block_bitmap_rest = lay->inode_table_rest +
+			inode_tables - 1;
+		lay->inode_bitmap_rest = lay->block_bitmap_rest +
+			blk_bitmaps - 1;
+	}
+	lay->journal_first = inode_tables + blk_bitmaps + inode_bitmaps + 3;
+	lay->data_first = lay->journal_first + journal_blocks;
+}
+
+/*
+ * get the block number of the i-th block of a chain
+ *
+ * @first: block number of the first block
+ * @rest: block number of the second block, the rest following it
+ * @i: position in the chain
+ *
+ * return: the block number
+ */
+static uint64_t chain_block(uint64_t first, uint64_t rest, uint64_t i)
+{
+	return i == 0 ? first : rest + i - 1;
+}
+
+/*
+ * write a chain of linked blocks, gathering blocks that follow each other on
+ * the device into one large write
+ *
+ * @fd: file descriptor of the device
+ * @first: block number of the first block
+ * @rest: block number of the second block, the rest following it
+ * @count: number of blocks in the chain
+ * @nr_write: number of blocks to write from the first one
+ * @fill: fills the data of the i-th block, which is zeroed before
+ * @arg: passed to @fill
+ *
+ * return: 0 on success, error code otherwise
+ */
+static int write_chain(int fd, uint64_t first, uint64_t rest, uint64_t count,
+	uint64_t nr_write, fill_block_t fill, const void * arg)
+{
+	struct wtfs_linked_block * buf = NULL;
+	uint64_t i, pos, start = first, n = 0;
+	int ret = 0;
+
+	if (posix_memalign((void **)&buf, WTFS_BLOCK_SIZE,
+		WRITE_CHUNK_BLOCKS * WTFS_BLOCK_SIZE) != 0) {
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < nr_write; ++i) {
+		pos = chain_block(first, rest, i);
+		/* flush the batch if it is full or this block does not follow */
+		if (n == WRITE_CHUNK_BLOCKS || (n > 0 && pos != start + n)) {
+			if ((ret = write_blocks(fd, buf, start, n)) < 0) {
+				goto out;
+			}
+			n = 0;
+		}
+		if (n == 0) {
+			start = pos;
+		}
+		memset(&buf[n], 0, sizeof(buf[n]));
+		fill(&buf[n], i, arg);
+		buf[n].next = cpu_to_wtfs64(i + 1 < count ?
+			chain_block(first, rest, i + 1) : 0);
+		++n;
+	}
+	if (n > 0) {
+		ret = write_blocks(fd, buf, start, n);
+	}
+
+out:
+	free(buf);
+	return ret;
+}
+
+/*
+ * write blocks to the device, retrying short writes
+ *
+ * @fd: file descriptor of the device
+ * @buf: data of the blocks
+ * @start: first block to write
+ * @count: number of blocks to write
+ *
+ * return: 0 on success, error code otherwise
+ */
+static int write_blocks(int fd, const void * buf, uint64_t start,
+	uint64_t count)
+{
+	size_t len = count * WTFS_BLOCK_SIZE, done = 0;
+	off_t pos = start * WTFS_BLOCK_SIZE;
+	ssize_t n;
+
+	while (done < len) {
+		n = pwrite(fd, (const char *)buf + done, len - done,
+			pos + done);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return -EIO;
+		}
+		done += n;
+	}
+	return 0;
+}
+
 static int write_boot_block(int fd)
 {
 	struct wtfs_data_block block;
 
 	memset(&block, 0, sizeof(block));
-	lseek(fd, WTFS_RB_BOOT * WTFS_BLOCK_SIZE, SEEK_SET);
-	if (write(fd, &block, sizeof(block)) != sizeof(block)) {
-		return -EIO;
-	} else {
-		return 0;
-	}
+	return write_blocks(fd, &block, WTFS_RB_BOOT, 1);
 }
 
 static int write_super_block(int fd, uint64_t blocks, uint64_t inode_tables,
-	uint64_t blk_bitmaps, uint64_t inode_bitmaps,
-	const char * label, uuid_t uuid)
+	uint64_t blk_bitmaps, uint64_t inode_bitmaps, uint64_t journal_blocks,
+	const struct layout * lay, const char * label, uuid_t uuid)
 {
+	/* short symlinks are kept in extended inode records from the start */
+	uint64_t features = WTFS_FEATURE_FAST_SYMLINK;
 	struct wtfs_super_block sb = {
 		.version = cpu_to_wtfs64(WTFS_VERSION),
 		.magic = cpu_to_wtfs64(WTFS_MAGIC),
 		.block_size = cpu_to_wtfs64(WTFS_BLOCK_SIZE),
 		.block_count = cpu_to_wtfs64(blocks),
-		.inode_table_first = cpu_to_wtfs64(WTFS_RB_INODE_TABLE),
+		.inode_table_first = cpu_to_wtfs64(lay->inode_table_first),
 		.inode_table_count = cpu_to_wtfs64(inode_tables),
-		.block_bitmap_first = cpu_to_wtfs64(WTFS_RB_BLOCK_BITMAP),
+		.block_bitmap_first = cpu_to_wtfs64(lay->block_bitmap_first),
 		.block_bitmap_count = cpu_to_wtfs64(blk_bitmaps),
-		.inode_bitmap_first = cpu_to_wtfs64(WTFS_RB_INODE_BITMAP),
+		.inode_bitmap_first = cpu_to_wtfs64(lay->inode_bitmap_first),
 		.inode_bitmap_count = cpu_to_wtfs64(inode_bitmaps),
 		.inode_count = cpu_to_wtfs64(1),
 		.free_block_count = cpu_to_wtfs64(blocks - inode_tables -
-			blk_bitmaps - inode_bitmaps - 3),
+			blk_bitmaps - inode_bitmaps - 3 - journal_blocks),
+		.state = cpu_to_wtfs64(WTFS_STATE_CLEAN),
 	};
 
+	/* the journal starts right behind the other metadata */
+	if (journal_blocks > 0) {
+		features |= WTFS_FEATURE_JOURNAL;
+		sb.journal_first = cpu_to_wtfs64(lay->journal_first);
+		sb.journal_count = cpu_to_wtfs64(journal_blocks);
+	}
+	if (lay->contiguous) {
+		features |= WTFS_FEATURE_CONTIG_META;
+	}
+	if (lay->inode_tables_inited < inode_tables) {
+		features |= WTFS_FEATURE_LAZY_ITABLE;
+	}
+	sb.features = cpu_to_wtfs64(features);
+	sb.inode_table_inited = cpu_to_wtfs64(lay->inode_tables_inited);
+
 	/* set label */
 	if (label != NULL) {
 		memcpy(sb.label, label, strlen(label));
@@ -468,30 +786,80 @@ static int write_super_block(int fd, uint64_t blocks, uint64_t inode_tables,
 	}
 	uuid_copy(sb.uuid, uuid);
 
-	lseek(fd, WTFS_RB_SUPER * WTFS_BLOCK_SIZE, SEEK_SET);
-	if (write(fd, &sb, sizeof(sb)) != sizeof(sb)) {
-		return -EIO;
-	} else {
-		return 0;
+	return write_blocks(fd, &sb, WTFS_RB_SUPER, 1);
+}
+
+/*
+ * write an empty jbd2 journal, which is zeroed in large writes first, so that
+ * no block left by an old journal on the device is taken as a valid one, and
+ * whose first transaction gets a random sequence for the same reason
+ */
+static int write_journal(int fd, uint64_t first, uint64_t journal_blocks,
+	uuid_t uuid)
+{
+	struct wtfs_data_block block;
+	struct jbd2_super_block * jsb = (struct jbd2_super_block *)&block;
+	uint64_t i, count;
+	uint32_t sequence;
+	uuid_t random;
+	void * buf = NULL;
+	int ret = 0;
+
+	if ((buf = calloc(WRITE_CHUNK_BLOCKS, WTFS_BLOCK_SIZE)) == NULL) {
+		return -ENOMEM;
+	}
+	for (i = 0; i < journal_blocks && ret == 0; i += count) {
+		count = journal_blocks - i;
+		count = count > WRITE_CHUNK_BLOCKS ? WRITE_CHUNK_BLOCKS : count;
+		ret = write_blocks(fd, buf, first + i, count);
+	}
+	free(buf);
+	if (ret < 0) {
+		return ret;
 	}
 
-	return 0;
+	uuid_generate_random(random);
+	memcpy(&sequence, random, sizeof(sequence));
+
+	memset(&block, 0, sizeof(block));
+	jsb->h_magic = htobe32(JBD2_MAGIC);
+	jsb->h_blocktype = htobe32(JBD2_SUPERBLOCK_V2);
+	jsb->s_blocksize = htobe32(WTFS_BLOCK_SIZE);
+	jsb->s_maxlen = htobe32(journal_blocks);
+	jsb->s_first = htobe32(1);
+	jsb->s_sequence = htobe32(sequence);
+	jsb->s_start = htobe32(0);
+	jsb->s_nr_users = htobe32(1);
+	uuid_copy(jsb->s_uuid, uuid);
+	uuid_copy(jsb->s_users, uuid);
+
+	return write_blocks(fd, &block, first, 1);
 }
 
 /*
- * pre-build the whole inode table for the device
+ * put the root directory inode in the first inode table
  */
-static int write_inode_table(int fd, uint64_t inode_tables)
+static void fill_inode_table(struct wtfs_linked_block * blk, uint64_t i,
+	const void * arg)
 {
-	/* buffer to write */
-	struct wtfs_inode_table table;
+	if (i == 0) {
+		((struct wtfs_inode_table *)blk)->inodes[0] =
+			*(const struct wtfs_inode *)arg;
+	}
+}
 
+/*
+ * pre-build the whole inode table for the device
+ */
+static int write_inode_table(int fd, uint64_t inode_tables,
+	const struct layout * lay)
+{
 	/* inode for root dir */
 	struct wtfs_inode inode = {
 		.inode_no = cpu_to_wtfs64(WTFS_ROOT_INO),
 		.dir_entry_count = cpu_to_wtfs64(2),
 		.block_count = cpu_to_wtfs64(1),
-		.first_block = cpu_to_wtfs64(WTFS_DB_FIRST),
+		.first_block = cpu_to_wtfs64(lay->root_dir),
 		.atime = cpu_to_wtfs64(time(NULL)),
 		.ctime = cpu_to_wtfs64(time(NULL)),
 		.mtime = cpu_to_wtfs64(time(NULL)),
@@ -500,244 +868,318 @@ static int write_inode_table(int fd, uint64_t inode_tables)
 		.gid = cpu_to_wtfs16(getgid()),
 	};
 
-	/* block number index array */
-	uint64_t * index = NULL;
-	uint64_t i;
-	int ret = -EINVAL;
+	return write_chain(fd, lay->inode_table_first, lay->inode_table_rest,
+		inode_tables, lay->inode_tables_inited, fill_inode_table,
+		&inode);
+}
 
-	/* construct index */
-	index = (uint64_t *)calloc(inode_tables + 1, sizeof(uint64_t));
-	if (index == NULL) {
-		ret = -ENOMEM;
-		goto error;
-	}
-	index[0] = WTFS_RB_INODE_TABLE;
-	for (i = 1; i < inode_tables; ++i) {
-		index[i] = WTFS_DB_FIRST + i;
-	}
+/*
+ * mark all blocks before the data area used in the i-th block bitmap
+ */
+static void fill_block_bitmap(struct wtfs_linked_block * blk, uint64_t i,
+	const void * arg)
+{
+	const struct layout * lay = (const struct layout *)arg;
+	uint64_t lo = i * WTFS_BITMAP_SIZE * 8, used;
 
-	/* write 1st inode table */
-	memset(&table, 0, sizeof(table));
-	table.inodes[0] = inode;
-	table.next = wtfs64_to_cpu(index[1]);
-	lseek(fd, index[0] * WTFS_BLOCK_SIZE, SEEK_SET);
-	if (write(fd, &table, sizeof(table)) != sizeof(table)) {
-		ret = -EIO;
-		goto error;
+	if (lay->data_first <= lo) {
+		return;
 	}
-
-	/* write remaining inode tables */
-	memset(&table, 0, sizeof(table));
-	for (i = 1; i < inode_tables; ++i) {
-		table.next = wtfs64_to_cpu(index[i + 1]);
-		lseek(fd, index[i] * WTFS_BLOCK_SIZE, SEEK_SET);
-		if (write(fd, &table, sizeof(table)) != sizeof(table)) {
-			ret = -EIO;
-			goto error;
-		}
+	used = lay->data_first - lo;
+	if (used >= WTFS_BITMAP_SIZE * 8) {
+		memset(blk->data, 0xff, WTFS_BITMAP_SIZE);
+		return;
 	}
-
-	free(index);
-	return 0;
-
-error:
-	if (index != NULL) {
-		free(index);
+	memset(blk->data, 0xff, used / 8);
+	if (used % 8 != 0) {
+		blk->data[used / 8] = (1 << (used % 8)) - 1;
 	}
-	return ret;
 }
 
 /*
  * since the device size is fixed, we pre-build the whole block bitmap for
  * the device
  */
-static int write_block_bitmap(int fd, uint64_t inode_tables,
-	uint64_t blk_bitmaps, uint64_t inode_bitmaps)
+static int write_block_bitmap(int fd, uint64_t blk_bitmaps,
+	const struct layout * lay)
 {
-	/* full bytes fill 0xff */
-	uint64_t full_bytes = (blk_bitmaps + inode_tables + inode_bitmaps +
-		3) / 8;
+	return write_chain(fd, lay->block_bitmap_first, lay->block_bitmap_rest,
+		blk_bitmaps, blk_bitmaps, fill_block_bitmap, lay);
+}
 
-	/* half byte fills (1 << half_byte) - 1 */
-	uint64_t half_byte = (blk_bitmaps + inode_tables + inode_bitmaps +
-		3) % 8;
+/*
+ * mark inode 0 and the root directory used in the first inode bitmap
+ */
+static void fill_inode_bitmap(struct wtfs_linked_block * blk, uint64_t i,
+	const void * arg)
+{
+	if (i == 0) {
+		blk->data[0] = 0x03;
+	}
+}
 
-	/* last full bitmap */
-	uint64_t full = full_bytes / WTFS_BITMAP_SIZE;
+static int write_inode_bitmap(int fd, uint64_t inode_bitmaps,
+	const struct layout * lay)
+{
+	return write_chain(fd, lay->inode_bitmap_first, lay->inode_bitmap_rest,
+		inode_bitmaps, inode_bitmaps, fill_inode_bitmap, NULL);
+}
 
-	/* full bytes in half-full bitmap */
-	uint64_t half_full = full_bytes % WTFS_BITMAP_SIZE;
+static int write_root_dir(int fd, const struct layout * lay)
+{
+	struct wtfs_dir_block root_blk = {
+		.entries = {
+			[0] = {
+				.inode_no = WTFS_ROOT_INO,
+				.filename = ".",
+			},
+			[1] = {
+				.inode_no = WTFS_ROOT_INO,
+				.filename = "..",
+			},
+		},
+	};
 
-	/* block number index array */
-	uint64_t * index;
-	uint64_t i, j;
-	struct wtfs_bitmap_block bitmap;
-	int ret = -EINVAL;
+	return write_blocks(fd, &root_blk, lay->root_dir, 1);
+}
 
-	/* construct index */
-	index = (uint64_t *)calloc(blk_bitmaps + 1, sizeof(uint64_t));
-	if (index == NULL) {
-		ret = -ENOMEM;
-		goto error;
-	}
-	index[0] = WTFS_RB_BLOCK_BITMAP;
-	for (i = 1; i < blk_bitmaps; ++i) {
-		index[i] = WTFS_DB_FIRST + inode_tables - 1 + i;
-	}
+/*
+ * zero all data blocks after the initial metadata
+ *
+ * on a block device the blocks are discarded first, which is enough if the
+ * device reads discarded blocks back as zeros, otherwise they are zeroed by
+ * BLKZEROOUT; on an image file a hole is punched over them; whatever is left
+ * after these fail is zeroed by large writes, bypassing the page cache when
+ * possible
+ *
+ * @fd: file descriptor of the device
+ * @blkdev: whether @fd is a block device
+ * @blocks: total blocks of the device
+ * @lay: where the initial metadata went
+ * @quiet: print nothing
+ *
+ * return: 0 on success, error code otherwise
+ */
+static int do_deep_format(int fd, int blkdev, uint64_t blocks,
+	const struct layout * lay, int quiet)
+{
+	uint64_t start = lay->data_first;
+	struct format_progress prog = {
+		.total = blocks - start,
+		.quiet = quiet,
+	};
+	int zeroes = 0, ret = -EOPNOTSUPP;
 
-	/* write full block bitmaps */
-	memset(&bitmap, 0xff, sizeof(bitmap));
-	for (i = 0; i < full; ++i) {
-		bitmap.next = cpu_to_wtfs64(index[i + 1]);
-		lseek(fd, index[i] * WTFS_BLOCK_SIZE, SEEK_SET);
-		if (write(fd, &bitmap, sizeof(bitmap)) != sizeof(bitmap)) {
-			ret = -EIO;
-			goto error;
-		}
+	if (!quiet) {
+		printf("total %lu blocks to format\n", prog.total);
+		printf("\rformat complete 0%%");
+		fflush(stdout);
 	}
+	clock_gettime(CLOCK_MONOTONIC, &prog.begin);
 
-	/* write half-full block bitmap */
-	memset(&bitmap, 0, sizeof(bitmap));
-	for (j = 0; j < half_full; ++j) {
-		bitmap.data[j] = 0xff;
+	if (blkdev) {
+		/* discarded blocks may already read back as zeros */
+		if (discard_blocks(fd, start, prog.total) == 0 &&
+			ioctl(fd, BLKDISCARDZEROES, &zeroes) == 0 && zeroes) {
+			report_progress(&prog, prog.total);
+			ret = 0;
+		} else {
+			ret = zero_blocks(fd, ZERO_BY_ZEROOUT, start, &prog);
+		}
+	} else {
+		ret = zero_blocks(fd, ZERO_BY_PUNCH, start, &prog);
 	}
-	bitmap.data[j] = (1 << half_byte) - 1;
-	bitmap.next = cpu_to_wtfs64(index[i + 1]);
-	lseek(fd, index[i] * WTFS_BLOCK_SIZE, SEEK_SET);
-	if (write(fd, &bitmap, sizeof(bitmap)) != sizeof(bitmap)) {
-		ret = -EIO;
-		goto error;
+	/* fall back to writing whatever is not zeroed yet */
+	if (ret < 0) {
+		ret = zero_blocks(fd, ZERO_BY_WRITE, start, &prog);
 	}
-	++i;
 
-	/* write empty bitmaps */
-	memset(&bitmap, 0, sizeof(bitmap));
-	for (; i < blk_bitmaps; ++i) {
-		bitmap.next = cpu_to_wtfs64(index[i + 1]);
-		lseek(fd, index[i] * WTFS_BLOCK_SIZE, SEEK_SET);
-		if (write(fd, &bitmap, sizeof(bitmap)) != sizeof(bitmap)) {
-			ret = -EIO;
-			goto error;
+	if (!quiet) {
+		if (ret < 0) {
+			printf("\ndeep format failed: %s\n", strerror(-ret));
+		} else {
+			printf("\ndeep format completed\n");
 		}
 	}
-
-	free(index);
-	return 0;
-
-error:
-	if (index != NULL) {
-		free(index);
-	}
 	return ret;
 }
 
-static int write_inode_bitmap(int fd, uint64_t inode_tables,
-	uint64_t blk_bitmaps, uint64_t inode_bitmaps)
+/*
+ * discard blocks on a block device
+ *
+ * @fd: file descriptor of the block device
+ * @start: first block to discard
+ * @count: number of blocks to discard
+ *
+ * return: 0 on success, error code otherwise
+ */
+static int discard_blocks(int fd, uint64_t start, uint64_t count)
 {
-	struct wtfs_bitmap_block bitmap = {
-		.data = { 0x03 },
+	uint64_t range[2] = {
+		start * WTFS_BLOCK_SIZE,
+		count * WTFS_BLOCK_SIZE,
 	};
 
-	/* block number index array */
-	uint64_t * index = NULL;
-	uint64_t i;
-	int ret = -EINVAL;
-
-	/* construct index */
-	index = (uint64_t *)calloc(inode_bitmaps + 1, sizeof(uint64_t));
-	if (index == NULL) {
-		ret = -ENOMEM;
-		goto error;
-	}
-	index[0] = WTFS_RB_INODE_BITMAP;
-	for (i = 1; i < inode_bitmaps; ++i) {
-		index[i] = WTFS_RB_INODE_BITMAP + inode_tables + blk_bitmaps -
-			2 + i;
+	if (ioctl(fd, BLKDISCARD, range) < 0) {
+		return -errno;
 	}
+	return 0;
+}
 
-	/* write 1st bitmap */
-	bitmap.next = cpu_to_wtfs64(index[1]);
-	lseek(fd, index[0] * WTFS_BLOCK_SIZE, SEEK_SET);
-	if (write(fd, &bitmap, sizeof(bitmap)) != sizeof(bitmap)) {
-		ret = -EIO;
-		goto error;
+/*
+ * zero the blocks of a deep format not zeroed yet in the given way
+ *
+ * it stops at the first failure, leaving the rest to a slower way
+ *
+ * @fd: file descriptor of the device
+ * @how: the way to zero blocks
+ * @start: first block of the data area
+ * @prog: progress of deep format
+ *
+ * return: 0 on success, error code otherwise
+ */
+static int zero_blocks(int fd, enum zero_method how, uint64_t start,
+	struct format_progress * prog)
+{
+	uint64_t range[2], count;
+	void * buf = NULL;
+	int direct = 0, flags = 0, ret = 0;
+
+	if (how == ZERO_BY_WRITE) {
+		if (posix_memalign(&buf, WTFS_BLOCK_SIZE,
+			WRITE_CHUNK_BLOCKS * WTFS_BLOCK_SIZE) != 0) {
+			return -ENOMEM;
+		}
+		memset(buf, 0, WRITE_CHUNK_BLOCKS * WTFS_BLOCK_SIZE);
+		/* bypass the page cache if we can */
+		flags = fcntl(fd, F_GETFL);
+		if (flags >= 0 && fcntl(fd, F_SETFL, flags | O_DIRECT) == 0) {
+			direct = 1;
+		}
 	}
 
-	/* write remaining bitmaps */
-	memset(&bitmap, 0, sizeof(bitmap));
-	for (i = 1; i < inode_bitmaps; ++i) {
-		bitmap.next = wtfs64_to_cpu(index[i + 1]);
-		lseek(fd, index[i] * WTFS_BLOCK_SIZE, SEEK_SET);
-		if (write(fd, &bitmap, sizeof(bitmap)) != sizeof(bitmap)) {
-			ret = -EIO;
-			goto error;
+	while (prog->done < prog->total) {
+		count = prog->total - prog->done;
+		range[0] = (start + prog->done) * WTFS_BLOCK_SIZE;
+
+		switch (how) {
+		case ZERO_BY_ZEROOUT:
+			count = count > ZERO_CHUNK_BLOCKS ?
+				ZERO_CHUNK_BLOCKS : count;
+			range[1] = count * WTFS_BLOCK_SIZE;
+			if (ioctl(fd, BLKZEROOUT, range) < 0) {
+				ret = -errno;
+			}
+			break;
+
+		case ZERO_BY_PUNCH:
+			count = count > ZERO_CHUNK_BLOCKS ?
+				ZERO_CHUNK_BLOCKS : count;
+			range[1] = count * WTFS_BLOCK_SIZE;
+			if (fallocate(fd, FALLOC_FL_PUNCH_HOLE |
+				FALLOC_FL_KEEP_SIZE, range[0], range[1]) < 0) {
+				ret = -errno;
+			}
+			break;
+
+		case ZERO_BY_WRITE:
+			count = count > WRITE_CHUNK_BLOCKS ?
+				WRITE_CHUNK_BLOCKS : count;
+			ret = write_zero_chunk(fd, buf, start + prog->done,
+				count, &direct);
+			break;
+		}
+		if (ret < 0) {
+			break;
 		}
+		report_progress(prog, count);
 	}
 
-	free(index);
-	return 0;
-
-error:
-	if (index != NULL) {
-		free(index);
+	if (how == ZERO_BY_WRITE) {
+		if (direct) {
+			fcntl(fd, F_SETFL, flags);
+		}
+		free(buf);
 	}
 	return ret;
 }
 
-static int write_root_dir(int fd)
+/*
+ * write a chunk of zeroed blocks
+ *
+ * if a direct write fails with EINVAL, the device or filesystem does not
+ * accept direct I/O of this kind, so drop O_DIRECT and write it buffered
+ *
+ * @fd: file descriptor of the device
+ * @buf: zeroed buffer of at least @count blocks
+ * @start: first block to write
+ * @count: number of blocks to write
+ * @direct: whether @fd has O_DIRECT set, cleared if dropped
+ *
+ * return: 0 on success, error code otherwise
+ */
+static int write_zero_chunk(int fd, void * buf, uint64_t start,
+	uint64_t count, int * direct)
 {
-	struct wtfs_dir_block root_blk = {
-		.entries = {
-			[0] = {
-				.inode_no = WTFS_ROOT_INO,
-				.filename = ".",
-			},
-			[1] = {
-				.inode_no = WTFS_ROOT_INO,
-				.filename = "..",
-			},
-		},
-	};
-
-	lseek(fd, WTFS_DB_FIRST * WTFS_BLOCK_SIZE, SEEK_SET);
-	if (write(fd, &root_blk, sizeof(root_blk)) != sizeof(root_blk)) {
-		return -EIO;
-	} else {
-		return 0;
+	size_t len = count * WTFS_BLOCK_SIZE, done = 0;
+	off_t pos = start * WTFS_BLOCK_SIZE;
+	ssize_t n;
+	int flags;
+
+	while (done < len) {
+		n = pwrite(fd, (char *)buf + done, len - done, pos + done);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n < 0 && errno == EINVAL && *direct) {
+			flags = fcntl(fd, F_GETFL);
+			if (flags < 0 ||
+				fcntl(fd, F_SETFL, flags & ~O_DIRECT) < 0) {
+				return -errno;
+			}
+			*direct = 0;
+			continue;
+		}
+		if (n <= 0) {
+			return n < 0 ? -errno : -EIO;
+		}
+		done += n;
 	}
+	return 0;
 }
 
-static void do_deep_format(int fd, uint64_t blocks, uint64_t inode_tables,
-	uint64_t blk_bitmaps, uint64_t inode_bitmaps, int quiet)
+/*
+ * account zeroed blocks and print percentage and throughput if it changes
+ *
+ * @prog: progress of deep format
+ * @count: number of blocks just zeroed
+ */
+static void report_progress(struct format_progress * prog, uint64_t count)
 {
-	uint64_t start = WTFS_DB_FIRST + inode_tables + blk_bitmaps +
-		inode_bitmaps - 2;
-	uint64_t i, percent, prev = 0;
-	struct wtfs_data_block blk;
+	struct timespec now;
+	uint64_t percent;
+	double secs;
 
-	memset(&blk, 0, sizeof(blk));
-	if (!quiet) {
-		printf("total %lu blocks to format\n", (blocks -= start));
-		printf("\rformat complete 0%%");
-		fflush(stdout);
+	prog->done += count;
+	if (prog->quiet || prog->total == 0) {
+		return;
 	}
-	lseek(fd, start * WTFS_BLOCK_SIZE, SEEK_SET);
-	for (i = 0; i < blocks; ++i) {
-		if (write(fd, &blk, sizeof(blk)) != sizeof(blk)) {
-			break;
-		}
-		if (!quiet) {
-			percent = (i + 1) * 100 / blocks;
-			if (percent > prev) {
-				printf("\rformat complete %lu%%", percent);
-				fflush(stdout);
-				prev = percent;
-			}
-		}
+	percent = prog->done * 100 / prog->total;
+	if (percent <= prog->prev) {
+		return;
 	}
-	if (!quiet) {
-		printf("\ndeep format completed\n");
+	prog->prev = percent;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	secs = (now.tv_sec - prog->begin.tv_sec) +
+		(now.tv_nsec - prog->begin.tv_nsec) / 1e9;
+	if (secs > 0) {
+		printf("\rformat complete %lu%% (%.1f MiB/s)", percent,
+			prog->done * WTFS_BLOCK_SIZE / secs / (1 << 20));
+	} else {
+		printf("\rformat complete %lu%%", percent);
 	}
+	fflush(stdout);
 }
 
 #ifdef __cplusplus
@@ -211,8 +211,9 @@ static int read_boot_block(int fd)
 static int read_super_block(int fd)
 {
 	struct wtfs_super_block sb;
-	uint64_t version;
+	uint64_t version, features;
 	char uuid_buffer[36 + 1];
+	const char * sep = "";
 
 	lseek(fd, WTFS_RB_SUPER * WTFS_BLOCK_SIZE, SEEK_SET);
 	if (read(fd, &sb, sizeof(sb)) != sizeof(sb)) {
@@ -247,6 +248,40 @@ static int read_super_block(int fd)
 		wtfs64_to_cpu(sb.inode_count));
 	printf("%-24s%llu\n", "free blocks:",
 		wtfs64_to_cpu(sb.free_block_count));
+	printf("%-24s%s\n", "state:",
+		wtfs64_to_cpu(sb.state) == WTFS_STATE_CLEAN ? "clean" :
+		"not clean");
+	/* regular files are mapped by extents since v0.7.0 */
+	printf("%-24s%s\n", "file block mapping:",
+		WTFS_VERSION_MINOR(version) >= 7 ||
+		WTFS_VERSION_MAJOR(version) > 0 ? "extent" : "linked list");
+	features = wtfs64_to_cpu(sb.features);
+	printf("%-24s%s", "features:", features == 0 ? "none" : "");
+	if (features & WTFS_FEATURE_JOURNAL) {
+		printf("%sjournal", sep);
+		sep = " ";
+	}
+	if (features & WTFS_FEATURE_CONTIG_META) {
+		printf("%scontiguous", sep);
+		sep = " ";
+	}
+	if (features & WTFS_FEATURE_LAZY_ITABLE) {
+		printf("%slazy_itable", sep);
+		sep = " ";
+	}
+	if (features & WTFS_FEATURE_FAST_SYMLINK) {
+		printf("%sfast_symlink", sep);
+	}
+	printf("\n");
+	if (features & WTFS_FEATURE_LAZY_ITABLE) {
+		printf("%-24s%llu\n", "zeroed inode tables:",
+			wtfs64_to_cpu(sb.inode_table_inited));
+	}
+	if (features & WTFS_FEATURE_JOURNAL) {
+		printf("%-24s%llu blocks at %llu\n", "journal:",
+			wtfs64_to_cpu(sb.journal_count),
+			wtfs64_to_cpu(sb.journal_first));
+	}
 	/* label and UUID are supported since v0.3.0 */
 	if (WTFS_VERSION_MINOR(version) >= 3 ||
 		WTFS_VERSION_MAJOR(version) > 0) {
@@ -285,18 +320,33 @@ static int read_inode_bitmap(int fd)
 
 static int read_root_dir(int fd)
 {
+	struct wtfs_super_block sb;
+	struct wtfs_inode_table table;
 	struct wtfs_dir_block root_blk;
 	int i;
-	uint64_t next = WTFS_DB_FIRST, inode_no;
+	uint64_t first, next, inode_no;
 	const char * filename = NULL;
 
+	/* root directory is the first inode of the first inode table */
+	lseek(fd, WTFS_RB_SUPER * WTFS_BLOCK_SIZE, SEEK_SET);
+	if (read(fd, &sb, sizeof(sb)) != sizeof(sb)) {
+		return -EIO;
+	}
+	lseek(fd, wtfs64_to_cpu(sb.inode_table_first) * WTFS_BLOCK_SIZE,
+		SEEK_SET);
+	if (read(fd, &table, sizeof(table)) != sizeof(table)) {
+		return -EIO;
+	}
+	first = wtfs64_to_cpu(table.inodes[0].first_block);
+
+	next = first;
 	while (next != 0) {
 		lseek(fd, next * WTFS_BLOCK_SIZE, SEEK_SET);
 		if (read(fd, &root_blk, sizeof(root_blk)) != sizeof(root_blk)) {
 			return -EIO;
 		}
 
-		if (next == WTFS_DB_FIRST) {
+		if (next == first) {
 			printf("root directory\n");
 		}
 
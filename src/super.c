@@ -27,7 +27,11 @@
 #include <linux/buffer_head.h>
 #include <linux/blkdev.h>
 #include <linux/slab.h>
+#include <linux/vmalloc.h>
 #include <linux/writeback.h>
+#include <linux/parser.h>
+#include <linux/seq_file.h>
+#include <linux/version.h>
 
 #include "wtfs.h"
 
@@ -63,21 +67,42 @@ static struct file_system_type wtfs_type = {
 static struct inode * wtfs_alloc_inode(struct super_block * vsb);
 static void wtfs_destroy_inode(struct inode * vi);
 static int wtfs_write_inode(struct inode * vi, struct writeback_control * wbc);
+static void wtfs_dirty_inode(struct inode * vi, int flags);
 static void wtfs_evict_inode(struct inode * vi);
 static void wtfs_put_super(struct super_block * vsb);
 static int wtfs_sync_fs(struct super_block * vsb, int wait);
+static int wtfs_remount(struct super_block * vsb, int * flags, char * data);
 static int wtfs_statfs(struct dentry * dentry, struct kstatfs * buf);
+static int wtfs_show_options(struct seq_file * seq, struct dentry * root);
 
 const struct super_operations wtfs_super_ops = {
 	.alloc_inode = wtfs_alloc_inode,
 	.destroy_inode = wtfs_destroy_inode,
 	.write_inode = wtfs_write_inode,
+	.dirty_inode = wtfs_dirty_inode,
 	.evict_inode = wtfs_evict_inode,
 	.put_super = wtfs_put_super,
 	.sync_fs = wtfs_sync_fs,
+	.remount_fs = wtfs_remount,
 	.statfs = wtfs_statfs,
+	.show_options = wtfs_show_options,
 };
 
+/* declaration of internal helper functions */
+static struct buffer_head * __wtfs_update_inode(struct inode * vi);
+static int wtfs_parse_options(struct wtfs_sb_info * sbi, char * options);
+static int wtfs_build_meta_index(struct super_block * vsb, uint64_t first,
+	uint64_t count, uint64_t ** pindex);
+static int wtfs_load_bitmaps(struct super_block * vsb);
+static int wtfs_init_groups(struct super_block * vsb);
+static int wtfs_load_itable_ready(struct super_block * vsb);
+static int wtfs_init_counters(struct super_block * vsb, uint64_t state);
+static void wtfs_free_sb_info(struct wtfs_sb_info * sbi);
+static unsigned long wtfs_rsv_count(struct shrinker * shrink,
+	struct shrink_control * sc);
+static unsigned long wtfs_rsv_scan(struct shrinker * shrink,
+	struct shrink_control * sc);
+
 /********************* implementation of alloc_inode **************************/
 
 /* a slab memory that contains wtfs_inode_info structure */
@@ -101,6 +126,17 @@ static struct inode * wtfs_alloc_inode(struct super_block * vsb)
 	if (info == NULL) {
 		return NULL;
 	} else {
+		info->first_block = 0;
+		info->dir_entry_count = 0;
+		info->loc.blk_no = 0;
+		info->dir_gen = 0;
+		info->last_block = 0;
+		info->extent_cache = RB_ROOT;
+		info->extent_cache_count = 0;
+		RB_CLEAR_NODE(&(info->rsv.node));
+		info->rsv.start = info->rsv.end = 0;
+		info->rsv.size = WTFS_RSV_MIN;
+		info->sync_tid = info->datasync_tid = 0;
 		return &(info->vfs_inode);
 	}
 }
@@ -116,6 +152,13 @@ static void wtfs_i_callback(struct rcu_head * head)
 {
 	struct inode * inode = container_of(head, struct inode, i_rcu);
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 2, 0)
+	/* symlink target cached by get_link, walked under RCU until now */
+	if (S_ISLNK(inode->i_mode)) {
+		kfree(inode->i_link);
+	}
+#endif
+
 	kmem_cache_free(wtfs_inode_cachep, WTFS_INODE_INFO(inode));
 }
 
@@ -142,14 +185,64 @@ static void wtfs_destroy_inode(struct inode * vi)
  * return: 0 on success, error code otherwise
  */
 static int wtfs_write_inode(struct inode * vi, struct writeback_control * wbc)
+{
+	struct buffer_head * bh = NULL;
+	int ret = 0;
+
+	wtfs_debug("write_inode called, inode %lu\n", vi->i_ino);
+
+	/* an unlinked inode is deleted on eviction, its slot may be reused */
+	if (vi->i_nlink == 0) {
+		return 0;
+	}
+
+	/*
+	 * with a journal, the inode has been journaled when it was dirtied, so
+	 * we only wait for the commit, which sync(2) does in sync_fs instead
+	 */
+	if (WTFS_SB_INFO(vi->i_sb)->journal != NULL) {
+		if (wbc->sync_mode != WB_SYNC_ALL || wbc->for_sync) {
+			return 0;
+		}
+		return wtfs_journal_sync_inode(vi, 0);
+	}
+
+	bh = __wtfs_update_inode(vi);
+	if (IS_ERR(bh)) {
+		return PTR_ERR(bh);
+	}
+
+	/* actually do write back */
+	mark_buffer_dirty(bh);
+	if (wbc->sync_mode == WB_SYNC_ALL) {
+		sync_dirty_buffer(bh);
+		if (buffer_req(bh) && !buffer_uptodate(bh)) {
+			wtfs_error("inode %lu sync failed at %s\n", vi->i_ino,
+				vi->i_sb->s_id);
+			ret = -EIO;
+		}
+	}
+
+	/* release the buffer_head read in wtfs_get_inode */
+	brelse(bh);
+	return ret;
+}
+
+/*
+ * internal function used to copy an inode into its inode table in memory
+ *
+ * @vi: the VFS inode structure
+ *
+ * return: buffer_head of the inode table on success, error code otherwise
+ *         it must be released outside after this function being called
+ */
+static struct buffer_head * __wtfs_update_inode(struct inode * vi)
 {
 	struct wtfs_inode_info * info = WTFS_INODE_INFO(vi);
 	struct wtfs_inode * inode = NULL;
 	struct buffer_head * bh = NULL;
 	int ret = -EINVAL;
 
-	wtfs_debug("write_inode called, inode %lu\n", vi->i_ino);
-
 	/*
 	 * get the physical inode
 	 *
@@ -162,6 +255,9 @@ static int wtfs_write_inode(struct inode * vi, struct writeback_control * wbc)
 		ret = PTR_ERR(inode);
 		goto error;
 	}
+	if ((ret = wtfs_journal_access(vi->i_sb, bh)) < 0) {
+		goto error;
+	}
 
 	/* write to the physical inode (still in memory) */
 	inode->inode_no = cpu_to_wtfs64(vi->i_ino);
@@ -185,46 +281,81 @@ static int wtfs_write_inode(struct inode * vi, struct writeback_control * wbc)
 
 	default:
 		wtfs_error("special file type not supported\n");
+		ret = -EINVAL;
 		goto error;
 	}
+	return bh;
 
-	/* actually do write back */
-	mark_buffer_dirty(bh);
-	if (wbc->sync_mode == WB_SYNC_ALL) {
-		sync_dirty_buffer(bh);
-		if (buffer_req(bh) && !buffer_uptodate(bh)) {
-			wtfs_error("inode %lu sync failed at %s\n", vi->i_ino,
-				vi->i_sb->s_id);
-			ret = -EIO;
-			goto error;
-		}
+error:
+	if (bh != NULL) {
+		brelse(bh);
 	}
+	return ERR_PTR(ret);
+}
 
-	/* release the buffer_head read in wtfs_get_inode */
-	brelse(bh);
-	return 0;
+/********************* implementation of dirty_inode **************************/
 
-error:
-	if (bh != NULL) {
+/*
+ * routine called when the VFS marks an inode dirty, with a journal this is
+ * where the inode gets journaled
+ *
+ * @vi: the VFS inode structure
+ * @flags: what of the inode is dirtied
+ */
+static void wtfs_dirty_inode(struct inode * vi, int flags)
+{
+	struct buffer_head * bh = NULL;
+	handle_t * handle = NULL;
+
+	/* without a journal, the inode is written back by write_inode */
+	if (WTFS_SB_INFO(vi->i_sb)->journal == NULL || vi->i_nlink == 0) {
+		return;
+	}
+
+	handle = wtfs_journal_start(vi->i_sb, 1);
+	if (IS_ERR(handle)) {
+		wtfs_error("unable to journal inode %lu\n", vi->i_ino);
+		return;
+	}
+	bh = __wtfs_update_inode(vi);
+	if (!IS_ERR(bh)) {
+		wtfs_journal_dirty_inode(vi, bh, flags & I_DIRTY_DATASYNC);
 		brelse(bh);
 	}
-	return ret;
+	wtfs_journal_stop(handle);
 }
 
 /********************* implementation of evict_inode **************************/
 
 /*
- * routine called when the inode is evicted
+ * routine called when the inode is evicted, which also deletes the inode on
+ * disk if it has been unlinked
  *
  * @vi: the VFS inode structure
  */
 static void wtfs_evict_inode(struct inode * vi)
 {
+	handle_t * handle = NULL;
+
 	wtfs_debug("evict_inode called, inode %lu\n", vi->i_ino);
 
+	/* pages go first so that none is written to freed blocks */
 	truncate_inode_pages(&(vi->i_data), 0);
+	if (vi->i_nlink == 0 && !is_bad_inode(vi)) {
+		handle = wtfs_journal_start(vi->i_sb, WTFS_JOURNAL_CREDITS);
+		if (IS_ERR(handle)) {
+			wtfs_error("unable to delete inode %lu\n", vi->i_ino);
+		} else {
+			wtfs_delete_inode(vi);
+			wtfs_journal_stop(handle);
+		}
+	}
 	invalidate_inode_buffers(vi);
 	clear_inode(vi);
+	if (S_ISREG(vi->i_mode)) {
+		wtfs_drop_extent_cache(vi);
+		wtfs_rsv_release(vi);
+	}
 }
 
 /********************* implementation of put_super ****************************/
@@ -241,7 +372,19 @@ static void wtfs_put_super(struct super_block * vsb)
 	wtfs_debug("put_super called\n");
 
 	if (sbi != NULL) {
-		kfree(sbi);
+		unregister_shrinker(&(sbi->rsv_shrinker));
+		wtfs_stop_itable_thread(sbi);
+		flush_work(&(sbi->unwritten_work));
+
+		/* checkpoint everything before the counters are trusted */
+		wtfs_destroy_journal(sbi);
+
+		/* fold the counters for the last time and mark it clean */
+		if (!(vsb->s_flags & MS_RDONLY)) {
+			sbi->state = WTFS_STATE_CLEAN;
+			wtfs_sync_super(vsb, 1);
+		}
+		wtfs_free_sb_info(sbi);
 		vsb->s_fs_info = NULL;
 	}
 }
@@ -259,11 +402,64 @@ static void wtfs_put_super(struct super_block * vsb)
  */
 static int wtfs_sync_fs(struct super_block * vsb, int wait)
 {
+	int ret;
+
 	wtfs_debug("sync_fs called\n");
 
+	/* group commit whatever has been journaled so far */
+	if ((ret = wtfs_journal_commit(vsb, wait)) < 0) {
+		return ret;
+	}
 	return wtfs_sync_super(vsb, wait);
 }
 
+/********************* implementation of remount_fs ***************************/
+
+/*
+ * routine called when the filesystem is remounted, where only switching
+ * between read-only and read-write is supported, and other mount options stay
+ * as they were
+ *
+ * going read-only, the inode table thread is stopped and the journal is
+ * committed and checkpointed before the super block is marked clean; going
+ * read-write, the super block is marked dirty again and the thread restarted
+ *
+ * @vsb: the VFS super block structure
+ * @flags: the new mount flags
+ * @data: mount options
+ *
+ * return: 0 on success, error code otherwise
+ */
+static int wtfs_remount(struct super_block * vsb, int * flags, char * data)
+{
+	struct wtfs_sb_info * sbi = WTFS_SB_INFO(vsb);
+	int ret;
+
+	wtfs_debug("remount_fs called\n");
+
+	sync_filesystem(vsb);
+	if ((*flags & MS_RDONLY) == (vsb->s_flags & MS_RDONLY)) {
+		return 0;
+	}
+
+	if (*flags & MS_RDONLY) {
+		wtfs_stop_itable_thread(sbi);
+		if ((ret = wtfs_journal_flush(vsb)) < 0) {
+			return ret;
+		}
+		sbi->state = WTFS_STATE_CLEAN;
+		return wtfs_sync_super(vsb, 1);
+	}
+
+	/* counters on disk are stale again from now on */
+	sbi->state = WTFS_STATE_DIRTY;
+	if ((ret = wtfs_sync_super(vsb, 1)) < 0) {
+		return ret;
+	}
+	wtfs_start_itable_thread(vsb);
+	return 0;
+}
+
 /********************* implementation of statfs *******************************/
 
 /*
@@ -291,17 +487,20 @@ static int wtfs_statfs(struct dentry * dentry, struct kstatfs * buf)
 
 	/*
 	 * free block & available block count
-	 * they should be the same
+	 * they should be the same, and blocks promised to delayed writes are
+	 * not free any more
 	 */
-	buf->f_bfree = sbi->free_block_count;
-	buf->f_bavail = sbi->free_block_count;
+	buf->f_bfree = percpu_counter_sum_positive(&(sbi->free_block_count));
+	buf->f_bfree -= wtfs_min(buf->f_bfree,
+		percpu_counter_sum_positive(&(sbi->delayed_block_count)));
+	buf->f_bavail = buf->f_bfree;
 
 	/* inode count */
-	buf->f_files = sbi->inode_count;
+	buf->f_files = percpu_counter_sum_positive(&(sbi->inode_count));
 
 	/* free inode count */
 	buf->f_ffree = sbi->inode_bitmap_count * WTFS_BITMAP_SIZE * 8 -
-		sbi->inode_count;
+		buf->f_files;
 
 	/* high & low 32 bits of device id */
 	buf->f_fsid.val[0] = (u32)id;
@@ -313,8 +512,468 @@ static int wtfs_statfs(struct dentry * dentry, struct kstatfs * buf)
 	return 0;
 }
 
+/********************* implementation of show_options *************************/
+
+/*
+ * routine called by the VFS to show mount options for /proc/mounts
+ *
+ * @seq: the seq_file to write to
+ * @root: root dentry of this wtfs instance
+ *
+ * return: 0
+ */
+static int wtfs_show_options(struct seq_file * seq, struct dentry * root)
+{
+	struct wtfs_sb_info * sbi = WTFS_SB_INFO(root->d_sb);
+
+	if (sbi->options & WTFS_OPT_PIN_BITMAPS) {
+		seq_puts(seq, ",pin_bitmaps");
+	}
+	if (sbi->options & WTFS_OPT_DIR_INDEX) {
+		seq_puts(seq, ",dir_index");
+	}
+	return 0;
+}
+
+/********************* implementation of reservation shrinker *****************/
+
+/*
+ * callback function called under memory pressure to count reservation windows
+ *
+ * @shrink: the shrinker in sb_info
+ * @sc: the shrink control
+ *
+ * return: count of reservation windows
+ */
+static unsigned long wtfs_rsv_count(struct shrinker * shrink,
+	struct shrink_control * sc)
+{
+	struct wtfs_sb_info * sbi = container_of(shrink, struct wtfs_sb_info,
+		rsv_shrinker);
+
+	return sbi->rsv_count;
+}
+
+/*
+ * callback function called under memory pressure to drop reservation windows,
+ * so that writeback can allocate blocks wherever it finds them
+ *
+ * @shrink: the shrinker in sb_info
+ * @sc: the shrink control
+ *
+ * return: count of reservation windows dropped, or SHRINK_STOP
+ */
+static unsigned long wtfs_rsv_scan(struct shrinker * shrink,
+	struct shrink_control * sc)
+{
+	struct wtfs_sb_info * sbi = container_of(shrink, struct wtfs_sb_info,
+		rsv_shrinker);
+	unsigned long dropped;
+
+	/* rsv_lock is never held while memory is allocated */
+	spin_lock(&(sbi->rsv_lock));
+	dropped = wtfs_rsv_drop(sbi, sc->nr_to_scan);
+	spin_unlock(&(sbi->rsv_lock));
+	return dropped;
+}
+
 /********************* implementation of fill_super ***************************/
 
+/* tokens of mount options */
+enum {
+	Opt_pin_bitmaps,
+	Opt_dir_index,
+	Opt_err,
+};
+
+static const match_table_t wtfs_tokens = {
+	{ Opt_pin_bitmaps, "pin_bitmaps" },
+	{ Opt_dir_index, "dir_index" },
+	{ Opt_err, NULL },
+};
+
+/*
+ * parse mount options
+ *
+ * @sbi: the sb_info to store options
+ * @options: mount options separated by commas, can be NULL
+ *
+ * return: 0 on success, error code otherwise
+ */
+static int wtfs_parse_options(struct wtfs_sb_info * sbi, char * options)
+{
+	substring_t args[MAX_OPT_ARGS];
+	char * p = NULL;
+
+	if (options == NULL) {
+		return 0;
+	}
+
+	while ((p = strsep(&options, ",")) != NULL) {
+		if (*p == '\0') {
+			continue;
+		}
+		switch (match_token(p, wtfs_tokens, args)) {
+		case Opt_pin_bitmaps:
+			sbi->options |= WTFS_OPT_PIN_BITMAPS;
+			break;
+
+		case Opt_dir_index:
+			sbi->options |= WTFS_OPT_DIR_INDEX;
+			break;
+
+		default:
+			wtfs_error("unrecognized mount option '%s'\n", p);
+			return -EINVAL;
+		}
+	}
+	return 0;
+}
+
+/*
+ * build the index of a metadata chain by walking it once
+ *
+ * a contiguous chain needs no index, so it is only checked against the volume
+ * and its index is left NULL
+ *
+ * @vsb: the VFS super block structure
+ * @first: block number of the first block
+ * @count: count of blocks in the chain
+ * @pindex: place to store the index
+ *
+ * return: 0 on success, error code otherwise
+ */
+static int wtfs_build_meta_index(struct super_block * vsb, uint64_t first,
+	uint64_t count, uint64_t ** pindex)
+{
+	struct wtfs_sb_info * sbi = WTFS_SB_INFO(vsb);
+	uint64_t * index = NULL;
+
+	*pindex = NULL;
+	if (sbi->features & WTFS_FEATURE_CONTIG_META) {
+		if (count == 0 || first < WTFS_RB_INODE_TABLE ||
+			first >= sbi->block_count ||
+			count > sbi->block_count - first) {
+			wtfs_error("invalid metadata run of %llu blocks at "
+				"%llu\n", count, first);
+			return -EINVAL;
+		}
+		return 0;
+	}
+
+	index = wtfs_build_linked_index(vsb, first, count);
+	if (IS_ERR(index)) {
+		return PTR_ERR(index);
+	}
+	*pindex = index;
+	return 0;
+}
+
+/*
+ * walk the bitmap chains once to build their indices, and pin all bitmaps in
+ * memory if required
+ *
+ * contiguous bitmaps are read ahead as a whole, as all of them are read right
+ * after this to count their free bits
+ *
+ * @vsb: the VFS super block structure
+ *
+ * return: 0 on success, error code otherwise
+ */
+static int wtfs_load_bitmaps(struct super_block * vsb)
+{
+	struct wtfs_sb_info * sbi = WTFS_SB_INFO(vsb);
+	struct buffer_head ** bhs = NULL;
+	uint64_t i;
+	int ret;
+
+	ret = wtfs_build_meta_index(vsb, sbi->block_bitmap_first,
+		sbi->block_bitmap_count, &(sbi->block_bitmap_index));
+	if (ret < 0) {
+		return ret;
+	}
+	ret = wtfs_build_meta_index(vsb, sbi->inode_bitmap_first,
+		sbi->inode_bitmap_count, &(sbi->inode_bitmap_index));
+	if (ret < 0) {
+		return ret;
+	}
+
+	if (sbi->features & WTFS_FEATURE_CONTIG_META) {
+		for (i = 0; i < sbi->block_bitmap_count; ++i) {
+			sb_breadahead(vsb, sbi->block_bitmap_first + i);
+		}
+		for (i = 0; i < sbi->inode_bitmap_count; ++i) {
+			sb_breadahead(vsb, sbi->inode_bitmap_first + i);
+		}
+	}
+
+	if (!(sbi->options & WTFS_OPT_PIN_BITMAPS)) {
+		return 0;
+	}
+
+	/* pin block bitmaps */
+	bhs = vzalloc(sbi->block_bitmap_count * sizeof(*bhs));
+	if (bhs == NULL) {
+		return -ENOMEM;
+	}
+	sbi->block_bitmap_bh = bhs;
+	for (i = 0; i < sbi->block_bitmap_count; ++i) {
+		bhs[i] = sb_bread(vsb, wtfs_meta_block(sbi->block_bitmap_index,
+			sbi->block_bitmap_first, i));
+		if (bhs[i] == NULL) {
+			wtfs_error("unable to read the block bitmap %llu\n", i);
+			return -EIO;
+		}
+	}
+
+	/* pin inode bitmaps */
+	bhs = vzalloc(sbi->inode_bitmap_count * sizeof(*bhs));
+	if (bhs == NULL) {
+		return -ENOMEM;
+	}
+	sbi->inode_bitmap_bh = bhs;
+	for (i = 0; i < sbi->inode_bitmap_count; ++i) {
+		bhs[i] = sb_bread(vsb, wtfs_meta_block(sbi->inode_bitmap_index,
+			sbi->inode_bitmap_first, i));
+		if (bhs[i] == NULL) {
+			wtfs_error("unable to read the inode bitmap %llu\n", i);
+			return -EIO;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * set up the allocation groups of a bitmap chain, counting their free bits
+ *
+ * @vsb: the VFS super block structure
+ * @entry: block number of the first bitmap
+ * @total: count of bitmaps
+ * @limit: count of objects the bitmaps state
+ *
+ * return: the array of groups on success, error code otherwise
+ */
+static struct wtfs_group * __wtfs_init_groups(struct super_block * vsb,
+	uint64_t entry, uint64_t total, uint64_t limit)
+{
+	struct wtfs_group * groups = NULL;
+	struct buffer_head * bh = NULL;
+	uint64_t i, valid;
+
+	if ((groups = vmalloc(total * sizeof(*groups))) == NULL) {
+		return ERR_PTR(-ENOMEM);
+	}
+	for (i = 0; i < total; ++i) {
+		bh = wtfs_get_bitmap_block(vsb, entry, i);
+		if (IS_ERR(bh)) {
+			vfree(groups);
+			return ERR_CAST(bh);
+		}
+		valid = wtfs_min(limit - i * WTFS_BITMAP_SIZE * 8,
+			WTFS_BITMAP_SIZE * 8);
+		spin_lock_init(&(groups[i].lock));
+		groups[i].free = valid - wtfs_bitmap_weight(bh->b_data, valid);
+		brelse(bh);
+	}
+	return groups;
+}
+
+/*
+ * set up an allocation group for every block/inode bitmap, whose free bits
+ * are counted so that the allocator can skip full bitmaps without reading
+ * them, the per-CPU cursors of block allocation and the maps of dirty bitmaps
+ *
+ * @vsb: the VFS super block structure
+ *
+ * return: 0 on success, error code otherwise
+ */
+static int wtfs_init_groups(struct super_block * vsb)
+{
+	struct wtfs_sb_info * sbi = WTFS_SB_INFO(vsb);
+	int cpu, ret;
+
+	sbi->block_groups = __wtfs_init_groups(vsb, sbi->block_bitmap_first,
+		sbi->block_bitmap_count, sbi->block_count);
+	if (IS_ERR(sbi->block_groups)) {
+		ret = PTR_ERR(sbi->block_groups);
+		sbi->block_groups = NULL;
+		return ret;
+	}
+	sbi->inode_groups = __wtfs_init_groups(vsb, sbi->inode_bitmap_first,
+		sbi->inode_bitmap_count,
+		sbi->inode_bitmap_count * WTFS_BITMAP_SIZE * 8);
+	if (IS_ERR(sbi->inode_groups)) {
+		ret = PTR_ERR(sbi->inode_groups);
+		sbi->inode_groups = NULL;
+		return ret;
+	}
+
+	/* each CPU starts in a group of its own as far as there are enough */
+	sbi->block_alloc_rotor = alloc_percpu(uint64_t);
+	if (sbi->block_alloc_rotor == NULL) {
+		return -ENOMEM;
+	}
+	for_each_possible_cpu(cpu) {
+		*per_cpu_ptr(sbi->block_alloc_rotor, cpu) =
+			(uint64_t)cpu * sbi->block_bitmap_count / nr_cpu_ids *
+			WTFS_BITMAP_SIZE * 8;
+	}
+
+	sbi->block_bitmap_dirty = vzalloc(sizeof(unsigned long) *
+		BITS_TO_LONGS(sbi->block_bitmap_count));
+	sbi->inode_bitmap_dirty = vzalloc(sizeof(unsigned long) *
+		BITS_TO_LONGS(sbi->inode_bitmap_count));
+	if (sbi->block_bitmap_dirty == NULL || sbi->inode_bitmap_dirty == NULL) {
+		return -ENOMEM;
+	}
+	return 0;
+}
+
+/*
+ * set up the map of initialized inode tables, where all tables before the
+ * watermark in the super block and those holding inodes in use are initialized
+ *
+ * @vsb: the VFS super block structure
+ *
+ * return: 0 on success, error code otherwise
+ */
+static int wtfs_load_itable_ready(struct super_block * vsb)
+{
+	struct wtfs_sb_info * sbi = WTFS_SB_INFO(vsb);
+
+	/* the first table holds the root directory, so it is never left */
+	sbi->inode_table_inited = wtfs_max(wtfs_min(sbi->inode_table_inited,
+		sbi->inode_table_count), 1);
+	sbi->inode_table_ready = vzalloc(sizeof(unsigned long) *
+		BITS_TO_LONGS(sbi->inode_table_count));
+	if (sbi->inode_table_ready == NULL) {
+		return -ENOMEM;
+	}
+	bitmap_set(sbi->inode_table_ready, 0, sbi->inode_table_inited);
+	return wtfs_scan_inode_tables(vsb);
+}
+
+/*
+ * set up the in-memory inode and free block counters, and mark the super block
+ * dirty on disk until a clean unmount
+ *
+ * the counters come from the super block if it was cleanly unmounted, and are
+ * rebuilt from the free bits of bitmaps otherwise
+ *
+ * @vsb: the VFS super block structure
+ * @state: the state recorded in the super block on disk
+ *
+ * return: 0 on success, error code otherwise
+ */
+static int wtfs_init_counters(struct super_block * vsb, uint64_t state)
+{
+	struct wtfs_sb_info * sbi = WTFS_SB_INFO(vsb);
+	struct wtfs_super_block * sb = NULL;
+	struct buffer_head * bh = NULL;
+	uint64_t inode_count, free_block_count, i;
+	int ret;
+
+	if ((bh = sb_bread(vsb, WTFS_RB_SUPER)) == NULL) {
+		wtfs_error("unable to read the super block\n");
+		return -EIO;
+	}
+	sb = (struct wtfs_super_block *)bh->b_data;
+	inode_count = wtfs64_to_cpu(sb->inode_count);
+	free_block_count = wtfs64_to_cpu(sb->free_block_count);
+	brelse(bh);
+
+	if (state != WTFS_STATE_CLEAN) {
+		wtfs_info("not cleanly unmounted, recounting inodes and "
+			"free blocks\n");
+		free_block_count = 0;
+		for (i = 0; i < sbi->block_bitmap_count; ++i) {
+			free_block_count += sbi->block_groups[i].free;
+		}
+		/* inode 0 is reserved and not counted */
+		inode_count = sbi->inode_bitmap_count * WTFS_BITMAP_SIZE * 8 - 1;
+		for (i = 0; i < sbi->inode_bitmap_count; ++i) {
+			inode_count -= sbi->inode_groups[i].free;
+		}
+	}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 18, 0)
+	ret = percpu_counter_init(&(sbi->inode_count), inode_count,
+		GFP_KERNEL);
+	if (ret == 0) {
+		ret = percpu_counter_init(&(sbi->free_block_count),
+			free_block_count, GFP_KERNEL);
+	}
+	if (ret == 0) {
+		ret = percpu_counter_init(&(sbi->delayed_block_count), 0,
+			GFP_KERNEL);
+	}
+#else
+	ret = percpu_counter_init(&(sbi->inode_count), inode_count);
+	if (ret == 0) {
+		ret = percpu_counter_init(&(sbi->free_block_count),
+			free_block_count);
+	}
+	if (ret == 0) {
+		ret = percpu_counter_init(&(sbi->delayed_block_count), 0);
+	}
+#endif
+	if (ret < 0) {
+		return ret;
+	}
+
+	/* counters on disk are stale from now on */
+	sbi->state = WTFS_STATE_DIRTY;
+	if (!(vsb->s_flags & MS_RDONLY)) {
+		return wtfs_sync_super(vsb, 1);
+	}
+	return 0;
+}
+
+/*
+ * release an sb_info and everything it holds
+ *
+ * @sbi: the sb_info to free
+ */
+static void wtfs_free_sb_info(struct wtfs_sb_info * sbi)
+{
+	uint64_t i;
+
+	wtfs_stop_itable_thread(sbi);
+	wtfs_destroy_journal(sbi);
+	if (sbi->block_bitmap_bh != NULL) {
+		for (i = 0; i < sbi->block_bitmap_count; ++i) {
+			if (sbi->block_bitmap_bh[i] != NULL) {
+				brelse(sbi->block_bitmap_bh[i]);
+			}
+		}
+		vfree(sbi->block_bitmap_bh);
+	}
+	if (sbi->inode_bitmap_bh != NULL) {
+		for (i = 0; i < sbi->inode_bitmap_count; ++i) {
+			if (sbi->inode_bitmap_bh[i] != NULL) {
+				brelse(sbi->inode_bitmap_bh[i]);
+			}
+		}
+		vfree(sbi->inode_bitmap_bh);
+	}
+	percpu_counter_destroy(&(sbi->inode_count));
+	percpu_counter_destroy(&(sbi->free_block_count));
+	percpu_counter_destroy(&(sbi->delayed_block_count));
+	vfree(sbi->block_groups);
+	vfree(sbi->inode_groups);
+	if (sbi->block_alloc_rotor != NULL) {
+		free_percpu(sbi->block_alloc_rotor);
+	}
+	vfree(sbi->block_bitmap_dirty);
+	vfree(sbi->inode_bitmap_dirty);
+	vfree(sbi->block_bitmap_index);
+	vfree(sbi->inode_bitmap_index);
+	vfree(sbi->inode_table_index);
+	vfree(sbi->inode_table_ready);
+	kfree(sbi);
+}
+
 /*
  * routine called to fill information of wtfs into the VFS super block
  *
@@ -358,7 +1017,15 @@ static int wtfs_fill_super(struct super_block * vsb, void * data, int silent)
 
 	/* do version relevant stuffs */
 	if (wtfs64_to_cpu(sb->version) != WTFS_VERSION) {
-		/* ... */
+		/*
+		 * regular files are mapped by extents since 0.7.0, we cannot
+		 * read the block chains of older versions any more
+		 */
+		if (wtfs64_to_cpu(sb->version) < WTFS_GET_VERSION(0, 7, 0)) {
+			wtfs_error("version 0x%llx not supported, "
+				"please reformat\n", wtfs64_to_cpu(sb->version));
+			goto error;
+		}
 	}
 
 	/* allocate a memory for sb_info */
@@ -380,14 +1047,74 @@ static int wtfs_fill_super(struct super_block * vsb, void * data, int silent)
 	sbi->block_bitmap_count = wtfs64_to_cpu(sb->block_bitmap_count);
 	sbi->inode_bitmap_first = wtfs64_to_cpu(sb->inode_bitmap_first);
 	sbi->inode_bitmap_count = wtfs64_to_cpu(sb->inode_bitmap_count);
-	sbi->inode_count = wtfs64_to_cpu(sb->inode_count);
-	sbi->free_block_count = wtfs64_to_cpu(sb->free_block_count);
+	sbi->features = wtfs64_to_cpu(sb->features);
+	sbi->journal_first = wtfs64_to_cpu(sb->journal_first);
+	sbi->journal_count = wtfs64_to_cpu(sb->journal_count);
+	sbi->inode_table_inited = wtfs64_to_cpu(sb->inode_table_inited);
+	mutex_init(&(sbi->itable_mutex));
+	spin_lock_init(&(sbi->rsv_lock));
+	spin_lock_init(&(sbi->unwritten_lock));
+	INIT_WORK(&(sbi->unwritten_work), wtfs_end_unwritten);
+	sbi->rsv_root = RB_ROOT;
+
+	/* parse mount options */
+	if ((ret = wtfs_parse_options(sbi, data)) < 0) {
+		goto error;
+	}
 
 	/* fill the VFS super block */
 	vsb->s_magic = sbi->magic;
+	vsb->s_maxbytes = min_t(loff_t, MAX_LFS_FILESIZE, WTFS_MAX_FILE_SIZE);
 	vsb->s_fs_info = sbi;
 	vsb->s_op = &wtfs_super_ops;
 
+	/* we cannot keep features we do not know consistent */
+	if (sbi->features & ~WTFS_FEATURE_ALL) {
+		wtfs_error("unknown features 0x%llx\n",
+			sbi->features & ~WTFS_FEATURE_ALL);
+		ret = -EINVAL;
+		goto error;
+	}
+
+	/* replay the journal before any metadata is read */
+	if (sbi->features & WTFS_FEATURE_JOURNAL) {
+		if ((ret = wtfs_load_journal(vsb)) < 0) {
+			goto error;
+		}
+	}
+
+	/* walk the inode table chain once so that inodes can be read directly */
+	ret = wtfs_build_meta_index(vsb, sbi->inode_table_first,
+		sbi->inode_table_count, &(sbi->inode_table_index));
+	if (ret < 0) {
+		goto error;
+	}
+
+	/* do the same for bitmaps */
+	if ((ret = wtfs_load_bitmaps(vsb)) < 0) {
+		goto error;
+	}
+
+	/* tables left uninitialized can only be found by arithmetic */
+	if (sbi->features & WTFS_FEATURE_LAZY_ITABLE) {
+		if (!(sbi->features & WTFS_FEATURE_CONTIG_META)) {
+			wtfs_error("lazy inode tables must be contiguous\n");
+			ret = -EINVAL;
+			goto error;
+		}
+		if ((ret = wtfs_load_itable_ready(vsb)) < 0) {
+			goto error;
+		}
+	}
+	if ((ret = wtfs_init_groups(vsb)) < 0) {
+		goto error;
+	}
+
+	/* set up counters, recounting them if the last unmount was unclean */
+	if ((ret = wtfs_init_counters(vsb, wtfs64_to_cpu(sb->state))) < 0) {
+		goto error;
+	}
+
 	/* get the root inode from inode cache */
 	root_inode = wtfs_iget(vsb, WTFS_ROOT_INO);
 	if (IS_ERR(root_inode)) {
@@ -398,6 +1125,21 @@ static int wtfs_fill_super(struct super_block * vsb, void * data, int silent)
 	/* make root dentry */
 	if ((vsb->s_root = d_make_root(root_inode)) == NULL) {
 		wtfs_error("make root dentry failed\n");
+		ret = -ENOMEM;
+		goto error;
+	}
+
+	/* zero the inode tables left by mkfs in the background */
+	if (!(vsb->s_flags & MS_RDONLY)) {
+		wtfs_start_itable_thread(vsb);
+	}
+
+	/* let memory pressure take reservation windows back */
+	sbi->rsv_shrinker.count_objects = wtfs_rsv_count;
+	sbi->rsv_shrinker.scan_objects = wtfs_rsv_scan;
+	sbi->rsv_shrinker.seeks = DEFAULT_SEEKS;
+	if ((ret = register_shrinker(&(sbi->rsv_shrinker))) < 0) {
+		wtfs_error("unable to register the shrinker\n");
 		goto error;
 	}
 
@@ -409,7 +1151,8 @@ error:
 		brelse(bh);
 	}
 	if (sbi != NULL) {
-		kfree(sbi);
+		wtfs_free_sb_info(sbi);
+		vsb->s_fs_info = NULL;
 	}
 	return ret;
 }
@@ -470,6 +1213,7 @@ static void init_once(void * data)
 {
 	struct wtfs_inode_info * info = (struct wtfs_inode_info *)data;
 
+	mutex_init(&(info->extent_mutex));
 	inode_init_once(&(info->vfs_inode));
 }
 
@@ -512,6 +1256,9 @@ static int __init wtfs_init(void)
 	if ((ret = create_inode_cache()) != 0) {
 		goto error;
 	}
+	if ((ret = wtfs_create_extent_cache()) != 0) {
+		goto error;
+	}
 
 	/* register wtfs */
 	if ((ret = register_filesystem(&wtfs_type)) == 0) {
@@ -527,6 +1274,7 @@ error:
 	if (wtfs_inode_cachep != NULL) {
 		destroy_inode_cache();
 	}
+	wtfs_destroy_extent_cache();
 	return ret;
 }
 
@@ -542,6 +1290,7 @@ static void __exit wtfs_exit(void)
 	/* unregister wtfs */
 	unregister_filesystem(&wtfs_type);
 
-	/* destroy inode cache */
+	/* destroy inode and extent caches */
 	destroy_inode_cache();
+	wtfs_destroy_extent_cache();
 }
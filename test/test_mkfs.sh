@@ -223,6 +223,107 @@ function test_uuid {
 	return 0
 }
 
+# test the option 'j', 'journal'
+function test_journal {
+	local first=""
+	local magic=""
+
+	# normal case
+	"$mkfs" -fq -j 4096 "$wtfs_img"
+	if (( $? != 0 )); then
+		return 2
+	fi
+	first=`od -An -tu8 -j4256 -N8 "$wtfs_img" | tr -d ' '`
+	if [[ -z "$first" ]] || (( first <= 1 )); then
+		return 1
+	fi
+	magic=`tail -c+$(( first * 4096 + 1 )) "$wtfs_img" | head -c4 | xxd -ps`
+	if [[ "$magic" != "c03b3998" ]]; then
+		return 1
+	fi
+
+	# journal too small
+	"$mkfs" -fq -j 100 "$wtfs_img" 2> /dev/null
+	if (( $? == 0 )); then
+		return 1
+	fi
+
+	# journal too large
+	"$mkfs" -fq -j 1000000 "$wtfs_img" 2> /dev/null
+	if (( $? == 0 )); then
+		return 1
+	fi
+
+	return 0
+}
+
+# test the option 'c', 'contiguous'
+function test_contiguous {
+	local tables=""
+	local first=""
+	local features=""
+
+	"$mkfs" -fqc "$wtfs_img"
+	if (( $? != 0 )); then
+		return 2
+	fi
+
+	# block bitmaps follow all inode tables from block 2
+	tables=`od -An -tu8 -j4136 -N8 "$wtfs_img" | tr -d ' '`
+	first=`od -An -tu8 -j4144 -N8 "$wtfs_img" | tr -d ' '`
+	if (( first != tables + 2 )); then
+		return 1
+	fi
+	features=`od -An -tu8 -j4248 -N8 "$wtfs_img" | tr -d ' '`
+	if (( (features & 2) == 0 )); then
+		return 1
+	fi
+
+	return 0
+}
+
+# test the option 'l', 'lazy-itable'
+function test_lazy_itable {
+	local features=""
+	local inited=""
+
+	"$mkfs" -fql "$wtfs_img"
+	if (( $? != 0 )); then
+		return 2
+	fi
+
+	# lazy inode tables come with the contiguous layout
+	features=`od -An -tu8 -j4248 -N8 "$wtfs_img" | tr -d ' '`
+	if (( (features & 6) != 6 )); then
+		return 1
+	fi
+	# only the table holding the root directory is written
+	inited=`od -An -tu8 -j4272 -N8 "$wtfs_img" | tr -d ' '`
+	if (( inited != 1 )); then
+		return 1
+	fi
+
+	return 0
+}
+
+# test the features set without any option
+function test_features {
+	local features=""
+
+	"$mkfs" -fq "$wtfs_img"
+	if (( $? != 0 )); then
+		return 2
+	fi
+
+	# fast symlinks are always on, the others need their options
+	features=`od -An -tu8 -j4248 -N8 "$wtfs_img" | tr -d ' '`
+	if (( features != 8 )); then
+		return 1
+	fi
+
+	return 0
+}
+
 # test the option 'V', 'version'
 function test_version {
 	# no need
@@ -256,6 +357,7 @@ fi
 tests=(
 	test_fast test_quiet test_force
 	test_imaps test_label test_uuid
+	test_journal test_contiguous test_lazy_itable test_features
 	test_version test_help
 )
 skipped=0
@@ -193,6 +193,19 @@ function test_free_blks {
 	return $?
 }
 
+# test state in output, a newly formatted volume is always clean
+function test_state {
+	local grep_state='grep -Po (?<=state:\s{18}).*'
+
+	local output_state=`cat "$stdout" | $grep_state`
+	if [[ "$output_state" != "clean" ]]; then
+		printf "clean\n"
+		printf "$output_state\n"
+		return 1
+	fi
+	return 0
+}
+
 # test label in output
 function test_label {
 	local grep_label='grep -Pzo (?<=label:\s{18})(.|\n)*(?=\nUUID:\s{19})'
@@ -271,7 +284,7 @@ fi
 tests=(
 	test_version test_magic test_blk_size test_total_blks
 	test_itables test_bmaps	test_imaps test_total_inodes test_free_blks
-	test_label test_uuid test_root_dir
+	test_state test_label test_uuid test_root_dir
 )
 skipped=0
 for part in ${tests[@]}; do